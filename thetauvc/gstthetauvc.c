@@ -21,8 +21,13 @@
 #include "config.h"
 #endif
 
+/* gst_tracer_register() and the tracing hooks */
+#define GST_USE_UNSTABLE_API
 #include <gst/gst.h>
 #include "gstthetauvcsrc.h"
+#include "gstthetauvcshmsrc.h"
+#include "gstthetauvcdeviceprovider.h"
+#include "gstthetauvclatency.h"
 #if defined(WITH_TRANSFORM_FILTER)
 #include "gstthetatransform.h"
 #endif
@@ -32,6 +37,15 @@ plugin_init(GstPlugin * plugin)
 {
     if (!gst_element_register(plugin, "thetauvcsrc", GST_RANK_NONE, GST_TYPE_THETAUVCSRC))
 	return FALSE;
+    if (!gst_element_register(plugin, "thetauvcshmsrc", GST_RANK_NONE,
+	    GST_TYPE_THETAUVCSHMSRC))
+	return FALSE;
+    if (!gst_device_provider_register(plugin, "thetauvcdeviceprovider",
+	    GST_RANK_PRIMARY, GST_TYPE_THETAUVC_DEVICE_PROVIDER))
+	return FALSE;
+    if (!gst_tracer_register(plugin, "thetauvclatency",
+	    GST_TYPE_THETAUVC_LATENCY_TRACER))
+	return FALSE;
 #if defined(WITH_TRANSFORM_FILTER)
     if (!gst_element_register(plugin, "thetatransform", GST_RANK_NONE, GST_TYPE_THETATRANSFORM))
 	return FALSE;
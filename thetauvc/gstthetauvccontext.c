@@ -0,0 +1,163 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/*
+ * Process-wide libusb context.
+ *
+ * All sources, the device cache and the configuration switch of THETA S
+ * use one libusb context, whose events are handled by a single thread.
+ * Each source still gets a libuvc context of its own on top of it, as
+ * libuvc does not lock its list of open devices.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/time.h>
+
+#include <gst/gst.h>
+#include <libusb.h>
+
+#include "gstthetauvccontext.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_context_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_context_debug_category
+
+/* event polling interval (us) */
+#define THETAUVC_CONTEXT_EVENT_TIMEOUT 100000
+
+static GMutex context_lock;
+static GstThetauvcContext *context;
+
+/* Apply a new scheduling request, on the event thread */
+static void
+context_apply_sched(GstThetauvcContext * ctx)
+{
+    GstThetauvcThreadSched sched = { 0 };
+    gint    ret;
+
+    g_mutex_lock(&ctx->sched_lock);
+    gst_thetauvc_thread_sched_copy(&sched, &ctx->sched);
+    g_mutex_unlock(&ctx->sched_lock);
+
+    if ((ret = gst_thetauvc_thread_sched_apply(&sched)) != 0)
+	GST_WARNING("could not set scheduling of the event thread: %s",
+	    g_strerror(ret));
+    gst_thetauvc_thread_sched_clear(&sched);
+}
+
+static  gpointer
+context_event_thread(gpointer data)
+{
+    GstThetauvcContext *ctx = data;
+    struct timeval tv = { 0, THETAUVC_CONTEXT_EVENT_TIMEOUT };
+    gint    serial = 0, now;
+
+    while (g_atomic_int_get(&ctx->event_running)) {
+	now = g_atomic_int_get(&ctx->sched_serial);
+	if (now != serial) {
+	    serial = now;
+	    context_apply_sched(ctx);
+	}
+	libusb_handle_events_timeout_completed(ctx->usb_ctx, &tv, NULL);
+    }
+
+    return NULL;
+}
+
+/* Get the shared context, creating it on first use */
+GstThetauvcContext *
+gst_thetauvc_context_ref(void)
+{
+    GstThetauvcContext *ctx;
+
+    g_mutex_lock(&context_lock);
+    if (context != NULL) {
+	context->refcount++;
+	ctx = context;
+	g_mutex_unlock(&context_lock);
+	return ctx;
+    }
+
+    if (gst_thetauvc_context_debug_category == NULL)
+	GST_DEBUG_CATEGORY_INIT(gst_thetauvc_context_debug_category,
+	    "thetauvccontext", 0, "shared libusb context");
+
+    ctx = g_new0(GstThetauvcContext, 1);
+    if (libusb_init(&ctx->usb_ctx) != LIBUSB_SUCCESS) {
+	GST_WARNING("could not initialize libusb");
+	g_free(ctx);
+	g_mutex_unlock(&context_lock);
+	return NULL;
+    }
+
+    ctx->refcount = 1;
+    g_mutex_init(&ctx->sched_lock);
+    g_atomic_int_set(&ctx->event_running, 1);
+    ctx->event_thread = g_thread_new("thetauvc-usb", context_event_thread,
+	ctx);
+    GST_DEBUG("created libusb context %p", ctx->usb_ctx);
+
+    context = ctx;
+    g_mutex_unlock(&context_lock);
+
+    return ctx;
+}
+
+void
+gst_thetauvc_context_unref(GstThetauvcContext * ctx)
+{
+    g_mutex_lock(&context_lock);
+    if (ctx != context || ctx->refcount <= 0) {
+	g_mutex_unlock(&context_lock);
+	g_return_if_reached();
+    }
+    if (--ctx->refcount > 0) {
+	g_mutex_unlock(&context_lock);
+	return;
+    }
+    context = NULL;
+    g_mutex_unlock(&context_lock);
+
+    g_atomic_int_set(&ctx->event_running, 0);
+    libusb_interrupt_event_handler(ctx->usb_ctx);
+    g_thread_join(ctx->event_thread);
+
+    GST_DEBUG("releasing libusb context %p", ctx->usb_ctx);
+    libusb_exit(ctx->usb_ctx);
+    gst_thetauvc_thread_sched_clear(&ctx->sched);
+    g_mutex_clear(&ctx->sched_lock);
+    g_free(ctx);
+}
+
+/*
+ * Set the scheduling of the event thread.  It is shared by all sources,
+ * so the latest request wins.  The thread is woken up to apply it.
+ */
+void
+gst_thetauvc_context_set_sched(GstThetauvcContext * ctx,
+    const GstThetauvcThreadSched * sched)
+{
+    g_mutex_lock(&ctx->sched_lock);
+    gst_thetauvc_thread_sched_copy(&ctx->sched, sched);
+    g_mutex_unlock(&ctx->sched_lock);
+    g_atomic_int_inc(&ctx->sched_serial);
+    libusb_interrupt_event_handler(ctx->usb_ctx);
+}
@@ -0,0 +1,53 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCCONTEXT_H_
+#define _GST_THETAUVCCONTEXT_H_
+
+#include <gst/gst.h>
+#include <libusb.h>
+
+#include "gstthetauvcthread.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstThetauvcContext GstThetauvcContext;
+
+/* libusb context shared by the whole process, with its event thread */
+struct _GstThetauvcContext
+{
+    gint    refcount;
+    libusb_context *usb_ctx;
+
+    GThread *event_thread;
+    gint    event_running;
+
+    /* scheduling of the event thread, the latest request wins */
+    GMutex  sched_lock;
+    GstThetauvcThreadSched sched;
+    gint    sched_serial;
+};
+
+GstThetauvcContext *gst_thetauvc_context_ref(void);
+void    gst_thetauvc_context_unref(GstThetauvcContext *);
+void    gst_thetauvc_context_set_sched(GstThetauvcContext *,
+    const GstThetauvcThreadSched *);
+
+G_END_DECLS
+#endif
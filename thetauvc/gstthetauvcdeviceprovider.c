@@ -0,0 +1,270 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+/**
+ * SECTION:provider-thetauvcdeviceprovider
+ *
+ * Lists the THETAs on the bus and reports them as they are plugged and
+ * unplugged.
+ *
+ * <refsect2>
+ * <title>Example</title>
+ * |[
+ * gst-device-monitor-1.0 Video/Source
+ * ]|
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "libuvc/libuvc.h"
+#include "thetauvc.h"
+#include "gstthetauvcsrc.h"
+#include "gstthetauvcdevices.h"
+#include "gstthetauvcdeviceprovider.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_device_provider_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_device_provider_debug_category
+
+G_DEFINE_TYPE_WITH_CODE(GstThetauvcDeviceProvider,
+    gst_thetauvc_device_provider, GST_TYPE_DEVICE_PROVIDER,
+    GST_DEBUG_CATEGORY_INIT
+    (gst_thetauvc_device_provider_debug_category, "thetauvcdeviceprovider", 0,
+	"debug category for thetauvcdeviceprovider"));
+
+G_DEFINE_TYPE(GstThetauvcDevice, gst_thetauvc_device, GST_TYPE_DEVICE);
+
+/* Caps of the modes the model can stream */
+static GstCaps *
+thetauvc_device_caps(guint16 pid)
+{
+    const thetauvc_mode_t *m;
+    GstCaps *caps;
+    unsigned int mode;
+
+    caps = gst_caps_new_empty();
+    for (mode = 0; mode < THETAUVC_MODE_NUM; mode++) {
+	if (!thetauvc_mode_supported(pid, mode)
+	    || (m = thetauvc_get_mode(mode)) == NULL)
+	    continue;
+
+	gst_caps_append_structure(caps, gst_structure_new("video/x-h264",
+		"width", G_TYPE_INT, m->width,
+		"height", G_TYPE_INT, m->height,
+		"stream-format", G_TYPE_STRING, "byte-stream",
+		"alignment", G_TYPE_STRING, "au", NULL));
+    }
+
+    return caps;
+}
+
+static GstDevice *
+gst_thetauvc_device_new(const GstThetauvcDeviceInfo * info)
+{
+    GstThetauvcDevice *device;
+    GstStructure *props;
+    GstCaps *caps;
+    gchar  *name;
+
+    caps = thetauvc_device_caps(info->pid);
+    props = gst_structure_new("thetauvc-device-properties",
+	"device.api", G_TYPE_STRING, "libuvc",
+	"device.product.name", G_TYPE_STRING, info->product,
+	"device.serial", G_TYPE_STRING, info->serial,
+	"device.vendor.id", G_TYPE_UINT, USBVID_RICOH,
+	"device.product.id", G_TYPE_UINT, info->pid,
+	"device.bus", G_TYPE_UINT, info->bus,
+	"device.address", G_TYPE_UINT, info->address, NULL);
+    name = g_strdup_printf("%s (%s)", info->product,
+	info->serial ? info->serial : "unknown");
+
+    device = g_object_new(GST_TYPE_THETAUVC_DEVICE,
+	"display-name", name, "device-class", "Video/Source",
+	"caps", caps, "properties", props, NULL);
+    device->serial = g_strdup(info->serial);
+
+    g_free(name);
+    gst_structure_free(props);
+    gst_caps_unref(caps);
+
+    return GST_DEVICE(device);
+}
+
+static GList *
+gst_thetauvc_device_provider_probe(GstDeviceProvider * provider)
+{
+    GList  *infos, *l, *ret;
+
+    if (!gst_thetauvc_devices_ref())
+	return NULL;
+
+    ret = NULL;
+    infos = gst_thetauvc_devices_list();
+    for (l = infos; l != NULL; l = l->next)
+	ret = g_list_prepend(ret, gst_thetauvc_device_new(l->data));
+    g_list_free_full(infos, (GDestroyNotify) gst_thetauvc_device_info_free);
+
+    gst_thetauvc_devices_unref();
+
+    return g_list_reverse(ret);
+}
+
+/* Runs with the device cache locked */
+static void
+gst_thetauvc_device_provider_watch(const GstThetauvcDeviceInfo * info,
+    gboolean added, gpointer user_data)
+{
+    GstDeviceProvider *provider = GST_DEVICE_PROVIDER(user_data);
+    GList  *devices, *l;
+
+    if (added) {
+	gst_device_provider_device_add(provider,
+	    gst_thetauvc_device_new(info));
+	return;
+    }
+
+    devices = gst_device_provider_get_devices(provider);
+    for (l = devices; l != NULL; l = l->next) {
+	GstThetauvcDevice *device = l->data;
+	if (g_strcmp0(device->serial, info->serial) == 0) {
+	    gst_device_provider_device_remove(provider, GST_DEVICE(device));
+	    break;
+	}
+    }
+    g_list_free_full(devices, gst_object_unref);
+}
+
+static  gboolean
+gst_thetauvc_device_provider_start(GstDeviceProvider * provider)
+{
+    GstThetauvcDeviceProvider *self = GST_THETAUVC_DEVICE_PROVIDER(provider);
+    GList  *infos, *l;
+
+    if (!gst_thetauvc_devices_ref())
+	return FALSE;
+
+    /* without hotplug events, list the devices present once */
+    if (!gst_thetauvc_devices_is_live()) {
+	GST_INFO_OBJECT(self, "no hotplug support, devices are not monitored");
+	infos = gst_thetauvc_devices_list();
+	for (l = infos; l != NULL; l = l->next)
+	    gst_device_provider_device_add(provider,
+		gst_thetauvc_device_new(l->data));
+	g_list_free_full(infos,
+	    (GDestroyNotify) gst_thetauvc_device_info_free);
+	self->watch_id = 0;
+	return TRUE;
+    }
+
+    self->watch_id =
+	gst_thetauvc_devices_add_watch(gst_thetauvc_device_provider_watch,
+	self);
+
+    return TRUE;
+}
+
+static void
+gst_thetauvc_device_provider_stop(GstDeviceProvider * provider)
+{
+    GstThetauvcDeviceProvider *self = GST_THETAUVC_DEVICE_PROVIDER(provider);
+
+    if (self->watch_id != 0)
+	gst_thetauvc_devices_remove_watch(self->watch_id);
+    self->watch_id = 0;
+    gst_thetauvc_devices_unref();
+}
+
+static void
+gst_thetauvc_device_provider_class_init(GstThetauvcDeviceProviderClass *
+    klass)
+{
+    GstDeviceProviderClass *dm_class = GST_DEVICE_PROVIDER_CLASS(klass);
+
+    dm_class->probe = gst_thetauvc_device_provider_probe;
+    dm_class->start = gst_thetauvc_device_provider_start;
+    dm_class->stop = gst_thetauvc_device_provider_stop;
+
+    gst_device_provider_class_set_static_metadata(dm_class,
+	"THETA Device Provider", "Source/Video",
+	"List and monitor THETA UVC devices",
+	"Koji Takeo <nickel110@icloud.com>");
+}
+
+static void
+gst_thetauvc_device_provider_init(GstThetauvcDeviceProvider * self)
+{
+    self->watch_id = 0;
+}
+
+static GstElement *
+gst_thetauvc_device_create_element(GstDevice * device, const gchar * name)
+{
+    GstThetauvcDevice *self = GST_THETAUVC_DEVICE(device);
+    GstElement *elem;
+
+    elem = gst_element_factory_make("thetauvcsrc", name);
+    if (elem != NULL)
+	g_object_set(elem, "serial", self->serial, NULL);
+
+    return elem;
+}
+
+static  gboolean
+gst_thetauvc_device_reconfigure_element(GstDevice * device,
+    GstElement * element)
+{
+    GstThetauvcDevice *self = GST_THETAUVC_DEVICE(device);
+
+    if (!GST_IS_THETAUVCSRC(element))
+	return FALSE;
+
+    g_object_set(element, "serial", self->serial, NULL);
+
+    return TRUE;
+}
+
+static void
+gst_thetauvc_device_finalize(GObject * object)
+{
+    GstThetauvcDevice *self = GST_THETAUVC_DEVICE(object);
+
+    g_free(self->serial);
+
+    G_OBJECT_CLASS(gst_thetauvc_device_parent_class)->finalize(object);
+}
+
+static void
+gst_thetauvc_device_class_init(GstThetauvcDeviceClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstDeviceClass *dev_class = GST_DEVICE_CLASS(klass);
+
+    gobject_class->finalize = gst_thetauvc_device_finalize;
+    dev_class->create_element = gst_thetauvc_device_create_element;
+    dev_class->reconfigure_element = gst_thetauvc_device_reconfigure_element;
+}
+
+static void
+gst_thetauvc_device_init(GstThetauvcDevice * self)
+{
+    self->serial = NULL;
+}
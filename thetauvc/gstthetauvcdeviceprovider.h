@@ -0,0 +1,65 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCDEVICEPROVIDER_H_
+#define _GST_THETAUVCDEVICEPROVIDER_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_THETAUVC_DEVICE_PROVIDER   (gst_thetauvc_device_provider_get_type())
+#define GST_THETAUVC_DEVICE_PROVIDER(obj)   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_THETAUVC_DEVICE_PROVIDER,GstThetauvcDeviceProvider))
+#define GST_TYPE_THETAUVC_DEVICE   (gst_thetauvc_device_get_type())
+#define GST_THETAUVC_DEVICE(obj)   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_THETAUVC_DEVICE,GstThetauvcDevice))
+#define GST_IS_THETAUVC_DEVICE(obj)   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_THETAUVC_DEVICE))
+
+typedef struct _GstThetauvcDeviceProvider GstThetauvcDeviceProvider;
+typedef struct _GstThetauvcDeviceProviderClass GstThetauvcDeviceProviderClass;
+typedef struct _GstThetauvcDevice GstThetauvcDevice;
+typedef struct _GstThetauvcDeviceClass GstThetauvcDeviceClass;
+
+struct _GstThetauvcDeviceProvider
+{
+    GstDeviceProvider parent;
+
+    guint   watch_id;
+};
+
+struct _GstThetauvcDeviceProviderClass
+{
+    GstDeviceProviderClass parent_class;
+};
+
+struct _GstThetauvcDevice
+{
+    GstDevice parent;
+
+    gchar  *serial;
+};
+
+struct _GstThetauvcDeviceClass
+{
+    GstDeviceClass parent_class;
+};
+
+GType   gst_thetauvc_device_provider_get_type(void);
+GType   gst_thetauvc_device_get_type(void);
+
+G_END_DECLS
+#endif
@@ -0,0 +1,467 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/*
+ * Process-wide cache of the THETAs on the bus.
+ *
+ * Devices are probed once when they arrive, reading the string
+ * descriptors, and dropped when they leave, so looking up a serial or an
+ * index does not touch USB.  Without hotplug support in libusb the list
+ * is probed again on every lookup.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <libusb.h>
+
+#include "libuvc/libuvc.h"
+#include "thetauvc.h"
+#include "gstthetauvccontext.h"
+#include "gstthetauvcdevices.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_devices_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_devices_debug_category
+
+typedef struct
+{
+    libusb_device *dev;
+    gboolean arrived;
+} DeviceEvent;
+
+typedef struct
+{
+    guint   id;
+    GstThetauvcDevicesFunc func;
+    gpointer user_data;
+} DeviceWatch;
+
+/* ref_lock serializes ref/unref, devices_lock protects the lists */
+static GMutex ref_lock;
+static guint refcount;
+static GMutex devices_lock;
+static GList *devices;
+static GList *watches;
+static guint next_watch_id = 1;
+
+static GstThetauvcContext *context;
+static gboolean has_hotplug;
+static libusb_hotplug_callback_handle hotplug;
+/* hotplug events for the probe thread, a NULL device stops it */
+static GAsyncQueue *events;
+static GThread *probe_thread;
+
+GstThetauvcDeviceInfo *
+gst_thetauvc_device_info_copy(const GstThetauvcDeviceInfo * info)
+{
+    GstThetauvcDeviceInfo *copy;
+
+    copy = g_new(GstThetauvcDeviceInfo, 1);
+    *copy = *info;
+    copy->product = g_strdup(info->product);
+    copy->serial = g_strdup(info->serial);
+
+    return copy;
+}
+
+void
+gst_thetauvc_device_info_free(GstThetauvcDeviceInfo * info)
+{
+    g_free(info->product);
+    g_free(info->serial);
+    g_free(info);
+}
+
+static gchar *
+devices_get_string(libusb_device_handle * devh, uint8_t index)
+{
+    unsigned char buf[256];
+    int     len;
+
+    if (index == 0)
+	return NULL;
+
+    len = libusb_get_string_descriptor_ascii(devh, index, buf, sizeof(buf));
+    if (len <= 0)
+	return NULL;
+
+    return g_strndup((const gchar *) buf, len);
+}
+
+/* Read the descriptors of a RICOH device, NULL if it is not a THETA */
+static GstThetauvcDeviceInfo *
+devices_probe(libusb_device * dev)
+{
+    struct libusb_device_descriptor desc;
+    libusb_device_handle *devh;
+    GstThetauvcDeviceInfo *info;
+
+    if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS
+	|| desc.idVendor != USBVID_RICOH)
+	return NULL;
+
+    if (libusb_open(dev, &devh) != LIBUSB_SUCCESS) {
+	GST_DEBUG("could not open %03u:%03u", libusb_get_bus_number(dev),
+	    libusb_get_device_address(dev));
+	return NULL;
+    }
+
+    info = g_new0(GstThetauvcDeviceInfo, 1);
+    info->product = devices_get_string(devh, desc.iProduct);
+    info->serial = devices_get_string(devh, desc.iSerialNumber);
+    libusb_close(devh);
+
+    if (info->product == NULL
+	|| !g_str_has_prefix(info->product, THETAUVC_PRODUCT_PREFIX)) {
+	gst_thetauvc_device_info_free(info);
+	return NULL;
+    }
+
+    info->pid = desc.idProduct;
+    info->bus = libusb_get_bus_number(dev);
+    info->address = libusb_get_device_address(dev);
+
+    return info;
+}
+
+/* devices_lock must be held */
+static void
+devices_notify(const GstThetauvcDeviceInfo * info, gboolean added)
+{
+    GList  *l;
+
+    for (l = watches; l != NULL; l = l->next) {
+	DeviceWatch *w = l->data;
+	w->func(info, added, w->user_data);
+    }
+}
+
+static GList *
+devices_find(guint8 bus, guint8 address)
+{
+    GList  *l;
+
+    for (l = devices; l != NULL; l = l->next) {
+	GstThetauvcDeviceInfo *info = l->data;
+	if (info->bus == bus && info->address == address)
+	    return l;
+    }
+
+    return NULL;
+}
+
+static void
+devices_remove(guint8 bus, guint8 address)
+{
+    GstThetauvcDeviceInfo *info;
+    GList  *l;
+
+    g_mutex_lock(&devices_lock);
+    if ((l = devices_find(bus, address)) != NULL) {
+	info = l->data;
+	devices = g_list_delete_link(devices, l);
+	GST_INFO("%s (%s) removed", info->product, info->serial);
+	devices_notify(info, FALSE);
+	gst_thetauvc_device_info_free(info);
+    }
+    g_mutex_unlock(&devices_lock);
+}
+
+static void
+devices_add(GstThetauvcDeviceInfo * info)
+{
+    devices_remove(info->bus, info->address);
+
+    g_mutex_lock(&devices_lock);
+    GST_INFO("%s (%s) at %03u:%03u", info->product, info->serial, info->bus,
+	info->address);
+    devices = g_list_append(devices, info);
+    devices_notify(info, TRUE);
+    g_mutex_unlock(&devices_lock);
+}
+
+/*
+ * Handle a queued hotplug event.  Probing does synchronous I/O which is
+ * not allowed in the hotplug callback itself.  Returns FALSE on the stop
+ * event.
+ */
+static  gboolean
+devices_process_event(DeviceEvent * ev)
+{
+    GstThetauvcDeviceInfo *info;
+
+    if (ev->dev == NULL) {
+	g_free(ev);
+	return FALSE;
+    }
+
+    if (ev->arrived) {
+	if ((info = devices_probe(ev->dev)) != NULL)
+	    devices_add(info);
+    } else {
+	devices_remove(libusb_get_bus_number(ev->dev),
+	    libusb_get_device_address(ev->dev));
+    }
+    libusb_unref_device(ev->dev);
+    g_free(ev);
+
+    return TRUE;
+}
+
+static int LIBUSB_CALL
+devices_hotplug_cb(libusb_context * ctx, libusb_device * dev,
+    libusb_hotplug_event event, void *user_data)
+{
+    DeviceEvent *ev;
+
+    ev = g_new(DeviceEvent, 1);
+    ev->dev = libusb_ref_device(dev);
+    ev->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+    g_async_queue_push(events, ev);
+
+    return 0;
+}
+
+static  gpointer
+devices_probe_thread(gpointer data)
+{
+    while (devices_process_event(g_async_queue_pop(events)));
+
+    return NULL;
+}
+
+/* Probe the whole bus, used when there are no hotplug events */
+static void
+devices_refresh(void)
+{
+    GstThetauvcDeviceInfo *info;
+    libusb_device **list;
+    GList  *found, *old;
+    ssize_t n, i;
+
+    found = NULL;
+    n = libusb_get_device_list(context->usb_ctx, &list);
+    for (i = 0; i < n; i++) {
+	if ((info = devices_probe(list[i])) != NULL)
+	    found = g_list_append(found, info);
+    }
+    if (n >= 0)
+	libusb_free_device_list(list, 1);
+
+    g_mutex_lock(&devices_lock);
+    old = devices;
+    devices = found;
+    g_mutex_unlock(&devices_lock);
+
+    g_list_free_full(old, (GDestroyNotify) gst_thetauvc_device_info_free);
+}
+
+/* Start the cache, the devices on the bus are known on return */
+gboolean
+gst_thetauvc_devices_ref(void)
+{
+    int     res;
+
+    g_mutex_lock(&ref_lock);
+    if (refcount > 0) {
+	refcount++;
+	g_mutex_unlock(&ref_lock);
+	return TRUE;
+    }
+
+    if (gst_thetauvc_devices_debug_category == NULL)
+	GST_DEBUG_CATEGORY_INIT(gst_thetauvc_devices_debug_category,
+	    "thetauvcdevices", 0, "THETA device cache");
+
+    if ((context = gst_thetauvc_context_ref()) == NULL) {
+	g_mutex_unlock(&ref_lock);
+	return FALSE;
+    }
+
+    events = g_async_queue_new();
+    has_hotplug = FALSE;
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+	res = libusb_hotplug_register_callback(context->usb_ctx,
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+	    LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, LIBUSB_HOTPLUG_ENUMERATE,
+	    USBVID_RICOH, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+	    devices_hotplug_cb, NULL, &hotplug);
+	has_hotplug = (res == LIBUSB_SUCCESS);
+    }
+
+    if (has_hotplug) {
+	DeviceEvent *ev;
+
+	/* the devices present were queued by the registration */
+	while ((ev = g_async_queue_try_pop(events)) != NULL)
+	    devices_process_event(ev);
+	probe_thread = g_thread_new("thetauvc-devices", devices_probe_thread,
+	    NULL);
+    } else {
+	GST_INFO("no hotplug support, probing on every lookup");
+	devices_refresh();
+    }
+
+    refcount = 1;
+    g_mutex_unlock(&ref_lock);
+
+    return TRUE;
+}
+
+void
+gst_thetauvc_devices_unref(void)
+{
+    DeviceEvent *ev;
+
+    g_mutex_lock(&ref_lock);
+    if (refcount == 0) {
+	g_mutex_unlock(&ref_lock);
+	g_return_if_reached();
+    }
+    if (--refcount > 0) {
+	g_mutex_unlock(&ref_lock);
+	return;
+    }
+
+    if (has_hotplug) {
+	libusb_hotplug_deregister_callback(context->usb_ctx, hotplug);
+	ev = g_new0(DeviceEvent, 1);
+	g_async_queue_push(events, ev);
+	g_thread_join(probe_thread);
+	probe_thread = NULL;
+	has_hotplug = FALSE;
+    }
+    /* events left behind the stop event only need their reference dropped */
+    while ((ev = g_async_queue_try_pop(events)) != NULL) {
+	if (ev->dev != NULL)
+	    libusb_unref_device(ev->dev);
+	g_free(ev);
+    }
+    g_async_queue_unref(events);
+    events = NULL;
+
+    g_mutex_lock(&devices_lock);
+    g_list_free_full(devices, (GDestroyNotify) gst_thetauvc_device_info_free);
+    devices = NULL;
+    g_mutex_unlock(&devices_lock);
+
+    gst_thetauvc_context_unref(context);
+    context = NULL;
+    g_mutex_unlock(&ref_lock);
+}
+
+/* Is the list kept up to date by hotplug events? */
+gboolean
+gst_thetauvc_devices_is_live(void)
+{
+    return has_hotplug;
+}
+
+/* Copy of the device list, the caller must hold a reference */
+GList  *
+gst_thetauvc_devices_list(void)
+{
+    GList  *l, *ret;
+
+    if (!has_hotplug)
+	devices_refresh();
+
+    ret = NULL;
+    g_mutex_lock(&devices_lock);
+    for (l = devices; l != NULL; l = l->next)
+	ret = g_list_prepend(ret, gst_thetauvc_device_info_copy(l->data));
+    g_mutex_unlock(&devices_lock);
+
+    return g_list_reverse(ret);
+}
+
+/*
+ * Find a device by serial, or by index if serial is NULL.  The caller
+ * must hold a reference and free the result.
+ */
+GstThetauvcDeviceInfo *
+gst_thetauvc_devices_lookup(const gchar * serial, gint index)
+{
+    GstThetauvcDeviceInfo *info, *ret;
+    GList  *l;
+
+    if (!has_hotplug)
+	devices_refresh();
+
+    ret = NULL;
+    g_mutex_lock(&devices_lock);
+    if (serial != NULL) {
+	for (l = devices; l != NULL; l = l->next) {
+	    info = l->data;
+	    if (g_strcmp0(info->serial, serial) == 0) {
+		ret = gst_thetauvc_device_info_copy(info);
+		break;
+	    }
+	}
+    } else if (index >= 0 && (info = g_list_nth_data(devices, index))) {
+	ret = gst_thetauvc_device_info_copy(info);
+    }
+    g_mutex_unlock(&devices_lock);
+
+    return ret;
+}
+
+/*
+ * Call func for every device arriving or leaving.  The devices already
+ * present are reported as added right away.
+ */
+guint
+gst_thetauvc_devices_add_watch(GstThetauvcDevicesFunc func,
+    gpointer user_data)
+{
+    DeviceWatch *w;
+    GList  *l;
+
+    w = g_new(DeviceWatch, 1);
+    w->func = func;
+    w->user_data = user_data;
+
+    g_mutex_lock(&devices_lock);
+    w->id = next_watch_id++;
+    watches = g_list_append(watches, w);
+    for (l = devices; l != NULL; l = l->next)
+	func(l->data, TRUE, user_data);
+    g_mutex_unlock(&devices_lock);
+
+    return w->id;
+}
+
+void
+gst_thetauvc_devices_remove_watch(guint id)
+{
+    GList  *l;
+
+    g_mutex_lock(&devices_lock);
+    for (l = watches; l != NULL; l = l->next) {
+	DeviceWatch *w = l->data;
+	if (w->id == id) {
+	    watches = g_list_delete_link(watches, l);
+	    g_free(w);
+	    break;
+	}
+    }
+    g_mutex_unlock(&devices_lock);
+}
@@ -0,0 +1,61 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCDEVICES_H_
+#define _GST_THETAUVCDEVICES_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstThetauvcDeviceInfo GstThetauvcDeviceInfo;
+
+/* THETA found on the bus */
+struct _GstThetauvcDeviceInfo
+{
+    gchar  *product;
+    gchar  *serial;
+    guint16 pid;
+    guint8  bus;
+    guint8  address;
+};
+
+/*
+ * Called with added=FALSE when a device left.  Watches are called with
+ * the cache locked and must not call back into it.
+ */
+typedef void (*GstThetauvcDevicesFunc) (const GstThetauvcDeviceInfo *,
+    gboolean added, gpointer);
+
+GstThetauvcDeviceInfo *gst_thetauvc_device_info_copy(const
+    GstThetauvcDeviceInfo *);
+void    gst_thetauvc_device_info_free(GstThetauvcDeviceInfo *);
+
+gboolean gst_thetauvc_devices_ref(void);
+void    gst_thetauvc_devices_unref(void);
+
+GList  *gst_thetauvc_devices_list(void);
+GstThetauvcDeviceInfo *gst_thetauvc_devices_lookup(const gchar *, gint);
+gboolean gst_thetauvc_devices_is_live(void);
+
+guint   gst_thetauvc_devices_add_watch(GstThetauvcDevicesFunc, gpointer);
+void    gst_thetauvc_devices_remove_watch(guint);
+
+G_END_DECLS
+#endif
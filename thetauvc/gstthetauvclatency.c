@@ -0,0 +1,276 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+/**
+ * SECTION:tracer-thetauvclatency
+ *
+ * Follows the frames of thetauvcsrc through the pipeline and writes a CSV
+ * line each time a frame is pushed out of a pad, and when that push
+ * returns:
+ *
+ *   frame,element,pad,event,latency
+ *
+ * frame is the host time the frame was captured in the libuvc callback,
+ * latency the time since then in ns and event either "push" or "done".
+ * The time a frame spends in an element, be it the source queue, parser,
+ * decoder, upload or thetatransform, is the difference between the push
+ * out of the element and the push into it.  "done" of the pad feeding a
+ * sink tells when the sink was finished with the frame.
+ *
+ * Frames are recognized by the capture meta added by thetauvcsrc, or by
+ * PTS past elements such as decoders that do not keep the meta.  Matching
+ * by PTS assumes a single source.
+ *
+ * <refsect2>
+ * <title>Example</title>
+ * |[
+ * GST_TRACERS="thetauvclatency(file=latency.csv)" gst-launch-1.0 thetauvcsrc ! h264parse ! avdec_h264 ! fakesink
+ * ]|
+ * Without file, the trace is written to thetauvclatency.csv.
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+/* gst_tracer_register() and the tracing hooks */
+#define GST_USE_UNSTABLE_API
+#include <gst/gst.h>
+
+#include "gstthetauvcsrc.h"
+#include "gstthetauvclatency.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_latency_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_latency_debug_category
+
+#define DEFAULT_FILE "thetauvclatency.csv"
+
+G_DEFINE_TYPE_WITH_CODE(GstThetauvcLatencyTracer,
+    gst_thetauvc_latency_tracer, GST_TYPE_TRACER,
+    GST_DEBUG_CATEGORY_INIT(gst_thetauvc_latency_debug_category,
+	"thetauvclatency", 0, "debug category for thetauvclatency tracer"));
+
+static void gst_thetauvc_latency_tracer_constructed(GObject * object);
+static void gst_thetauvc_latency_tracer_finalize(GObject * object);
+
+/* frames being pushed by the thread, pushes nest downstream */
+static GPrivate latency_stack = G_PRIVATE_INIT((GDestroyNotify) g_array_unref);
+
+/* Capture time of the buffer, GST_CLOCK_TIME_NONE if not a camera frame */
+static  GstClockTime
+latency_frame(GstThetauvcLatencyTracer * self, GstBuffer * buf)
+{
+    GstReferenceTimestampMeta *meta;
+    GstThetauvcLatencyFrame *f;
+    GstClockTime pts, capture;
+    guint   i, n;
+
+    pts = GST_BUFFER_PTS(buf);
+    meta = gst_buffer_get_reference_timestamp_meta(buf, self->capture_caps);
+    if (meta == NULL && !GST_CLOCK_TIME_IS_VALID(pts))
+	return GST_CLOCK_TIME_NONE;
+
+    capture = meta != NULL ? meta->timestamp : GST_CLOCK_TIME_NONE;
+    g_mutex_lock(&self->lock);
+    /* newest first */
+    for (n = 0; n < GST_THETAUVC_LATENCY_FRAMES; n++) {
+	i = (self->next_frame - 1 - n) % GST_THETAUVC_LATENCY_FRAMES;
+	f = &self->frames[i];
+	if (GST_CLOCK_TIME_IS_VALID(f->pts) && f->pts == pts) {
+	    capture = f->capture;
+	    break;
+	}
+    }
+    if (meta != NULL && GST_CLOCK_TIME_IS_VALID(pts)
+	&& n == GST_THETAUVC_LATENCY_FRAMES) {
+	f = &self->frames[self->next_frame++ % GST_THETAUVC_LATENCY_FRAMES];
+	f->pts = pts;
+	f->capture = capture;
+    }
+    g_mutex_unlock(&self->lock);
+
+    return capture;
+}
+
+static void
+latency_log(GstThetauvcLatencyTracer * self, GstPad * pad,
+    const gchar * event, GstClockTime capture)
+{
+    GstObject *parent;
+    GstClockTime now;
+
+    now = g_get_monotonic_time() * GST_USECOND;
+    parent = GST_OBJECT_PARENT(pad);
+
+    g_mutex_lock(&self->lock);
+    fprintf(self->out, "%" G_GUINT64_FORMAT ",%s,%s,%s,%" G_GUINT64_FORMAT
+	"\n", capture, parent != NULL ? GST_OBJECT_NAME(parent) : "",
+	GST_OBJECT_NAME(pad), event, now > capture ? now - capture : 0);
+    g_mutex_unlock(&self->lock);
+}
+
+static void
+latency_enter(GstThetauvcLatencyTracer * self, GstPad * pad,
+    GstClockTime capture)
+{
+    GArray *stack;
+
+    if ((stack = g_private_get(&latency_stack)) == NULL) {
+	stack = g_array_new(FALSE, FALSE, sizeof(GstClockTime));
+	g_private_set(&latency_stack, stack);
+    }
+    g_array_append_val(stack, capture);
+
+    if (GST_CLOCK_TIME_IS_VALID(capture))
+	latency_log(self, pad, "push", capture);
+}
+
+static void
+latency_leave(GstThetauvcLatencyTracer * self, GstPad * pad)
+{
+    GArray *stack;
+    GstClockTime capture;
+
+    stack = g_private_get(&latency_stack);
+    if (stack == NULL || stack->len == 0)
+	return;
+
+    capture = g_array_index(stack, GstClockTime, stack->len - 1);
+    g_array_set_size(stack, stack->len - 1);
+
+    if (GST_CLOCK_TIME_IS_VALID(capture))
+	latency_log(self, pad, "done", capture);
+}
+
+static void
+do_push_buffer_pre(GstThetauvcLatencyTracer * self, GstClockTime ts,
+    GstPad * pad, GstBuffer * buf)
+{
+    latency_enter(self, pad, latency_frame(self, buf));
+}
+
+static void
+do_push_buffer_list_pre(GstThetauvcLatencyTracer * self, GstClockTime ts,
+    GstPad * pad, GstBufferList * list)
+{
+    GstClockTime capture;
+
+    capture = gst_buffer_list_length(list) > 0 ?
+	latency_frame(self, gst_buffer_list_get(list, 0)) : GST_CLOCK_TIME_NONE;
+    latency_enter(self, pad, capture);
+}
+
+static void
+do_push_buffer_post(GstThetauvcLatencyTracer * self, GstClockTime ts,
+    GstPad * pad, GstFlowReturn res)
+{
+    latency_leave(self, pad);
+}
+
+static void
+gst_thetauvc_latency_tracer_class_init(GstThetauvcLatencyTracerClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+
+    gobject_class->constructed = gst_thetauvc_latency_tracer_constructed;
+    gobject_class->finalize = gst_thetauvc_latency_tracer_finalize;
+}
+
+static void
+gst_thetauvc_latency_tracer_init(GstThetauvcLatencyTracer * self)
+{
+    GstTracer *tracer = GST_TRACER(self);
+    guint   i;
+
+    g_mutex_init(&self->lock);
+    self->capture_caps =
+	gst_caps_new_empty_simple(GST_THETAUVCSRC_CAPTURE_CAPS);
+    for (i = 0; i < GST_THETAUVC_LATENCY_FRAMES; i++) {
+	self->frames[i].pts = GST_CLOCK_TIME_NONE;
+	self->frames[i].capture = GST_CLOCK_TIME_NONE;
+    }
+    self->next_frame = 0;
+    self->out = NULL;
+
+    gst_tracing_register_hook(tracer, "pad-push-pre",
+	G_CALLBACK(do_push_buffer_pre));
+    gst_tracing_register_hook(tracer, "pad-push-list-pre",
+	G_CALLBACK(do_push_buffer_list_pre));
+    gst_tracing_register_hook(tracer, "pad-push-post",
+	G_CALLBACK(do_push_buffer_post));
+    gst_tracing_register_hook(tracer, "pad-push-list-post",
+	G_CALLBACK(do_push_buffer_post));
+}
+
+/* The parameters are only set once constructed */
+static void
+gst_thetauvc_latency_tracer_constructed(GObject * object)
+{
+    GstThetauvcLatencyTracer *self = GST_THETAUVC_LATENCY_TRACER(object);
+    GstStructure *params;
+    const gchar *file;
+    gchar  *str, *tmp;
+
+    G_OBJECT_CLASS(gst_thetauvc_latency_tracer_parent_class)->constructed
+	(object);
+
+    params = NULL;
+    g_object_get(self, "params", &str, NULL);
+    if (str != NULL) {
+	tmp = g_strdup_printf("thetauvclatency,%s", str);
+	params = gst_structure_from_string(tmp, NULL);
+	if (params == NULL)
+	    GST_WARNING_OBJECT(self, "invalid parameters: %s", str);
+	g_free(tmp);
+	g_free(str);
+    }
+
+    file = params != NULL ? gst_structure_get_string(params, "file") : NULL;
+    if (file == NULL)
+	file = DEFAULT_FILE;
+    if ((self->out = fopen(file, "w")) == NULL) {
+	GST_WARNING_OBJECT(self, "could not open %s: %s, writing to stderr",
+	    file, g_strerror(errno));
+	self->out = stderr;
+    }
+    fputs("frame,element,pad,event,latency\n", self->out);
+
+    if (params != NULL)
+	gst_structure_free(params);
+}
+
+static void
+gst_thetauvc_latency_tracer_finalize(GObject * object)
+{
+    GstThetauvcLatencyTracer *self = GST_THETAUVC_LATENCY_TRACER(object);
+
+    if (self->out != NULL && self->out != stderr)
+	fclose(self->out);
+    else if (self->out != NULL)
+	fflush(self->out);
+    gst_caps_unref(self->capture_caps);
+    g_mutex_clear(&self->lock);
+
+    G_OBJECT_CLASS(gst_thetauvc_latency_tracer_parent_class)->finalize
+	(object);
+}
@@ -0,0 +1,65 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCLATENCY_H_
+#define _GST_THETAUVCLATENCY_H_
+
+#include <stdio.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+#define GST_TYPE_THETAUVC_LATENCY_TRACER   (gst_thetauvc_latency_tracer_get_type())
+#define GST_THETAUVC_LATENCY_TRACER(obj)   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_THETAUVC_LATENCY_TRACER,GstThetauvcLatencyTracer))
+
+/* frames remembered by PTS for buffers which lost the capture meta */
+#define GST_THETAUVC_LATENCY_FRAMES 256
+
+typedef struct _GstThetauvcLatencyTracer GstThetauvcLatencyTracer;
+typedef struct _GstThetauvcLatencyTracerClass GstThetauvcLatencyTracerClass;
+typedef struct _GstThetauvcLatencyFrame GstThetauvcLatencyFrame;
+
+struct _GstThetauvcLatencyFrame
+{
+    GstClockTime pts;
+    GstClockTime capture;
+};
+
+struct _GstThetauvcLatencyTracer
+{
+    GstTracer parent;
+
+    GstCaps *capture_caps;
+
+    /* protects the output and the frame ring */
+    GMutex  lock;
+    FILE   *out;
+    GstThetauvcLatencyFrame frames[GST_THETAUVC_LATENCY_FRAMES];
+    guint   next_frame;
+};
+
+struct _GstThetauvcLatencyTracerClass
+{
+    GstTracerClass parent_class;
+};
+
+GType   gst_thetauvc_latency_tracer_get_type(void);
+
+G_END_DECLS
+#endif
@@ -0,0 +1,219 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/*
+ * Allocator for frame payloads handed over by libuvc.
+ *
+ * libuvc keeps the payload of the frame passed to the callback in a
+ * malloc'ed block (library_owns_data) and reallocs it to fit every new
+ * frame.  Instead of copying the payload, the block is taken over as
+ * GstMemory and a recycled block is given back to libuvc in its place,
+ * so the steady state needs neither a copy nor a fresh allocation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+
+#include <gst/gst.h>
+
+#include "gstthetauvcmemory.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_memory_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_memory_debug_category
+
+/* number of idle blocks kept for recycling */
+#define THETAUVC_MEMORY_MAX_FREE 16
+
+G_DEFINE_TYPE_WITH_CODE(GstThetauvcAllocator, gst_thetauvc_allocator,
+    GST_TYPE_ALLOCATOR,
+    GST_DEBUG_CATEGORY_INIT
+    (gst_thetauvc_memory_debug_category, "thetauvcmemory", 0,
+	"debug category for thetauvc frame memory"));
+
+static GstMemory *
+gst_thetauvc_allocator_alloc(GstAllocator * allocator, gsize size,
+    GstAllocationParams * params)
+{
+    GST_WARNING_OBJECT(allocator, "frame memory can not be allocated directly");
+    return NULL;
+}
+
+static void
+gst_thetauvc_allocator_free(GstAllocator * allocator, GstMemory * mem)
+{
+    GstThetauvcAllocator *self = GST_THETAUVC_ALLOCATOR(allocator);
+    GstThetauvcMemory *tmem = (GstThetauvcMemory *) mem;
+
+    /* shared sub-memory does not own the block */
+    if (mem->parent != NULL) {
+	g_slice_free(GstThetauvcMemory, tmem);
+	return;
+    }
+
+    g_mutex_lock(&self->lock);
+    if (self->n_free < THETAUVC_MEMORY_MAX_FREE) {
+	tmem->next = self->free_list;
+	self->free_list = tmem;
+	self->n_free++;
+	g_mutex_unlock(&self->lock);
+	return;
+    }
+    g_mutex_unlock(&self->lock);
+
+    free(tmem->data);
+    g_slice_free(GstThetauvcMemory, tmem);
+}
+
+static gpointer
+gst_thetauvc_mem_map(GstMemory * mem, gsize maxsize, GstMapFlags flags)
+{
+    return ((GstThetauvcMemory *) mem)->data;
+}
+
+static void
+gst_thetauvc_mem_unmap(GstMemory * mem)
+{
+}
+
+static GstMemory *
+gst_thetauvc_mem_share(GstMemory * mem, gssize offset, gssize size)
+{
+    GstThetauvcMemory *sub;
+    GstMemory *parent;
+
+    if (size == -1)
+	size = mem->size - offset;
+
+    if ((parent = mem->parent) == NULL)
+	parent = mem;
+
+    sub = g_slice_new(GstThetauvcMemory);
+    gst_memory_init(GST_MEMORY_CAST(sub),
+	GST_MINI_OBJECT_FLAGS(parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+	mem->allocator, parent, mem->maxsize, mem->align,
+	mem->offset + offset, size);
+    sub->data = ((GstThetauvcMemory *) mem)->data;
+    sub->alloc_size = 0;
+    sub->next = NULL;
+
+    return GST_MEMORY_CAST(sub);
+}
+
+static void
+gst_thetauvc_allocator_finalize(GObject * object)
+{
+    GstThetauvcAllocator *self = GST_THETAUVC_ALLOCATOR(object);
+    GstThetauvcMemory *tmem;
+
+    while ((tmem = self->free_list) != NULL) {
+	self->free_list = tmem->next;
+	free(tmem->data);
+	g_slice_free(GstThetauvcMemory, tmem);
+    }
+    g_mutex_clear(&self->lock);
+
+    G_OBJECT_CLASS(gst_thetauvc_allocator_parent_class)->finalize(object);
+}
+
+static void
+gst_thetauvc_allocator_class_init(GstThetauvcAllocatorClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS(klass);
+
+    gobject_class->finalize = gst_thetauvc_allocator_finalize;
+    allocator_class->alloc = gst_thetauvc_allocator_alloc;
+    allocator_class->free = gst_thetauvc_allocator_free;
+}
+
+static void
+gst_thetauvc_allocator_init(GstThetauvcAllocator * self)
+{
+    GstAllocator *allocator = GST_ALLOCATOR_CAST(self);
+
+    allocator->mem_type = GST_THETAUVC_MEMORY_TYPE;
+    allocator->mem_map = gst_thetauvc_mem_map;
+    allocator->mem_unmap = gst_thetauvc_mem_unmap;
+    allocator->mem_share = gst_thetauvc_mem_share;
+
+    GST_OBJECT_FLAG_SET(self, GST_ALLOCATOR_FLAG_CUSTOM_ALLOC);
+
+    g_mutex_init(&self->lock);
+    self->free_list = NULL;
+    self->n_free = 0;
+}
+
+GstAllocator *
+gst_thetauvc_allocator_new(void)
+{
+    GstAllocator *allocator;
+
+    allocator = g_object_new(GST_TYPE_THETAUVC_ALLOCATOR, NULL);
+    gst_object_ref_sink(allocator);
+
+    return allocator;
+}
+
+/*
+ * Take over the payload of a libuvc owned frame.  The frame gets a
+ * recycled block (or none) in exchange, which libuvc reallocs to the
+ * size of the next frame.
+ */
+GstMemory *
+gst_thetauvc_allocator_take_frame(GstAllocator * allocator,
+    uvc_frame_t * frame)
+{
+    GstThetauvcAllocator *self = GST_THETAUVC_ALLOCATOR(allocator);
+    GstThetauvcMemory *tmem;
+    guint8 *data;
+    gsize   size;
+
+    g_return_val_if_fail(frame->library_owns_data, NULL);
+
+    g_mutex_lock(&self->lock);
+    if ((tmem = self->free_list) != NULL) {
+	self->free_list = tmem->next;
+	self->n_free--;
+    }
+    g_mutex_unlock(&self->lock);
+
+    if (tmem == NULL) {
+	tmem = g_slice_new(GstThetauvcMemory);
+	tmem->data = NULL;
+	tmem->alloc_size = 0;
+    }
+
+    data = frame->data;
+    size = frame->data_bytes;
+
+    frame->data = tmem->data;
+    frame->data_bytes = tmem->alloc_size;
+
+    tmem->data = data;
+    tmem->alloc_size = size;
+    tmem->next = NULL;
+
+    gst_memory_init(GST_MEMORY_CAST(tmem), 0, allocator, NULL, size, 0, 0,
+	size);
+
+    return GST_MEMORY_CAST(tmem);
+}
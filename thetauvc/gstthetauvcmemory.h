@@ -0,0 +1,68 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCMEMORY_H_
+#define _GST_THETAUVCMEMORY_H_
+
+#include <gst/gst.h>
+
+#include "libuvc/libuvc.h"
+
+G_BEGIN_DECLS
+#define GST_TYPE_THETAUVC_ALLOCATOR   (gst_thetauvc_allocator_get_type())
+#define GST_THETAUVC_ALLOCATOR(obj)   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_THETAUVC_ALLOCATOR,GstThetauvcAllocator))
+#define GST_IS_THETAUVC_ALLOCATOR(obj)   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_THETAUVC_ALLOCATOR))
+
+#define GST_THETAUVC_MEMORY_TYPE "ThetauvcFrameMemory"
+
+typedef struct _GstThetauvcMemory GstThetauvcMemory;
+typedef struct _GstThetauvcAllocator GstThetauvcAllocator;
+typedef struct _GstThetauvcAllocatorClass GstThetauvcAllocatorClass;
+
+/* Memory wrapping a frame payload taken over from libuvc */
+struct _GstThetauvcMemory
+{
+    GstMemory mem;
+
+    guint8 *data;
+    gsize   alloc_size;
+    GstThetauvcMemory *next;
+};
+
+struct _GstThetauvcAllocator
+{
+    GstAllocator parent;
+
+    GMutex  lock;
+    GstThetauvcMemory *free_list;
+    guint   n_free;
+};
+
+struct _GstThetauvcAllocatorClass
+{
+    GstAllocatorClass parent_class;
+};
+
+GType   gst_thetauvc_allocator_get_type(void);
+
+GstAllocator *gst_thetauvc_allocator_new(void);
+GstMemory *gst_thetauvc_allocator_take_frame(GstAllocator *, uvc_frame_t *);
+
+G_END_DECLS
+#endif
@@ -0,0 +1,435 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/*
+ * Lock-free frame queue between the libuvc callback and create().
+ *
+ * The producer never waits: it publishes a buffer by advancing tail and
+ * only enters the kernel when the consumer has announced that it is
+ * going to sleep.  The consumer sleeps on a futex (a mutex/cond pair on
+ * systems without one) keyed on wake_seq.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstthetauvcqueue.h"
+
+#if defined(__linux__)
+static void
+queue_futex_wait(atomic_uint * word, guint val, gint64 timeout_us)
+{
+    struct timespec ts, *tsp;
+
+    tsp = NULL;
+    if (timeout_us >= 0) {
+	ts.tv_sec = timeout_us / G_USEC_PER_SEC;
+	ts.tv_nsec = (timeout_us % G_USEC_PER_SEC) * 1000;
+	tsp = &ts;
+    }
+    syscall(SYS_futex, (int *) word, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+static void
+queue_futex_wake(atomic_uint * word)
+{
+    syscall(SYS_futex, (int *) word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif
+
+static void
+queue_wait(GstThetauvcQueue * q, atomic_uint * word, guint seq,
+    gint64 timeout_us)
+{
+    gint64  start;
+
+    start = g_get_monotonic_time();
+#if defined(__linux__)
+    queue_futex_wait(word, seq, timeout_us);
+#else
+    g_mutex_lock(&q->wake_lock);
+    while (atomic_load(word) == seq) {
+	if (timeout_us < 0)
+	    g_cond_wait(&q->wake_cond, &q->wake_lock);
+	else if (!g_cond_wait_until(&q->wake_cond, &q->wake_lock,
+		start + timeout_us))
+	    break;
+    }
+    g_mutex_unlock(&q->wake_lock);
+#endif
+    atomic_fetch_add_explicit(word == &q->space_seq ? &q->space_wait_time :
+	&q->wait_time, g_get_monotonic_time() - start, memory_order_relaxed);
+}
+
+static void
+queue_wake(GstThetauvcQueue * q, atomic_uint * word)
+{
+    atomic_fetch_add(word, 1);
+#if defined(__linux__)
+    queue_futex_wake(word);
+#else
+    g_mutex_lock(&q->wake_lock);
+    g_cond_broadcast(&q->wake_cond);
+    g_mutex_unlock(&q->wake_lock);
+#endif
+}
+
+GstThetauvcQueue *
+gst_thetauvc_queue_new(guint capacity)
+{
+    GstThetauvcQueue *q;
+    guint   size, i;
+
+    for (size = 2; size < capacity; size <<= 1);
+
+    q = g_new0(GstThetauvcQueue, 1);
+    q->slots = g_new(GstThetauvcQueueSlot, size);
+    for (i = 0; i < size; i++) {
+	atomic_init(&q->slots[i].buffer, NULL);
+	q->slots[i].flags = 0;
+	q->slots[i].size = 0;
+	q->slots[i].duration = 0;
+    }
+    q->mask = size - 1;
+
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->level_bytes, 0);
+    atomic_init(&q->level_time, 0);
+    atomic_init(&q->wake_seq, 0);
+    atomic_init(&q->waiting, 0);
+    atomic_init(&q->space_seq, 0);
+    atomic_init(&q->space_waiting, 0);
+    atomic_init(&q->discont, 0);
+    atomic_init(&q->flushing, 0);
+    atomic_init(&q->interrupted, 0);
+#if !defined(__linux__)
+    g_mutex_init(&q->wake_lock);
+    g_cond_init(&q->wake_cond);
+#endif
+    atomic_init(&q->pushed, 0);
+    atomic_init(&q->dropped, 0);
+    atomic_init(&q->stalls, 0);
+    atomic_init(&q->wakeups, 0);
+    atomic_init(&q->wait_time, 0);
+    atomic_init(&q->space_wait_time, 0);
+
+    return q;
+}
+
+void
+gst_thetauvc_queue_free(GstThetauvcQueue * q)
+{
+    gst_thetauvc_queue_flush(q);
+#if !defined(__linux__)
+    g_mutex_clear(&q->wake_lock);
+    g_cond_clear(&q->wake_cond);
+#endif
+    g_free(q->slots);
+    g_free(q);
+}
+
+void
+gst_thetauvc_queue_flush(GstThetauvcQueue * q)
+{
+    GstBuffer *buf;
+
+    while ((buf = gst_thetauvc_queue_pop(q)) != NULL)
+	gst_buffer_unref(buf);
+}
+
+guint
+gst_thetauvc_queue_length(GstThetauvcQueue * q)
+{
+    guint   head, tail;
+
+    head = atomic_load(&q->head);
+    tail = atomic_load(&q->tail);
+
+    return tail - head;
+}
+
+gboolean
+gst_thetauvc_queue_is_full(GstThetauvcQueue * q)
+{
+    return gst_thetauvc_queue_length(q) > q->mask;
+}
+
+guint
+gst_thetauvc_queue_capacity(GstThetauvcQueue * q)
+{
+    return q->mask + 1;
+}
+
+guint
+gst_thetauvc_queue_level_bytes(GstThetauvcQueue * q)
+{
+    return atomic_load_explicit(&q->level_bytes, memory_order_relaxed);
+}
+
+guint64
+gst_thetauvc_queue_level_time(GstThetauvcQueue * q)
+{
+    return atomic_load_explicit(&q->level_time, memory_order_relaxed);
+}
+
+/*
+ * Take the oldest buffer.  Safe from either side, the consumer and a
+ * producer making room race on head and the CAS decides the owner.
+ */
+GstBuffer *
+gst_thetauvc_queue_pop(GstThetauvcQueue * q)
+{
+    GstThetauvcQueueSlot *slot;
+    GstBuffer *buf;
+    GstClockTime duration;
+    guint   head, tail, size;
+
+    head = atomic_load_explicit(&q->head, memory_order_acquire);
+    do {
+	tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail)
+	    return NULL;
+	slot = &q->slots[head & q->mask];
+	buf = atomic_load_explicit(&slot->buffer, memory_order_relaxed);
+	size = slot->size;
+	duration = slot->duration;
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &head,
+	    head + 1, memory_order_seq_cst, memory_order_acquire));
+
+    atomic_fetch_sub_explicit(&q->level_bytes, size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&q->level_time, duration,
+	memory_order_relaxed);
+
+    if (atomic_load(&q->space_waiting))
+	queue_wake(q, &q->space_seq);
+
+    return buf;
+}
+
+/*
+ * Producer side.  Callers are expected to make room according to their
+ * overflow policy first; if the ring is still full the oldest buffer is
+ * dropped and FALSE is returned.
+ */
+gboolean
+gst_thetauvc_queue_push(GstThetauvcQueue * q, GstBuffer * buf, guint flags)
+{
+    GstThetauvcQueueSlot *slot;
+    gboolean ret;
+    guint   tail;
+
+    ret = TRUE;
+    while (gst_thetauvc_queue_is_full(q)) {
+	atomic_fetch_add_explicit(&q->stalls, 1, memory_order_relaxed);
+	gst_thetauvc_queue_drop_head(q);
+	ret = FALSE;
+    }
+
+    tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    slot = &q->slots[tail & q->mask];
+    slot->flags = flags;
+    slot->size = gst_buffer_get_size(buf);
+    slot->duration = GST_BUFFER_DURATION_IS_VALID(buf) ?
+	GST_BUFFER_DURATION(buf) : 0;
+    atomic_fetch_add_explicit(&q->level_bytes, slot->size,
+	memory_order_relaxed);
+    atomic_fetch_add_explicit(&q->level_time, slot->duration,
+	memory_order_relaxed);
+    atomic_store_explicit(&slot->buffer, buf, memory_order_relaxed);
+    atomic_store(&q->tail, tail + 1);
+    atomic_fetch_add_explicit(&q->pushed, 1, memory_order_relaxed);
+
+    /* pairs with the fence in pop_wait(), one side sees the other */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&q->waiting)) {
+	queue_wake(q, &q->wake_seq);
+	atomic_fetch_add_explicit(&q->wakeups, 1, memory_order_relaxed);
+    }
+
+    return ret;
+}
+
+guint
+gst_thetauvc_queue_head_index(GstThetauvcQueue * q)
+{
+    return atomic_load(&q->head);
+}
+
+guint
+gst_thetauvc_queue_tail_index(GstThetauvcQueue * q)
+{
+    return atomic_load(&q->tail);
+}
+
+/*
+ * Producer side.  The slot flags were written by the producer itself,
+ * so they stay valid even if the consumer takes the buffer meanwhile.
+ */
+gboolean
+gst_thetauvc_queue_head_is_key(GstThetauvcQueue * q)
+{
+    guint   head;
+
+    head = atomic_load(&q->head);
+    if (head == atomic_load(&q->tail))
+	return FALSE;
+
+    return (q->slots[head & q->mask].flags & GST_THETAUVC_QUEUE_FLAG_KEY) != 0;
+}
+
+/* Drop the oldest buffer and flag the gap for the consumer */
+gboolean
+gst_thetauvc_queue_drop_head(GstThetauvcQueue * q)
+{
+    GstBuffer *buf;
+
+    atomic_store(&q->discont, 1);
+    if ((buf = gst_thetauvc_queue_pop(q)) == NULL)
+	return FALSE;
+
+    gst_buffer_unref(buf);
+    gst_thetauvc_queue_count_drop(q);
+
+    return TRUE;
+}
+
+/* Account for a frame the producer discarded before queueing it */
+void
+gst_thetauvc_queue_count_drop(GstThetauvcQueue * q)
+{
+    atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+}
+
+/*
+ * Producer side.  Wait up to timeout_us for the consumer to take a
+ * buffer, head being the head index seen when the caller decided to
+ * wait.  Returns FALSE if nothing was taken.
+ */
+gboolean
+gst_thetauvc_queue_wait_space(GstThetauvcQueue * q, guint head,
+    gint64 timeout_us)
+{
+    guint   seq;
+
+    seq = atomic_load(&q->space_seq);
+    atomic_store(&q->space_waiting, 1);
+    if (atomic_load(&q->head) == head && !atomic_load(&q->flushing)) {
+	atomic_fetch_add_explicit(&q->stalls, 1, memory_order_relaxed);
+	queue_wait(q, &q->space_seq, seq, timeout_us);
+    }
+    atomic_store(&q->space_waiting, 0);
+
+    return atomic_load(&q->head) != head;
+}
+
+/* Consumer side.  TRUE once after frames were dropped. */
+gboolean
+gst_thetauvc_queue_take_discont(GstThetauvcQueue * q)
+{
+    if (atomic_load_explicit(&q->discont, memory_order_relaxed) == 0)
+	return FALSE;
+
+    return atomic_exchange(&q->discont, 0) != 0;
+}
+
+/*
+ * Wake up and keep out both sides while flushing, the consumer returns
+ * NULL and a blocked producer gives up.
+ */
+void
+gst_thetauvc_queue_set_flushing(GstThetauvcQueue * q, gboolean flushing)
+{
+    atomic_store(&q->flushing, flushing ? 1 : 0);
+    if (flushing) {
+	queue_wake(q, &q->wake_seq);
+	queue_wake(q, &q->space_seq);
+    }
+}
+
+gboolean
+gst_thetauvc_queue_is_flushing(GstThetauvcQueue * q)
+{
+    return atomic_load(&q->flushing) != 0;
+}
+
+/* Wake the consumer without a buffer, pop_wait() returns NULL */
+void
+gst_thetauvc_queue_interrupt(GstThetauvcQueue * q)
+{
+    atomic_store(&q->interrupted, 1);
+    queue_wake(q, &q->wake_seq);
+}
+
+/*
+ * Consumer side.  Waits up to timeout_us (-1 for ever) for a buffer,
+ * returns NULL on timeout, when flushing or interrupted.
+ */
+GstBuffer *
+gst_thetauvc_queue_pop_wait(GstThetauvcQueue * q, gint64 timeout_us)
+{
+    GstBuffer *buf;
+    gint64  end_time, now;
+    guint   seq;
+
+    end_time = timeout_us < 0 ? -1 : g_get_monotonic_time() + timeout_us;
+
+    while ((buf = gst_thetauvc_queue_pop(q)) == NULL) {
+	seq = atomic_load(&q->wake_seq);
+	atomic_store(&q->waiting, 1);
+	/* pop() loads tail with acquire only, keep it after the store */
+	atomic_thread_fence(memory_order_seq_cst);
+
+	/* recheck after announcing, the producer may have missed it */
+	if ((buf = gst_thetauvc_queue_pop(q)) != NULL) {
+	    atomic_store(&q->waiting, 0);
+	    break;
+	}
+	if (atomic_load(&q->flushing)
+	    || atomic_exchange(&q->interrupted, 0)) {
+	    atomic_store(&q->waiting, 0);
+	    break;
+	}
+
+	if (end_time < 0) {
+	    queue_wait(q, &q->wake_seq, seq, -1);
+	} else {
+	    now = g_get_monotonic_time();
+	    if (now >= end_time) {
+		atomic_store(&q->waiting, 0);
+		break;
+	    }
+	    queue_wait(q, &q->wake_seq, seq, end_time - now);
+	}
+	atomic_store(&q->waiting, 0);
+    }
+
+    return buf;
+}
@@ -0,0 +1,116 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCQUEUE_H_
+#define _GST_THETAUVCQUEUE_H_
+
+#include <stdatomic.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstThetauvcQueue GstThetauvcQueue;
+typedef struct _GstThetauvcQueueSlot GstThetauvcQueueSlot;
+
+#define GST_THETAUVC_QUEUE_FLAG_KEY (1 << 0)
+
+/* flags are written by the producer and only read back by it */
+struct _GstThetauvcQueueSlot
+{
+    _Atomic(GstBuffer *) buffer;
+    guint   flags;
+    guint   size;
+    GstClockTime duration;
+};
+
+/*
+ * Bounded single-producer/single-consumer ring of GstBuffers.
+ *
+ * The libuvc callback is the producer and create() the consumer.  The
+ * producer may also take buffers off the head to make room, so head is
+ * advanced with compare-and-swap and whoever wins owns the buffer.
+ */
+struct _GstThetauvcQueue
+{
+    GstThetauvcQueueSlot *slots;
+    guint   mask;
+
+    atomic_uint head;
+    atomic_uint tail;
+
+    /* amount of data between head and tail */
+    atomic_uint level_bytes;
+    atomic_ullong level_time;
+
+    /* wakeup of a sleeping consumer */
+    atomic_uint wake_seq;
+    atomic_int waiting;
+    /* wakeup of a producer waiting for room */
+    atomic_uint space_seq;
+    atomic_int space_waiting;
+#if !defined(__linux__)
+    GMutex  wake_lock;
+    GCond   wake_cond;
+#endif
+
+    /* set when frames were dropped, taken by the consumer */
+    atomic_int discont;
+    /* no waiting while set */
+    atomic_int flushing;
+    /* makes one pop_wait() return early */
+    atomic_int interrupted;
+
+    /* statistics */
+    atomic_ullong pushed;
+    atomic_ullong dropped;
+    atomic_ullong stalls;
+    atomic_ullong wakeups;
+    /* time asleep in microseconds, consumer for frames, producer for room */
+    atomic_ullong wait_time;
+    atomic_ullong space_wait_time;
+};
+
+GstThetauvcQueue *gst_thetauvc_queue_new(guint);
+void    gst_thetauvc_queue_free(GstThetauvcQueue *);
+void    gst_thetauvc_queue_flush(GstThetauvcQueue *);
+
+guint   gst_thetauvc_queue_length(GstThetauvcQueue *);
+guint   gst_thetauvc_queue_capacity(GstThetauvcQueue *);
+guint   gst_thetauvc_queue_level_bytes(GstThetauvcQueue *);
+guint64 gst_thetauvc_queue_level_time(GstThetauvcQueue *);
+gboolean gst_thetauvc_queue_is_full(GstThetauvcQueue *);
+
+gboolean gst_thetauvc_queue_push(GstThetauvcQueue *, GstBuffer *, guint);
+GstBuffer *gst_thetauvc_queue_pop(GstThetauvcQueue *);
+GstBuffer *gst_thetauvc_queue_pop_wait(GstThetauvcQueue *, gint64);
+
+guint   gst_thetauvc_queue_head_index(GstThetauvcQueue *);
+guint   gst_thetauvc_queue_tail_index(GstThetauvcQueue *);
+gboolean gst_thetauvc_queue_head_is_key(GstThetauvcQueue *);
+gboolean gst_thetauvc_queue_drop_head(GstThetauvcQueue *);
+void    gst_thetauvc_queue_count_drop(GstThetauvcQueue *);
+gboolean gst_thetauvc_queue_wait_space(GstThetauvcQueue *, guint, gint64);
+gboolean gst_thetauvc_queue_take_discont(GstThetauvcQueue *);
+void    gst_thetauvc_queue_set_flushing(GstThetauvcQueue *, gboolean);
+void    gst_thetauvc_queue_interrupt(GstThetauvcQueue *);
+gboolean gst_thetauvc_queue_is_flushing(GstThetauvcQueue *);
+
+G_END_DECLS
+#endif
@@ -0,0 +1,375 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+
+/*
+ * Pre-event ring and its dump to a file.
+ *
+ * create() copies every frame it pushes into the ring.  A dump takes a
+ * copy of the ring, then the live frames up to the requested time after
+ * the event, and writes them as an H.264 byte-stream on a thread of its
+ * own, so the main stream is not held up by the disk.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include "gstthetauvcring.h"
+
+/* end of the live frames in the dump queue */
+static gint ring_dump_end;
+
+struct _GstThetauvcRingDump
+{
+    FILE   *file;
+    gchar  *location;
+    GAsyncQueue *queue;
+    /* counted under the ring lock, read by the writer after the end */
+    guint   frames;
+    GstThetauvcRingDumpFunc func;
+    gpointer user_data;
+};
+
+GstThetauvcRing *
+gst_thetauvc_ring_new(GstThetauvcRingDumpFunc func, gpointer user_data)
+{
+    GstThetauvcRing *ring;
+
+    ring = g_new0(GstThetauvcRing, 1);
+    g_mutex_init(&ring->lock);
+    g_queue_init(&ring->frames);
+    g_queue_init(&ring->keys);
+    g_queue_init(&ring->spare);
+    ring->max_time = GST_CLOCK_TIME_NONE;
+    ring->dump_end = GST_CLOCK_TIME_NONE;
+    ring->dump_func = func;
+    ring->user_data = user_data;
+
+    return ring;
+}
+
+/* Drop the oldest frame and the rest of its GOP, lock held */
+static void
+ring_drop_gop(GstThetauvcRing * ring)
+{
+    GstThetauvcRingFrame *frame;
+
+    do {
+	frame = g_queue_pop_head(&ring->frames);
+	if (frame->key)
+	    g_queue_pop_head(&ring->keys);
+	ring->head = (ring->head + frame->size) % ring->size;
+	ring->used -= frame->size;
+	g_queue_push_tail(&ring->spare, frame);
+	frame = g_queue_peek_head(&ring->frames);
+    } while (frame != NULL && !frame->key);
+
+    if (ring->used == 0)
+	ring->head = 0;
+}
+
+static void
+ring_clear_frames(GstThetauvcRing * ring)
+{
+    while (!g_queue_is_empty(&ring->frames))
+	ring_drop_gop(ring);
+}
+
+/* Finish the live part of a dump, lock held */
+static void
+ring_end_dump(GstThetauvcRing * ring)
+{
+    if (ring->dump == NULL)
+	return;
+
+    /* the writer owns the dump from here */
+    g_async_queue_push(ring->dump->queue, &ring_dump_end);
+    ring->dump = NULL;
+}
+
+/* End a dump and wait for it to be written */
+static void
+ring_join_writer(GstThetauvcRing * ring)
+{
+    GThread *writer;
+
+    g_mutex_lock(&ring->lock);
+    ring_end_dump(ring);
+    writer = ring->writer;
+    ring->writer = NULL;
+    g_mutex_unlock(&ring->lock);
+
+    if (writer != NULL)
+	g_thread_join(writer);
+}
+
+void
+gst_thetauvc_ring_free(GstThetauvcRing * ring)
+{
+    gst_thetauvc_ring_reset(ring);
+    g_queue_clear_full(&ring->spare, g_free);
+    g_free(ring->data);
+    g_mutex_clear(&ring->lock);
+    g_free(ring);
+}
+
+/* Keep max_time of frames within size bytes, 0 disables the ring */
+void
+gst_thetauvc_ring_set_limits(GstThetauvcRing * ring, GstClockTime max_time,
+    gsize size)
+{
+    g_mutex_lock(&ring->lock);
+    ring_clear_frames(ring);
+    if (size != ring->size) {
+	g_free(ring->data);
+	ring->data = size > 0 ? g_malloc(size) : NULL;
+	ring->size = size;
+    }
+    ring->max_time = max_time;
+    g_mutex_unlock(&ring->lock);
+}
+
+/* Forget the frames and finish a dump in progress */
+void
+gst_thetauvc_ring_reset(GstThetauvcRing * ring)
+{
+    ring_join_writer(ring);
+
+    g_mutex_lock(&ring->lock);
+    ring_clear_frames(ring);
+    gst_buffer_replace(&ring->headers, NULL);
+    g_mutex_unlock(&ring->lock);
+}
+
+/* Hand a live frame to the dump writer, lock held */
+static void
+ring_forward(GstThetauvcRing * ring, GstBuffer * buf, GstClockTime pts,
+    gboolean key)
+{
+    /* counted from the first live frame when the ring was empty */
+    if (!GST_CLOCK_TIME_IS_VALID(ring->dump_end)
+	&& GST_CLOCK_TIME_IS_VALID(pts))
+	ring->dump_end = pts + ring->dump_duration;
+    if (GST_CLOCK_TIME_IS_VALID(pts) && pts >= ring->dump_end) {
+	ring_end_dump(ring);
+	return;
+    }
+
+    /* the file starts at a key frame with its parameter sets */
+    if (!ring->dump_keyed) {
+	if (!key)
+	    return;
+	if (!GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER)
+	    && ring->headers != NULL)
+	    g_async_queue_push(ring->dump->queue,
+		gst_buffer_ref(ring->headers));
+	ring->dump_keyed = TRUE;
+    }
+    g_async_queue_push(ring->dump->queue, gst_buffer_ref(buf));
+    ring->dump->frames++;
+}
+
+/* Add a frame pushed downstream, with the latest SPS/PPS */
+void
+gst_thetauvc_ring_push(GstThetauvcRing * ring, GstBuffer * buf,
+    GstBuffer * headers)
+{
+    GstThetauvcRingFrame *frame, *second;
+    GstClockTime pts;
+    gboolean key;
+    gsize   size, first;
+
+    pts = GST_BUFFER_PTS(buf);
+    key = !GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    size = gst_buffer_get_size(buf);
+
+    g_mutex_lock(&ring->lock);
+    if (headers != ring->headers)
+	gst_buffer_replace(&ring->headers, headers);
+    if (ring->dump != NULL)
+	ring_forward(ring, buf, pts, key);
+
+    if (ring->size == 0 || size == 0) {
+	g_mutex_unlock(&ring->lock);
+	return;
+    }
+    if (size > ring->size) {
+	ring_clear_frames(ring);
+	g_mutex_unlock(&ring->lock);
+	return;
+    }
+
+    /* whole GOPs from the oldest, first for the bytes, then for the time */
+    while (ring->used + size > ring->size)
+	ring_drop_gop(ring);
+    while (ring->keys.length > 1 && GST_CLOCK_TIME_IS_VALID(pts)) {
+	second = g_queue_peek_nth(&ring->keys, 1);
+	if (!GST_CLOCK_TIME_IS_VALID(second->pts)
+	    || second->pts + ring->max_time > pts)
+	    break;
+	ring_drop_gop(ring);
+    }
+
+    /* a GOP without its key frame is of no use */
+    if (!key && g_queue_is_empty(&ring->frames)) {
+	g_mutex_unlock(&ring->lock);
+	return;
+    }
+
+    if ((frame = g_queue_pop_head(&ring->spare)) == NULL)
+	frame = g_new(GstThetauvcRingFrame, 1);
+    frame->offset = (ring->head + ring->used) % ring->size;
+    frame->size = size;
+    frame->pts = pts;
+    frame->key = key;
+    frame->header = GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER);
+
+    first = MIN(size, ring->size - frame->offset);
+    gst_buffer_extract(buf, 0, ring->data + frame->offset, first);
+    if (first < size)
+	gst_buffer_extract(buf, first, ring->data, size - first);
+    ring->used += size;
+
+    g_queue_push_tail(&ring->frames, frame);
+    if (key)
+	g_queue_push_tail(&ring->keys, frame);
+    g_mutex_unlock(&ring->lock);
+}
+
+static  gpointer
+ring_writer_thread(gpointer data)
+{
+    GstThetauvcRingDump *dump = data;
+    gpointer item;
+    GstMapInfo map;
+    guint64 bytes = 0;
+    gint    err = 0;
+
+    while ((item = g_async_queue_pop(dump->queue)) != &ring_dump_end) {
+	GstBuffer *buf = item;
+
+	if (err == 0 && gst_buffer_map(buf, &map, GST_MAP_READ)) {
+	    if (fwrite(map.data, 1, map.size, dump->file) != map.size)
+		err = errno != 0 ? errno : EIO;
+	    bytes += map.size;
+	    gst_buffer_unmap(buf, &map);
+	}
+	gst_buffer_unref(buf);
+    }
+    if (fclose(dump->file) != 0 && err == 0)
+	err = errno;
+
+    if (dump->func != NULL)
+	dump->func(dump->location, dump->frames, bytes,
+	    err != 0 ? g_strerror(err) : NULL, dump->user_data);
+
+    g_async_queue_unref(dump->queue);
+    g_free(dump->location);
+    g_free(dump);
+
+    return NULL;
+}
+
+/*
+ * Write the ring and the live frames for duration after the latest one
+ * to location.  Only one dump runs at a time.
+ */
+gboolean
+gst_thetauvc_ring_dump(GstThetauvcRing * ring, const gchar * location,
+    GstClockTime duration, GError ** error)
+{
+    GstThetauvcRingDump *dump;
+    GstThetauvcRingFrame *frame;
+    GstBuffer *snapshot;
+    GThread *finished;
+    gsize   first;
+    FILE   *file;
+
+    g_mutex_lock(&ring->lock);
+    if (ring->dump != NULL) {
+	g_mutex_unlock(&ring->lock);
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_BUSY,
+	    "a dump is already in progress");
+	return FALSE;
+    }
+    finished = ring->writer;
+    ring->writer = NULL;
+    g_mutex_unlock(&ring->lock);
+    if (finished != NULL)
+	g_thread_join(finished);
+
+    if ((file = g_fopen(location, "wb")) == NULL) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_WRITE,
+	    "could not open %s: %s", location, g_strerror(errno));
+	return FALSE;
+    }
+
+    g_mutex_lock(&ring->lock);
+    /* another dump started while the file was opened */
+    if (ring->dump != NULL || ring->writer != NULL) {
+	g_mutex_unlock(&ring->lock);
+	fclose(file);
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_BUSY,
+	    "a dump is already in progress");
+	return FALSE;
+    }
+
+    dump = g_new0(GstThetauvcRingDump, 1);
+    dump->file = file;
+    dump->location = g_strdup(location);
+    dump->queue = g_async_queue_new();
+    dump->func = ring->dump_func;
+    dump->user_data = ring->user_data;
+
+    frame = g_queue_peek_head(&ring->frames);
+    if (frame != NULL) {
+	if (!frame->header && ring->headers != NULL)
+	    g_async_queue_push(dump->queue, gst_buffer_ref(ring->headers));
+
+	/* one copy of the arena, in order */
+	snapshot = gst_buffer_new_allocate(NULL, ring->used, NULL);
+	first = MIN(ring->used, ring->size - ring->head);
+	gst_buffer_fill(snapshot, 0, ring->data + ring->head, first);
+	if (first < ring->used)
+	    gst_buffer_fill(snapshot, first, ring->data, ring->used - first);
+	g_async_queue_push(dump->queue, snapshot);
+	dump->frames = ring->frames.length;
+    }
+
+    frame = g_queue_peek_tail(&ring->frames);
+    ring->dump_duration = duration;
+    ring->dump_end = frame != NULL && GST_CLOCK_TIME_IS_VALID(frame->pts) ?
+	frame->pts + duration : GST_CLOCK_TIME_NONE;
+    ring->dump_keyed = frame != NULL;
+    ring->dump = dump;
+    if (duration == 0)
+	ring_end_dump(ring);
+    ring->writer = g_thread_new("thetauvc-dump", ring_writer_thread, dump);
+    g_mutex_unlock(&ring->lock);
+
+    return TRUE;
+}
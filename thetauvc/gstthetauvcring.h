@@ -0,0 +1,89 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GST_THETAUVCRING_H_
+#define _GST_THETAUVCRING_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstThetauvcRing GstThetauvcRing;
+typedef struct _GstThetauvcRingFrame GstThetauvcRingFrame;
+typedef struct _GstThetauvcRingDump GstThetauvcRingDump;
+
+/* called on the writer thread when a dump is over, error is NULL on success */
+typedef void (*GstThetauvcRingDumpFunc) (const gchar * location,
+    guint frames, guint64 bytes, const gchar * error, gpointer user_data);
+
+struct _GstThetauvcRingFrame
+{
+    gsize   offset;
+    gsize   size;
+    GstClockTime pts;
+    gboolean key;
+    gboolean header;
+};
+
+/*
+ * Pre-event ring of the latest frames, starting at a key frame.  The
+ * frames are copied into one arena allocated up front, so the buffers
+ * go back to their pool, and whole GOPs are dropped from the oldest to
+ * stay within the byte budget and the time kept.
+ */
+struct _GstThetauvcRing
+{
+    GMutex  lock;
+
+    guint8 *data;
+    gsize   size;
+    /* offset of the oldest frame and bytes in use from there */
+    gsize   head;
+    gsize   used;
+    GstClockTime max_time;
+
+    /* GstThetauvcRingFrame, oldest first */
+    GQueue  frames;
+    GQueue  keys;
+    GQueue  spare;
+    /* latest SPS/PPS, for a first key frame without them */
+    GstBuffer *headers;
+
+    /* dump in progress, live frames go to the writer until dump_end */
+    GThread *writer;
+    GstThetauvcRingDump *dump;
+    GstClockTime dump_duration;
+    GstClockTime dump_end;
+    gboolean dump_keyed;
+
+    GstThetauvcRingDumpFunc dump_func;
+    gpointer user_data;
+};
+
+GstThetauvcRing *gst_thetauvc_ring_new(GstThetauvcRingDumpFunc, gpointer);
+void    gst_thetauvc_ring_free(GstThetauvcRing *);
+void    gst_thetauvc_ring_set_limits(GstThetauvcRing *, GstClockTime, gsize);
+void    gst_thetauvc_ring_reset(GstThetauvcRing *);
+void    gst_thetauvc_ring_push(GstThetauvcRing *, GstBuffer *, GstBuffer *);
+gboolean gst_thetauvc_ring_dump(GstThetauvcRing *, const gchar *,
+    GstClockTime, GError **);
+
+G_END_DECLS
+#endif
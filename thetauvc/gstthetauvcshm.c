@@ -0,0 +1,941 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+
+/*
+ * Shared memory fan-out of the frames of one camera.
+ *
+ * The source which opens the camera publishes every frame it pushes into
+ * a ring in a memfd, and hands the memfd to the readers connecting to its
+ * Unix socket.  Readers wrap the frames in place.  Each of them announces
+ * the oldest position it still references, and the server drops frames
+ * rather than overwrite them.  A reader which falls behind finds that its
+ * frames were overwritten and skips ahead by itself.
+ */
+
+/* memfd_create() */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include <gst/gst.h>
+
+#include "gstthetauvcshm.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvc_shm_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvc_shm_debug_category
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* polling interval of readers without futex (us) */
+#define THETAUVC_SHM_POLL_INTERVAL 1000
+/* a reader holding frames longer than this no longer holds up the others */
+#define THETAUVC_SHM_STALL_TIMEOUT G_USEC_PER_SEC
+
+/* a frame referenced by a buffer of a reader */
+typedef struct
+{
+    GstThetauvcShmClient *client;
+    guint64 pos;
+    gsize   size;
+    gboolean released;
+} GstThetauvcShmHeld;
+
+static void
+shm_debug_init(void)
+{
+    static gsize done = 0;
+
+    if (g_once_init_enter(&done)) {
+	GST_DEBUG_CATEGORY_INIT(gst_thetauvc_shm_debug_category,
+	    "thetauvcshm", 0, "shared memory fan-out");
+	g_once_init_leave(&done, 1);
+    }
+}
+
+#if defined(__linux__)
+static void
+shm_futex_wait(atomic_uint * word, guint val, gint64 timeout_us)
+{
+    struct timespec ts;
+
+    ts.tv_sec = timeout_us / G_USEC_PER_SEC;
+    ts.tv_nsec = (timeout_us % G_USEC_PER_SEC) * 1000;
+    /* shared between processes, not FUTEX_PRIVATE */
+    syscall(SYS_futex, (int *) word, FUTEX_WAIT, val, &ts, NULL, 0);
+}
+
+static void
+shm_futex_wake(atomic_uint * word)
+{
+    syscall(SYS_futex, (int *) word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+#endif
+
+static void
+shm_cloexec(gint fd)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+/* Anonymous shared memory, passed on as a file descriptor */
+static  gint
+shm_memfd(void)
+{
+#if defined(__linux__)
+    return memfd_create("thetauvc", MFD_CLOEXEC);
+#else
+    gchar  *name;
+    gint    fd;
+
+    name = g_strdup_printf("/thetauvc-%d-%u", (gint) getpid(),
+	g_random_int());
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+	shm_unlink(name);
+	shm_cloexec(fd);
+    }
+    g_free(name);
+    return fd;
+#endif
+}
+
+static  gboolean
+shm_socket_address(const gchar * path, struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+	return FALSE;
+    strcpy(addr->sun_path, path);
+    return TRUE;
+}
+
+/*
+ * Remove a socket left behind by a source which did not stop.  Anything
+ * else on path, or a socket somebody still accepts on, is left alone.
+ */
+static  gboolean
+shm_remove_stale_socket(const gchar * path, const struct sockaddr_un *addr)
+{
+    struct stat st;
+    gint    fd, err;
+
+    if (lstat(path, &st) != 0)
+	return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode)) {
+	errno = EEXIST;
+	return FALSE;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	return FALSE;
+    err = connect(fd, (const struct sockaddr *) addr, sizeof(*addr)) == 0 ?
+	0 : errno;
+    close(fd);
+    if (err != ECONNREFUSED) {
+	errno = EADDRINUSE;
+	return FALSE;
+    }
+
+    GST_DEBUG("removing stale socket %s", path);
+    return unlink(path) == 0 || errno == ENOENT;
+}
+
+static  gboolean
+shm_send_fd(gint sock, gint fd, guint32 index)
+{
+    struct msghdr msg = { 0 };
+    struct iovec iov = { &index, sizeof(index) };
+    union
+    {
+	struct cmsghdr hdr;
+	gchar   buf[CMSG_SPACE(sizeof(gint))];
+    } control;
+    struct cmsghdr *cmsg;
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(gint));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(gint));
+
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(index);
+}
+
+static  gint
+shm_recv_fd(gint sock, guint32 * index)
+{
+    struct msghdr msg = { 0 };
+    struct iovec iov = { index, sizeof(*index) };
+    union
+    {
+	struct cmsghdr hdr;
+	gchar   buf[CMSG_SPACE(sizeof(gint))];
+    } control;
+    struct cmsghdr *cmsg;
+    gint    fd;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (recvmsg(sock, &msg, 0) != sizeof(*index))
+	return -1;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+	|| cmsg->cmsg_type != SCM_RIGHTS)
+	return -1;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(gint));
+    shm_cloexec(fd);
+
+    return fd;
+}
+
+/* The reader went away, its frames are free */
+static void
+shm_server_drop_client(GstThetauvcShmServer * server, guint i)
+{
+    GstThetauvcShmReader *reader = &server->header->readers[i];
+
+    close(server->clients[i]);
+    server->clients[i] = -1;
+    atomic_store(&reader->active, 0);
+    atomic_store(&reader->evicted, 0);
+    atomic_store(&reader->hold, GST_THETAUVC_SHM_NO_HOLD);
+    GST_DEBUG("reader %u left", i);
+}
+
+static void
+shm_server_accept(GstThetauvcShmServer * server)
+{
+    GstThetauvcShmReader *reader;
+    gint    fd;
+    guint   i;
+
+    if ((fd = accept(server->listen_fd, NULL, NULL)) < 0)
+	return;
+    shm_cloexec(fd);
+
+    for (i = 0; i < GST_THETAUVC_SHM_READERS; i++)
+	if (server->clients[i] < 0)
+	    break;
+    if (i == GST_THETAUVC_SHM_READERS) {
+	GST_WARNING("more than %d readers, refused",
+	    GST_THETAUVC_SHM_READERS);
+	close(fd);
+	return;
+    }
+
+    reader = &server->header->readers[i];
+    atomic_store(&reader->hold, GST_THETAUVC_SHM_NO_HOLD);
+    atomic_store(&reader->evicted, 0);
+    atomic_store(&reader->read_seq, atomic_load(&server->header->write_seq));
+    atomic_store(&reader->active, 1);
+    if (!shm_send_fd(fd, server->memfd, i)) {
+	atomic_store(&reader->active, 0);
+	close(fd);
+	return;
+    }
+    server->clients[i] = fd;
+    GST_DEBUG("reader %u connected", i);
+}
+
+/* Hands the memfd to new readers and notices the ones leaving */
+static  gpointer
+shm_server_thread(gpointer data)
+{
+    GstThetauvcShmServer *server = data;
+    struct pollfd fds[2 + GST_THETAUVC_SHM_READERS];
+    guint   index[2 + GST_THETAUVC_SHM_READERS];
+    guint   n, i;
+
+    while (1) {
+	n = 0;
+	fds[n].fd = server->wake[0];
+	fds[n++].events = POLLIN;
+	fds[n].fd = server->listen_fd;
+	fds[n++].events = POLLIN;
+	for (i = 0; i < GST_THETAUVC_SHM_READERS; i++) {
+	    if (server->clients[i] < 0)
+		continue;
+	    index[n] = i;
+	    fds[n].fd = server->clients[i];
+	    fds[n++].events = POLLIN;
+	}
+
+	if (poll(fds, n, -1) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	if (fds[0].revents != 0)
+	    break;
+
+	/* readers send nothing, anything is a hang-up */
+	for (i = 2; i < n; i++)
+	    if (fds[i].revents != 0)
+		shm_server_drop_client(server, index[i]);
+	if (fds[1].revents & POLLIN)
+	    shm_server_accept(server);
+    }
+
+    return NULL;
+}
+
+/*
+ * Create the ring with data_size bytes for the frames and listen for
+ * readers on path.
+ */
+GstThetauvcShmServer *
+gst_thetauvc_shm_server_new(const gchar * path, gsize data_size,
+    GError ** error)
+{
+    GstThetauvcShmServer *server;
+    GstThetauvcShmHeader *h;
+    struct sockaddr_un addr;
+    gsize   header_size;
+    guint   i;
+
+    shm_debug_init();
+
+    server = g_new0(GstThetauvcShmServer, 1);
+    server->path = g_strdup(path);
+    server->memfd = server->listen_fd = -1;
+    server->wake[0] = server->wake[1] = -1;
+    for (i = 0; i < GST_THETAUVC_SHM_READERS; i++)
+	server->clients[i] = -1;
+
+    header_size = (sizeof(GstThetauvcShmHeader) + 4095) & ~(gsize) 4095;
+    server->map_size = header_size + data_size;
+    if ((server->memfd = shm_memfd()) < 0
+	|| ftruncate(server->memfd, server->map_size) != 0) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NO_SPACE_LEFT,
+	    "could not create shared memory: %s", g_strerror(errno));
+	goto fail;
+    }
+    h = mmap(NULL, server->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	server->memfd, 0);
+    if (h == MAP_FAILED) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_NO_SPACE_LEFT,
+	    "could not map shared memory: %s", g_strerror(errno));
+	goto fail;
+    }
+    server->header = h;
+    server->data = (guint8 *) h + header_size;
+
+    h->n_slots = GST_THETAUVC_SHM_SLOTS;
+    h->n_readers = GST_THETAUVC_SHM_READERS;
+    h->data_offset = header_size;
+    h->data_size = data_size;
+    for (i = 0; i < GST_THETAUVC_SHM_READERS; i++)
+	atomic_store(&h->readers[i].hold, GST_THETAUVC_SHM_NO_HOLD);
+    h->version = GST_THETAUVC_SHM_VERSION;
+    atomic_thread_fence(memory_order_release);
+    h->magic = GST_THETAUVC_SHM_MAGIC;
+
+    if (!shm_socket_address(path, &addr)) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_SETTINGS,
+	    "socket path %s is too long", path);
+	goto fail;
+    }
+    if ((server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	goto socket_error;
+    shm_cloexec(server->listen_fd);
+    if (!shm_remove_stale_socket(path, &addr)
+	|| bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+	goto socket_error;
+    server->bound = TRUE;
+    if (listen(server->listen_fd, GST_THETAUVC_SHM_READERS) != 0)
+	goto socket_error;
+
+    if (pipe(server->wake) != 0)
+	goto socket_error;
+    shm_cloexec(server->wake[0]);
+    shm_cloexec(server->wake[1]);
+    server->thread = g_thread_new("thetauvc-shm", shm_server_thread, server);
+    GST_DEBUG("serving %" G_GSIZE_FORMAT " bytes on %s", data_size, path);
+
+    return server;
+
+  socket_error:
+    g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_READ_WRITE,
+	"could not listen on %s: %s", path, g_strerror(errno));
+  fail:
+    gst_thetauvc_shm_server_free(server);
+    return NULL;
+}
+
+void
+gst_thetauvc_shm_server_free(GstThetauvcShmServer * server)
+{
+    GstThetauvcShmHeader *h = server->header;
+    guint   i;
+
+    if (server->thread != NULL) {
+	if (write(server->wake[1], "x", 1) != 1)
+	    GST_WARNING("could not stop the socket thread");
+	g_thread_join(server->thread);
+    }
+    for (i = 0; i < GST_THETAUVC_SHM_READERS; i++)
+	if (server->clients[i] >= 0)
+	    close(server->clients[i]);
+
+    if (h != NULL) {
+	/* readers waiting for a frame see the end */
+	atomic_store(&h->closed, 1);
+	atomic_fetch_add(&h->notify, 1);
+#if defined(__linux__)
+	shm_futex_wake(&h->notify);
+#endif
+	munmap(h, server->map_size);
+    }
+    if (server->listen_fd >= 0)
+	close(server->listen_fd);
+    if (server->bound)
+	unlink(server->path);
+    if (server->wake[0] >= 0) {
+	close(server->wake[0]);
+	close(server->wake[1]);
+    }
+    if (server->memfd >= 0)
+	close(server->memfd);
+    gst_caps_replace(&server->caps, NULL);
+    g_free(server->path);
+    g_free(server);
+}
+
+static void
+shm_server_set_caps(GstThetauvcShmServer * server, GstCaps * caps)
+{
+    GstThetauvcShmHeader *h = server->header;
+    gchar  *str;
+    gsize   len;
+    guint   seq;
+
+    gst_caps_replace(&server->caps, caps);
+    str = gst_caps_to_string(caps);
+    len = strlen(str);
+    if (len >= GST_THETAUVC_SHM_CAPS_SIZE) {
+	GST_WARNING("caps of %" G_GSIZE_FORMAT " bytes do not fit", len);
+	g_free(str);
+	return;
+    }
+
+    seq = atomic_load_explicit(&h->caps_seq, memory_order_relaxed);
+    atomic_store_explicit(&h->caps_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(h->caps, str, len + 1);
+    atomic_store_explicit(&h->caps_seq, seq + 2, memory_order_release);
+    g_free(str);
+}
+
+/*
+ * Copy a frame into the ring, runs in create().  Returns FALSE if the
+ * frame was dropped because a reader still references the space it
+ * needs, the stream then resumes at the next key frame.
+ */
+gboolean
+gst_thetauvc_shm_server_publish(GstThetauvcShmServer * server,
+    GstBuffer * buf, GstClockTime capture, GstCaps * caps)
+{
+    GstThetauvcShmHeader *h = server->header;
+    GstThetauvcShmReader *reader;
+    GstThetauvcShmSlot *slot;
+    guint64 seq, pos, end, reclaim, off;
+    gboolean key, blocked;
+    gint64  now;
+    gsize   size;
+    guint   i;
+
+    if (caps != NULL && caps != server->caps
+	&& (server->caps == NULL || !gst_caps_is_equal(caps, server->caps)))
+	shm_server_set_caps(server, caps);
+    else if (caps != NULL)
+	gst_caps_replace(&server->caps, caps);
+
+    size = gst_buffer_get_size(buf);
+    key = !GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DISCONT))
+	server->discont = TRUE;
+    if ((server->skip_to_key && !key) || size == 0 || size > h->data_size)
+	goto drop;
+
+    pos = server->pos;
+    off = pos % h->data_size;
+    if (off + size > h->data_size) {
+	pos += h->data_size - off;
+	off = 0;
+    }
+    end = pos + size;
+
+    /* pairs with the hold of the readers, one of the two sees the other */
+    reclaim = end > h->data_size ? end - h->data_size : 0;
+    if (reclaim > atomic_load(&h->reclaim))
+	atomic_store(&h->reclaim, reclaim);
+    now = g_get_monotonic_time();
+    blocked = FALSE;
+    for (i = 0; i < GST_THETAUVC_SHM_READERS; i++) {
+	reader = &h->readers[i];
+	if (!atomic_load(&reader->active) || atomic_load(&reader->evicted)
+	    || atomic_load(&reader->hold) >= reclaim) {
+	    server->stalled[i] = 0;
+	    continue;
+	}
+	if (server->stalled[i] == 0)
+	    server->stalled[i] = now;
+	if (now - server->stalled[i] > THETAUVC_SHM_STALL_TIMEOUT) {
+	    /* its buffers may be overwritten, it reads copies from now on */
+	    GST_WARNING("reader %u held frames for too long, evicted", i);
+	    atomic_store(&reader->evicted, 1);
+	    server->stalled[i] = 0;
+	    continue;
+	}
+	GST_LOG("reader %u holds %" G_GUINT64_FORMAT ", dropping", i,
+	    (guint64) atomic_load(&reader->hold));
+	blocked = TRUE;
+    }
+    if (blocked) {
+	server->skip_to_key = TRUE;
+	server->discont = TRUE;
+	goto drop;
+    }
+
+    seq = atomic_load_explicit(&h->write_seq, memory_order_relaxed);
+    slot = &h->slots[seq % h->n_slots];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->pos = pos;
+    slot->size = size;
+    slot->flags = (key ? GST_THETAUVC_SHM_FLAG_KEY : 0)
+	| (server->discont ? GST_THETAUVC_SHM_FLAG_DISCONT : 0)
+	| (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER) ?
+	GST_THETAUVC_SHM_FLAG_HEADER : 0);
+    slot->capture = capture;
+    slot->duration = GST_BUFFER_DURATION(buf);
+    gst_buffer_extract(buf, 0, server->data + off, size);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+    atomic_store(&h->write_seq, seq + 1);
+
+    server->pos = end;
+    server->skip_to_key = FALSE;
+    server->discont = FALSE;
+
+    atomic_fetch_add(&h->notify, 1);
+#if defined(__linux__)
+    if (atomic_load(&h->waiters) > 0)
+	shm_futex_wake(&h->notify);
+#endif
+    return TRUE;
+
+  drop:
+    server->dropped++;
+    return FALSE;
+}
+
+/* Connect to the server listening on path and map its ring */
+GstThetauvcShmClient *
+gst_thetauvc_shm_client_new(const gchar * path, GError ** error)
+{
+    GstThetauvcShmClient *client;
+    GstThetauvcShmHeader *h;
+    struct sockaddr_un addr;
+    struct stat st;
+    guint32 index;
+    gpointer map;
+
+    shm_debug_init();
+
+    client = g_new0(GstThetauvcShmClient, 1);
+    client->refcount = 1;
+    client->sock = client->memfd = -1;
+    g_mutex_init(&client->lock);
+    g_queue_init(&client->held);
+
+    if (!shm_socket_address(path, &addr)) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_SETTINGS,
+	    "socket path %s is too long", path);
+	goto fail;
+    }
+    if ((client->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	|| connect(client->sock, (struct sockaddr *) &addr,
+	    sizeof(addr)) != 0) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_READ,
+	    "could not connect to %s: %s", path, g_strerror(errno));
+	goto fail;
+    }
+    shm_cloexec(client->sock);
+
+    if ((client->memfd = shm_recv_fd(client->sock, &index)) < 0
+	|| fstat(client->memfd, &st) != 0
+	|| (gsize) st.st_size < sizeof(GstThetauvcShmHeader)) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_READ,
+	    "no shared memory from %s (too many readers?)", path);
+	goto fail;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	client->memfd, 0);
+    if (map == MAP_FAILED) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_READ,
+	    "could not map shared memory: %s", g_strerror(errno));
+	goto fail;
+    }
+    client->header = h = map;
+    client->map_size = st.st_size;
+
+    if (h->magic != GST_THETAUVC_SHM_MAGIC
+	|| h->version != GST_THETAUVC_SHM_VERSION
+	|| h->n_slots != GST_THETAUVC_SHM_SLOTS
+	|| index >= h->n_readers
+	|| h->data_offset + h->data_size > client->map_size) {
+	g_set_error(error, GST_RESOURCE_ERROR, GST_RESOURCE_ERROR_OPEN_READ,
+	    "unknown shared memory layout from %s", path);
+	goto fail;
+    }
+    client->index = index;
+    client->data = (guint8 *) map + h->data_offset;
+    client->caps_seq = G_MAXUINT;
+    GST_DEBUG("reader %u of %s", index, path);
+
+    return client;
+
+  fail:
+    gst_thetauvc_shm_client_unref(client);
+    return NULL;
+}
+
+GstThetauvcShmClient *
+gst_thetauvc_shm_client_ref(GstThetauvcShmClient * client)
+{
+    g_atomic_int_inc(&client->refcount);
+    return client;
+}
+
+/* The mapping stays until the last buffer wrapping it is gone */
+void
+gst_thetauvc_shm_client_unref(GstThetauvcShmClient * client)
+{
+    if (!g_atomic_int_dec_and_test(&client->refcount))
+	return;
+
+    if (client->header != NULL)
+	munmap(client->header, client->map_size);
+    if (client->memfd >= 0)
+	close(client->memfd);
+    /* the server frees the reader on hang-up */
+    if (client->sock >= 0)
+	close(client->sock);
+    g_mutex_clear(&client->lock);
+    g_free(client);
+}
+
+/* Wait for frame seq to be published, FALSE on timeout or flushing */
+gboolean
+gst_thetauvc_shm_client_wait(GstThetauvcShmClient * client, guint64 seq,
+    gint64 timeout_us)
+{
+    GstThetauvcShmHeader *h = client->header;
+    guint   notify;
+
+    if (atomic_load(&h->write_seq) > seq)
+	return TRUE;
+
+#if defined(__linux__)
+    /* pairs with the waiters check in publish() */
+    notify = atomic_load(&h->notify);
+    atomic_fetch_add(&h->waiters, 1);
+    if (atomic_load(&h->write_seq) <= seq && !atomic_load(&h->closed)
+	&& !atomic_load(&client->flushing))
+	shm_futex_wait(&h->notify, notify, timeout_us);
+    atomic_fetch_sub(&h->waiters, 1);
+#else
+    (void) notify;
+    if (!atomic_load(&client->flushing))
+	g_usleep(MIN(timeout_us, THETAUVC_SHM_POLL_INTERVAL));
+#endif
+
+    return atomic_load(&h->write_seq) > seq;
+}
+
+/*
+ * Wake wait() from another thread.  The futex is shared with the other
+ * readers, they wake up as well and go back to sleep.
+ */
+void
+gst_thetauvc_shm_client_set_flushing(GstThetauvcShmClient * client,
+    gboolean flushing)
+{
+    GstThetauvcShmHeader *h = client->header;
+
+    atomic_store(&client->flushing, flushing);
+    if (!flushing)
+	return;
+
+    /* a waiter which missed the flag sleeps on the old value */
+    atomic_fetch_add(&h->notify, 1);
+#if defined(__linux__)
+    shm_futex_wake(&h->notify);
+#endif
+}
+
+/* Reference the data from pos on, before checking that it is still there */
+static  GstThetauvcShmHeld *
+shm_client_hold(GstThetauvcShmClient * client, guint64 pos, gsize size)
+{
+    GstThetauvcShmHeld *held;
+
+    held = g_new(GstThetauvcShmHeld, 1);
+    held->client = gst_thetauvc_shm_client_ref(client);
+    held->pos = pos;
+    held->size = size;
+    held->released = FALSE;
+
+    g_mutex_lock(&client->lock);
+    if (g_queue_is_empty(&client->held))
+	atomic_store(&client->header->readers[client->index].hold, pos);
+    g_queue_push_tail(&client->held, held);
+    client->held_bytes += size;
+    g_mutex_unlock(&client->lock);
+
+    return held;
+}
+
+/* Buffers may be freed in any order, the hold is the oldest one left */
+static void
+shm_client_release(gpointer data)
+{
+    GstThetauvcShmHeld *held = data, *head;
+    GstThetauvcShmClient *client = held->client;
+
+    g_mutex_lock(&client->lock);
+    held->released = TRUE;
+    client->held_bytes -= held->size;
+    while ((head = g_queue_peek_head(&client->held)) != NULL
+	&& head->released)
+	g_free(g_queue_pop_head(&client->held));
+    atomic_store(&client->header->readers[client->index].hold,
+	head != NULL ? head->pos : GST_THETAUVC_SHM_NO_HOLD);
+    g_mutex_unlock(&client->lock);
+
+    gst_thetauvc_shm_client_unref(client);
+}
+
+/*
+ * An evicted reader has no hold, copy the frame and check that the
+ * server did not start overwriting it meanwhile.
+ */
+static  GstBuffer *
+shm_client_copy_unheld(GstThetauvcShmClient * client, guint64 pos, gsize size)
+{
+    GstThetauvcShmHeader *h = client->header;
+    GstBuffer *buffer;
+
+    buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_fill(buffer, 0, client->data + pos % h->data_size, size);
+    /* pairs with the fence before the data is written in publish() */
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load(&h->reclaim) > pos) {
+	gst_buffer_unref(buffer);
+	return NULL;
+    }
+
+    return buffer;
+}
+
+/*
+ * Rejoin once the buffers of before the eviction are gone: the hold is
+ * set before evicted is cleared, then reclaim is checked as usual.
+ */
+static  gboolean
+shm_client_check_evicted(GstThetauvcShmClient * client, guint64 pos)
+{
+    GstThetauvcShmReader *reader = &client->header->readers[client->index];
+    gboolean evicted;
+
+    if (!atomic_load(&reader->evicted))
+	return FALSE;
+
+    g_mutex_lock(&client->lock);
+    if (!client->evicted) {
+	GST_WARNING("reader %u evicted, copying frames", client->index);
+	client->evicted = TRUE;
+    }
+    evicted = !g_queue_is_empty(&client->held);
+    if (!evicted) {
+	atomic_store(&reader->hold, pos);
+	atomic_store(&reader->evicted, 0);
+	client->evicted = FALSE;
+	GST_DEBUG("reader %u back", client->index);
+    }
+    g_mutex_unlock(&client->lock);
+
+    return evicted;
+}
+
+/*
+ * Take frame seq.  The buffer wraps the shared memory unless copy is set,
+ * half of the ring is already held by this reader or the server evicted
+ * it, so one slow consumer does not hold up the others.  FALSE if the
+ * frame is gone.
+ */
+gboolean
+gst_thetauvc_shm_client_read(GstThetauvcShmClient * client, guint64 seq,
+    gboolean copy, GstThetauvcShmFrame * frame)
+{
+    GstThetauvcShmHeader *h = client->header;
+    GstThetauvcShmSlot *slot = &h->slots[seq % h->n_slots];
+    GstThetauvcShmHeld *held;
+    guint64 pos, off;
+    gsize   size;
+
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq + 1)
+	return FALSE;
+    pos = slot->pos;
+    size = slot->size;
+    frame->flags = slot->flags;
+    frame->capture = slot->capture;
+    frame->duration = slot->duration;
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq + 1)
+	return FALSE;
+
+    off = pos % h->data_size;
+    if (size == 0 || off + size > h->data_size)
+	return FALSE;
+
+    if (shm_client_check_evicted(client, pos)) {
+	if ((frame->buffer = shm_client_copy_unheld(client, pos, size)) == NULL)
+	    return FALSE;
+	goto done;
+    }
+
+    held = shm_client_hold(client, pos, size);
+    if (atomic_load(&h->reclaim) > pos) {
+	shm_client_release(held);
+	return FALSE;
+    }
+
+    g_mutex_lock(&client->lock);
+    copy |= client->held_bytes > h->data_size / 2;
+    g_mutex_unlock(&client->lock);
+
+    if (copy) {
+	frame->buffer = gst_buffer_new_allocate(NULL, size, NULL);
+	gst_buffer_fill(frame->buffer, 0, client->data + off, size);
+	shm_client_release(held);
+    } else {
+	frame->buffer = gst_buffer_new();
+	gst_buffer_append_memory(frame->buffer,
+	    gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY,
+		client->data + off, size, 0, size, held, shm_client_release));
+    }
+
+  done:
+    frame->seq = seq;
+    atomic_store_explicit(&h->readers[client->index].read_seq, seq + 1,
+	memory_order_relaxed);
+
+    return TRUE;
+}
+
+/* Newest key frame still in the ring, from seq on */
+gboolean
+gst_thetauvc_shm_client_find_key(GstThetauvcShmClient * client,
+    guint64 from, guint64 * seq)
+{
+    GstThetauvcShmHeader *h = client->header;
+    GstThetauvcShmSlot *slot;
+    guint64 s, last, reclaim;
+
+    last = atomic_load(&h->write_seq);
+    reclaim = atomic_load(&h->reclaim);
+    if (last > h->n_slots && from < last - h->n_slots)
+	from = last - h->n_slots;
+
+    for (s = last; s > from; s--) {
+	slot = &h->slots[(s - 1) % h->n_slots];
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) == s
+	    && (slot->flags & GST_THETAUVC_SHM_FLAG_KEY)
+	    && slot->pos >= reclaim) {
+	    *seq = s - 1;
+	    return TRUE;
+	}
+    }
+
+    return FALSE;
+}
+
+gboolean
+gst_thetauvc_shm_client_caps_changed(GstThetauvcShmClient * client)
+{
+    return atomic_load_explicit(&client->header->caps_seq,
+	memory_order_acquire) != client->caps_seq;
+}
+
+/* Caps of the stream, NULL if the server has none yet */
+GstCaps *
+gst_thetauvc_shm_client_get_caps(GstThetauvcShmClient * client)
+{
+    GstThetauvcShmHeader *h = client->header;
+    gchar   caps[GST_THETAUVC_SHM_CAPS_SIZE];
+    guint   s1, s2;
+
+    do {
+	s1 = atomic_load_explicit(&h->caps_seq, memory_order_acquire);
+	if (s1 & 1) {
+	    g_thread_yield();
+	    continue;
+	}
+	memcpy(caps, h->caps, sizeof(caps));
+	atomic_thread_fence(memory_order_acquire);
+	s2 = atomic_load_explicit(&h->caps_seq, memory_order_relaxed);
+    } while ((s1 & 1) || s1 != s2);
+
+    client->caps_seq = s1;
+    caps[sizeof(caps) - 1] = '\0';
+
+    return caps[0] != '\0' ? gst_caps_from_string(caps) : NULL;
+}
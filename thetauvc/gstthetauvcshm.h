@@ -0,0 +1,183 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GST_THETAUVCSHM_H_
+#define _GST_THETAUVCSHM_H_
+
+#include <stdatomic.h>
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+#define GST_THETAUVC_SHM_MAGIC 0x48535554	/* "TUSH" */
+#define GST_THETAUVC_SHM_VERSION 1
+#define GST_THETAUVC_SHM_SLOTS 1024
+#define GST_THETAUVC_SHM_READERS 16
+#define GST_THETAUVC_SHM_CAPS_SIZE 4096
+/* hold of a reader which references no data */
+#define GST_THETAUVC_SHM_NO_HOLD G_MAXUINT64
+
+#define GST_THETAUVC_SHM_FLAG_KEY (1 << 0)
+#define GST_THETAUVC_SHM_FLAG_DISCONT (1 << 1)
+#define GST_THETAUVC_SHM_FLAG_HEADER (1 << 2)
+
+typedef struct _GstThetauvcShmSlot GstThetauvcShmSlot;
+typedef struct _GstThetauvcShmReader GstThetauvcShmReader;
+typedef struct _GstThetauvcShmHeader GstThetauvcShmHeader;
+typedef struct _GstThetauvcShmServer GstThetauvcShmServer;
+typedef struct _GstThetauvcShmClient GstThetauvcShmClient;
+typedef struct _GstThetauvcShmFrame GstThetauvcShmFrame;
+
+/* frame seq is published as seq + 1, 0 while the slot is rewritten */
+struct _GstThetauvcShmSlot
+{
+    atomic_ullong seq;
+    /* position in the byte stream, the data is at pos % data_size */
+    guint64 pos;
+    guint32 size;
+    guint32 flags;
+    /* host monotonic time of the capture */
+    guint64 capture;
+    guint64 duration;
+};
+
+/* written by the reader, active is managed by the server */
+struct _GstThetauvcShmReader
+{
+    atomic_int active;
+    /* set by the server when the hold stalls it, the hold is ignored */
+    atomic_int evicted;
+    /* oldest position the reader still references */
+    atomic_ullong hold;
+    atomic_ullong read_seq;
+};
+
+/*
+ * Start of the memfd, the frame data follows at data_offset.  Frames are
+ * contiguous, one which does not fit before the end starts over at the
+ * beginning.
+ */
+struct _GstThetauvcShmHeader
+{
+    guint32 magic;
+    guint32 version;
+    guint32 n_slots;
+    guint32 n_readers;
+    guint64 data_offset;
+    guint64 data_size;
+
+    /* frames published */
+    atomic_ullong write_seq;
+    /* data below this position may be overwritten */
+    atomic_ullong reclaim;
+    /* futex bumped for every frame, readers sleep on it */
+    atomic_uint notify;
+    atomic_int waiters;
+    atomic_int closed;
+
+    /* odd while caps is rewritten */
+    atomic_uint caps_seq;
+    gchar   caps[GST_THETAUVC_SHM_CAPS_SIZE];
+
+    GstThetauvcShmReader readers[GST_THETAUVC_SHM_READERS];
+    GstThetauvcShmSlot slots[GST_THETAUVC_SHM_SLOTS];
+};
+
+/* a frame taken by a reader */
+struct _GstThetauvcShmFrame
+{
+    guint64 seq;
+    guint32 flags;
+    guint64 capture;
+    guint64 duration;
+    GstBuffer *buffer;
+};
+
+/* one process opening the camera */
+struct _GstThetauvcShmServer
+{
+    gchar  *path;
+    gint    memfd;
+    gint    listen_fd;
+    /* path is our socket, removed on free */
+    gboolean bound;
+    gint    wake[2];
+    gint    clients[GST_THETAUVC_SHM_READERS];
+    GThread *thread;
+
+    GstThetauvcShmHeader *header;
+    guint8 *data;
+    gsize   map_size;
+
+    /* publisher state, create() only */
+    guint64 pos;
+    gboolean skip_to_key;
+    gboolean discont;
+    GstCaps *caps;
+    guint64 dropped;
+    /* since when each reader keeps frames from being published (us) */
+    gint64  stalled[GST_THETAUVC_SHM_READERS];
+};
+
+/* mapping in a reader process, referenced by the buffers it hands out */
+struct _GstThetauvcShmClient
+{
+    gint    refcount;
+    gint    sock;
+    gint    memfd;
+    guint   index;
+
+    GstThetauvcShmHeader *header;
+    guint8 *data;
+    gsize   map_size;
+
+    /* positions of the frames in flight, oldest first */
+    GMutex  lock;
+    GQueue  held;
+    guint64 held_bytes;
+    gboolean evicted;
+    /* set by unlock, wait() returns at once */
+    atomic_int flushing;
+    guint   caps_seq;
+};
+
+GstThetauvcShmServer *gst_thetauvc_shm_server_new(const gchar *, gsize,
+    GError **);
+void    gst_thetauvc_shm_server_free(GstThetauvcShmServer *);
+gboolean gst_thetauvc_shm_server_publish(GstThetauvcShmServer *,
+    GstBuffer *, GstClockTime, GstCaps *);
+
+GstThetauvcShmClient *gst_thetauvc_shm_client_new(const gchar *, GError **);
+GstThetauvcShmClient *gst_thetauvc_shm_client_ref(GstThetauvcShmClient *);
+void    gst_thetauvc_shm_client_unref(GstThetauvcShmClient *);
+gboolean gst_thetauvc_shm_client_wait(GstThetauvcShmClient *, guint64,
+    gint64);
+void    gst_thetauvc_shm_client_set_flushing(GstThetauvcShmClient *,
+    gboolean);
+gboolean gst_thetauvc_shm_client_read(GstThetauvcShmClient *, guint64,
+    gboolean, GstThetauvcShmFrame *);
+gboolean gst_thetauvc_shm_client_find_key(GstThetauvcShmClient *, guint64,
+    guint64 *);
+GstCaps *gst_thetauvc_shm_client_get_caps(GstThetauvcShmClient *);
+gboolean gst_thetauvc_shm_client_caps_changed(GstThetauvcShmClient *);
+
+G_END_DECLS
+#endif
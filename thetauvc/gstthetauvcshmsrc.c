@@ -0,0 +1,554 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+/**
+ * SECTION:element-gstthetauvcshmsrc
+ *
+ * Read the frames of a thetauvcsrc in another process.
+ *
+ * <refsect2>
+ * <title>Example launch line</title>
+ * |[
+ * gst-launch-1.0 thetauvcsrc shm-socket-path=/tmp/theta ! fakesink
+ * gst-launch-1.0 thetauvcshmsrc socket-path=/tmp/theta ! h264parse ! decodebin ! autovideosink
+ * ]|
+ * The first pipeline opens the camera and publishes its frames in shared
+ * memory, any number of readers up to 16 take them without copying.
+ *
+ * A reader starts at the latest key frame.  One which falls behind the
+ * ring, or more than max-lag frames behind the camera, skips to a key
+ * frame as chosen by lag-policy and marks the next buffer DISCONT.
+ * </refsect2>
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "gstthetauvcsrc.h"
+#include "gstthetauvcshmsrc.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_thetauvcshmsrc_debug_category);
+#define GST_CAT_DEFAULT gst_thetauvcshmsrc_debug_category
+#define GST_THETAUVCSHMSRC_CAPS_TEMPLATE "video/x-h264, "		\
+				   "stream-format = byte-stream, "	\
+				   "alignment = au"
+
+#define DEFAULT_LAG_POLICY GST_THETAUVC_LAG_SKIP_TO_KEY
+#define DEFAULT_MAX_LAG 0
+/* frame rate for the latency before the server sent caps */
+#define DEFAULT_FPS_N 30000
+#define DEFAULT_FPS_D 1001
+/* longest wait for a frame before checking for the server (us) */
+#define THETAUVCSHMSRC_WAIT 100000
+
+static GstCaps *capture_caps;
+
+/* prototypes */
+
+static void gst_thetauvcshmsrc_set_property(GObject * object,
+    guint property_id, const GValue * value, GParamSpec * pspec);
+static void gst_thetauvcshmsrc_get_property(GObject * object,
+    guint property_id, GValue * value, GParamSpec * pspec);
+static void gst_thetauvcshmsrc_finalize(GObject * object);
+
+static GstCaps *gst_thetauvcshmsrc_get_caps(GstBaseSrc * src,
+    GstCaps * filter);
+static gboolean gst_thetauvcshmsrc_negotiate(GstBaseSrc * src);
+static gboolean gst_thetauvcshmsrc_start(GstBaseSrc * src);
+static gboolean gst_thetauvcshmsrc_stop(GstBaseSrc * src);
+static gboolean gst_thetauvcshmsrc_unlock(GstBaseSrc * src);
+static gboolean gst_thetauvcshmsrc_unlock_stop(GstBaseSrc * src);
+static gboolean gst_thetauvcshmsrc_query(GstBaseSrc * src, GstQuery * query);
+static GstFlowReturn gst_thetauvcshmsrc_create(GstPushSrc * src,
+    GstBuffer ** buf);
+
+enum
+{
+    PROP_SOCKET_PATH = 1,
+    PROP_LAG_POLICY,
+    PROP_MAX_LAG,
+    PROP_SKIPPED
+};
+
+/* class initialization */
+
+G_DEFINE_TYPE_WITH_CODE(GstThetauvcshmsrc, gst_thetauvcshmsrc,
+    GST_TYPE_PUSH_SRC,
+    GST_DEBUG_CATEGORY_INIT
+    (gst_thetauvcshmsrc_debug_category, "thetauvcshmsrc", 0,
+	"debug category for thetauvcshmsrc element"));
+
+static void
+gst_thetauvcshmsrc_class_init(GstThetauvcshmsrcClass * klass)
+{
+    GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
+    GstBaseSrcClass *base_src_class = GST_BASE_SRC_CLASS(klass);
+    GstPushSrcClass *push_src_class = GST_PUSH_SRC_CLASS(klass);
+    GstCaps *caps;
+
+    caps = gst_caps_from_string(GST_THETAUVCSHMSRC_CAPS_TEMPLATE);
+    capture_caps = gst_caps_new_empty_simple(GST_THETAUVCSRC_CAPTURE_CAPS);
+    GST_MINI_OBJECT_FLAG_SET(capture_caps,
+	GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+
+    gst_element_class_add_pad_template(GST_ELEMENT_CLASS(klass),
+	gst_pad_template_new("src", GST_PAD_SRC, GST_PAD_ALWAYS, caps));
+
+    gst_element_class_set_static_metadata(GST_ELEMENT_CLASS(klass),
+	"Theta UVC shared memory source",
+	"Source/Video", "Reads the frames a thetauvcsrc shares",
+	"Koji Takeo <nickel110@icloud.com>");
+
+    gobject_class->set_property = gst_thetauvcshmsrc_set_property;
+    gobject_class->get_property = gst_thetauvcshmsrc_get_property;
+    gobject_class->finalize = gst_thetauvcshmsrc_finalize;
+    base_src_class->get_caps = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_get_caps);
+    base_src_class->negotiate =
+	GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_negotiate);
+    base_src_class->start = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_start);
+    base_src_class->stop = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_stop);
+    base_src_class->unlock = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_unlock);
+    base_src_class->unlock_stop =
+	GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_unlock_stop);
+    base_src_class->query = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_query);
+
+    push_src_class->create = GST_DEBUG_FUNCPTR(gst_thetauvcshmsrc_create);
+
+    g_object_class_install_property(gobject_class, PROP_SOCKET_PATH,
+	g_param_spec_string("socket-path", "Socket path",
+	    "Socket of the thetauvcsrc sharing the frames (shm-socket-path)",
+	    NULL, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_LAG_POLICY,
+	g_param_spec_enum("lag-policy", "Lag policy",
+	    "Where to continue after falling behind",
+	    gst_thetauvc_lag_get_type(), DEFAULT_LAG_POLICY,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_MAX_LAG,
+	g_param_spec_uint("max-lag", "Max. lag",
+	    "Frames behind the camera before skipping "
+	    "(0=only when frames are overwritten)",
+	    0, GST_THETAUVC_SHM_SLOTS, DEFAULT_MAX_LAG,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_SKIPPED,
+	g_param_spec_uint64("skipped", "Skipped",
+	    "Frames passed over after falling behind",
+	    0, G_MAXUINT64, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+}
+
+static void
+gst_thetauvcshmsrc_init(GstThetauvcshmsrc * shmsrc)
+{
+    gst_base_src_set_live(GST_BASE_SRC(shmsrc), TRUE);
+    gst_base_src_set_format(GST_BASE_SRC(shmsrc), GST_FORMAT_TIME);
+
+    shmsrc->socket_path = NULL;
+    shmsrc->lag_policy = DEFAULT_LAG_POLICY;
+    shmsrc->max_lag = DEFAULT_MAX_LAG;
+    shmsrc->client = NULL;
+    shmsrc->caps = NULL;
+    shmsrc->flushing = 0;
+    shmsrc->skipped = 0;
+}
+
+static void
+gst_thetauvcshmsrc_set_property(GObject * object, guint property_id,
+    const GValue * value, GParamSpec * pspec)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(object);
+
+    switch (property_id) {
+    case PROP_SOCKET_PATH:
+	g_free(shmsrc->socket_path);
+	shmsrc->socket_path = g_value_dup_string(value);
+	break;
+    case PROP_LAG_POLICY:
+	shmsrc->lag_policy = (GstThetauvcLagEnum) g_value_get_enum(value);
+	break;
+    case PROP_MAX_LAG:
+	shmsrc->max_lag = g_value_get_uint(value);
+	break;
+    default:
+	G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	break;
+    }
+}
+
+static void
+gst_thetauvcshmsrc_get_property(GObject * object, guint property_id,
+    GValue * value, GParamSpec * pspec)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(object);
+
+    switch (property_id) {
+    case PROP_SOCKET_PATH:
+	g_value_set_string(value, shmsrc->socket_path);
+	break;
+    case PROP_LAG_POLICY:
+	g_value_set_enum(value, shmsrc->lag_policy);
+	break;
+    case PROP_MAX_LAG:
+	g_value_set_uint(value, shmsrc->max_lag);
+	break;
+    case PROP_SKIPPED:
+	GST_OBJECT_LOCK(shmsrc);
+	g_value_set_uint64(value, shmsrc->skipped);
+	GST_OBJECT_UNLOCK(shmsrc);
+	break;
+    default:
+	G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	break;
+    }
+}
+
+static void
+gst_thetauvcshmsrc_finalize(GObject * object)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(object);
+
+    g_free(shmsrc->socket_path);
+    gst_caps_replace(&shmsrc->caps, NULL);
+
+    G_OBJECT_CLASS(gst_thetauvcshmsrc_parent_class)->finalize(object);
+}
+
+/* Take the caps of the server, they replace the negotiated ones */
+static void
+thetauvcshmsrc_update_caps(GstThetauvcshmsrc * shmsrc)
+{
+    GstCaps *caps;
+
+    caps = gst_thetauvc_shm_client_get_caps(shmsrc->client);
+    if (caps == NULL)
+	return;
+
+    GST_OBJECT_LOCK(shmsrc);
+    gst_caps_replace(&shmsrc->caps, caps);
+    GST_OBJECT_UNLOCK(shmsrc);
+    GST_DEBUG_OBJECT(shmsrc, "caps %" GST_PTR_FORMAT, caps);
+    gst_base_src_set_caps(GST_BASE_SRC(shmsrc), caps);
+    gst_caps_unref(caps);
+
+    /* the latency follows the frame rate */
+    gst_element_post_message(GST_ELEMENT_CAST(shmsrc),
+	gst_message_new_latency(GST_OBJECT_CAST(shmsrc)));
+}
+
+static GstCaps *
+gst_thetauvcshmsrc_get_caps(GstBaseSrc * src, GstCaps * filter)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+    GstCaps *caps, *tmp;
+
+    GST_OBJECT_LOCK(shmsrc);
+    if (shmsrc->caps != NULL)
+	caps = gst_caps_ref(shmsrc->caps);
+    else
+	caps = gst_pad_get_pad_template_caps(GST_BASE_SRC_PAD(src));
+    GST_OBJECT_UNLOCK(shmsrc);
+
+    if (filter != NULL) {
+	tmp = gst_caps_intersect_full(filter, caps, GST_CAPS_INTERSECT_FIRST);
+	gst_caps_unref(caps);
+	caps = tmp;
+    }
+
+    return caps;
+}
+
+/* The caps come with the first frame if the server has none yet */
+static  gboolean
+gst_thetauvcshmsrc_negotiate(GstBaseSrc * src)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+    GstCaps *caps;
+    gboolean ret;
+
+    GST_OBJECT_LOCK(shmsrc);
+    caps = shmsrc->caps != NULL ? gst_caps_ref(shmsrc->caps) : NULL;
+    GST_OBJECT_UNLOCK(shmsrc);
+    if (caps == NULL)
+	return TRUE;
+
+    ret = gst_base_src_set_caps(src, caps);
+    gst_caps_unref(caps);
+
+    return ret;
+}
+
+static  gboolean
+gst_thetauvcshmsrc_start(GstBaseSrc * src)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+    GError *error = NULL;
+    guint64 seq;
+
+    GST_DEBUG_OBJECT(shmsrc, "start");
+
+    if (shmsrc->socket_path == NULL) {
+	GST_ELEMENT_ERROR(shmsrc, RESOURCE, NOT_FOUND,
+	    ("No socket-path set."), (NULL));
+	return FALSE;
+    }
+    shmsrc->client = gst_thetauvc_shm_client_new(shmsrc->socket_path, &error);
+    if (shmsrc->client == NULL) {
+	GST_ELEMENT_ERROR(shmsrc, RESOURCE, OPEN_READ,
+	    ("Could not read frames from %s.", shmsrc->socket_path),
+	    ("%s", error->message));
+	g_error_free(error);
+	return FALSE;
+    }
+
+    /* start at the latest key frame, or wait for the next */
+    shmsrc->next_seq = atomic_load(&shmsrc->client->header->write_seq);
+    shmsrc->wait_key = TRUE;
+    if (gst_thetauvc_shm_client_find_key(shmsrc->client, 0, &seq)) {
+	shmsrc->next_seq = seq;
+	shmsrc->wait_key = FALSE;
+    }
+    shmsrc->discont = TRUE;
+    GST_OBJECT_LOCK(shmsrc);
+    shmsrc->skipped = 0;
+    GST_OBJECT_UNLOCK(shmsrc);
+    if (gst_thetauvc_shm_client_caps_changed(shmsrc->client))
+	thetauvcshmsrc_update_caps(shmsrc);
+
+    return TRUE;
+}
+
+static  gboolean
+gst_thetauvcshmsrc_stop(GstBaseSrc * src)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+
+    GST_DEBUG_OBJECT(shmsrc, "stop");
+
+    /* buffers still downstream keep the mapping */
+    if (shmsrc->client != NULL) {
+	gst_thetauvc_shm_client_unref(shmsrc->client);
+	shmsrc->client = NULL;
+    }
+    GST_OBJECT_LOCK(shmsrc);
+    gst_caps_replace(&shmsrc->caps, NULL);
+    GST_OBJECT_UNLOCK(shmsrc);
+
+    return TRUE;
+}
+
+static  gboolean
+gst_thetauvcshmsrc_unlock(GstBaseSrc * src)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+
+    GST_DEBUG_OBJECT(shmsrc, "unlock");
+    g_atomic_int_set(&shmsrc->flushing, 1);
+    if (shmsrc->client != NULL)
+	gst_thetauvc_shm_client_set_flushing(shmsrc->client, TRUE);
+
+    return TRUE;
+}
+
+static  gboolean
+gst_thetauvcshmsrc_unlock_stop(GstBaseSrc * src)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+
+    GST_DEBUG_OBJECT(shmsrc, "unlock_stop");
+    g_atomic_int_set(&shmsrc->flushing, 0);
+    if (shmsrc->client != NULL)
+	gst_thetauvc_shm_client_set_flushing(shmsrc->client, FALSE);
+
+    return TRUE;
+}
+
+/*
+ * One frame interval at the frame rate of the caps of the server, 29.97
+ * fps until it has sent caps.  Nothing to answer before connecting.
+ */
+static  gboolean
+gst_thetauvcshmsrc_query(GstBaseSrc * src, GstQuery * query)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+    GstClockTime interval;
+    GstStructure *s;
+    gint    fps_n, fps_d;
+
+    switch (GST_QUERY_TYPE(query)) {
+    case GST_QUERY_LATENCY:
+	if (shmsrc->client == NULL)
+	    return FALSE;
+
+	fps_n = DEFAULT_FPS_N;
+	fps_d = DEFAULT_FPS_D;
+	GST_OBJECT_LOCK(shmsrc);
+	if (shmsrc->caps != NULL && !gst_caps_is_empty(shmsrc->caps)) {
+	    s = gst_caps_get_structure(shmsrc->caps, 0);
+	    if (!gst_structure_get_fraction(s, "framerate", &fps_n, &fps_d)
+		|| fps_n <= 0 || fps_d <= 0) {
+		fps_n = DEFAULT_FPS_N;
+		fps_d = DEFAULT_FPS_D;
+	    }
+	}
+	GST_OBJECT_UNLOCK(shmsrc);
+
+	interval = gst_util_uint64_scale_ceil(GST_SECOND, fps_d, fps_n);
+	GST_DEBUG_OBJECT(shmsrc, "latency %" GST_TIME_FORMAT,
+	    GST_TIME_ARGS(interval));
+	gst_query_set_latency(query, TRUE, interval, interval * 8);
+	return TRUE;
+    default:
+	return GST_BASE_SRC_CLASS(gst_thetauvcshmsrc_parent_class)->query(src,
+	    query);
+    }
+}
+
+/*
+ * Fallen behind: continue at the newest key frame still in the ring with
+ * skip-to-key, otherwise drop everything published so far and wait for
+ * the next key frame.
+ */
+static void
+thetauvcshmsrc_skip(GstThetauvcshmsrc * shmsrc, guint64 write_seq)
+{
+    guint64 seq;
+
+    if (shmsrc->lag_policy == GST_THETAUVC_LAG_SKIP_TO_KEY
+	&& gst_thetauvc_shm_client_find_key(shmsrc->client, shmsrc->next_seq,
+	    &seq) && seq > shmsrc->next_seq) {
+	shmsrc->wait_key = FALSE;
+    } else {
+	seq = write_seq;
+	shmsrc->wait_key = TRUE;
+    }
+
+    GST_DEBUG_OBJECT(shmsrc, "skipping %" G_GUINT64_FORMAT " -> %"
+	G_GUINT64_FORMAT, shmsrc->next_seq, seq);
+    GST_OBJECT_LOCK(shmsrc);
+    shmsrc->skipped += seq - shmsrc->next_seq;
+    GST_OBJECT_UNLOCK(shmsrc);
+    shmsrc->next_seq = seq;
+    shmsrc->discont = TRUE;
+}
+
+/* Running time of a host capture time, as thetauvcsrc stamps its frames */
+static  GstClockTime
+thetauvcshmsrc_running_time(GstThetauvcshmsrc * shmsrc, GstClockTime capture)
+{
+    GstClock *clock;
+    GstClockTime now, host_now, base_time, elapsed;
+
+    if ((clock = gst_element_get_clock(GST_ELEMENT_CAST(shmsrc))) == NULL)
+	return GST_CLOCK_TIME_NONE;
+    now = gst_clock_get_time(clock);
+    host_now = g_get_monotonic_time() * GST_USECOND;
+    gst_object_unref(clock);
+
+    base_time = gst_element_get_base_time(GST_ELEMENT_CAST(shmsrc));
+    if (now < base_time)
+	return GST_CLOCK_TIME_NONE;
+    now -= base_time;
+    elapsed = host_now > capture ? host_now - capture : 0;
+
+    return now > elapsed ? now - elapsed : 0;
+}
+
+static  GstFlowReturn
+gst_thetauvcshmsrc_create(GstPushSrc * src, GstBuffer ** buf)
+{
+    GstThetauvcshmsrc *shmsrc = GST_THETAUVCSHMSRC(src);
+    GstThetauvcShmClient *client = shmsrc->client;
+    GstThetauvcShmFrame frame;
+    guint64 write_seq;
+
+    while (1) {
+	if (g_atomic_int_get(&shmsrc->flushing)) {
+	    GST_DEBUG_OBJECT(shmsrc, "flushing");
+	    return GST_FLOW_FLUSHING;
+	}
+	if (!gst_thetauvc_shm_client_wait(client, shmsrc->next_seq,
+		THETAUVCSHMSRC_WAIT)) {
+	    if (atomic_load(&client->header->closed)) {
+		GST_DEBUG_OBJECT(shmsrc, "server stopped");
+		return GST_FLOW_EOS;
+	    }
+	    continue;
+	}
+
+	write_seq = atomic_load(&client->header->write_seq);
+	if ((shmsrc->max_lag > 0
+		&& write_seq - shmsrc->next_seq > shmsrc->max_lag)
+	    || !gst_thetauvc_shm_client_read(client, shmsrc->next_seq, FALSE,
+		&frame)) {
+	    thetauvcshmsrc_skip(shmsrc, write_seq);
+	    continue;
+	}
+	shmsrc->next_seq++;
+
+	if (shmsrc->wait_key && !(frame.flags & GST_THETAUVC_SHM_FLAG_KEY)) {
+	    gst_buffer_unref(frame.buffer);
+	    GST_OBJECT_LOCK(shmsrc);
+	    shmsrc->skipped++;
+	    GST_OBJECT_UNLOCK(shmsrc);
+	    continue;
+	}
+	shmsrc->wait_key = FALSE;
+	break;
+    }
+
+    if (gst_thetauvc_shm_client_caps_changed(client))
+	thetauvcshmsrc_update_caps(shmsrc);
+
+    *buf = frame.buffer;
+    if (!(frame.flags & GST_THETAUVC_SHM_FLAG_KEY))
+	GST_BUFFER_FLAG_SET(*buf, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (frame.flags & GST_THETAUVC_SHM_FLAG_HEADER)
+	GST_BUFFER_FLAG_SET(*buf, GST_BUFFER_FLAG_HEADER);
+    if (shmsrc->discont || (frame.flags & GST_THETAUVC_SHM_FLAG_DISCONT)) {
+	GST_BUFFER_FLAG_SET(*buf, GST_BUFFER_FLAG_DISCONT);
+	shmsrc->discont = FALSE;
+    }
+    GST_BUFFER_OFFSET(*buf) = frame.seq;
+    GST_BUFFER_PTS(*buf) = thetauvcshmsrc_running_time(shmsrc, frame.capture);
+    GST_BUFFER_DURATION(*buf) = frame.duration;
+    gst_buffer_add_reference_timestamp_meta(*buf, capture_caps, frame.capture,
+	GST_CLOCK_TIME_NONE);
+
+    return GST_FLOW_OK;
+}
+
+GType
+gst_thetauvc_lag_get_type(void)
+{
+    static gsize id = 0;
+    static const GEnumValue policy[] = {
+	{GST_THETAUVC_LAG_SKIP_TO_KEY,
+	    "Continue at the newest key frame in the ring", "skip-to-key"},
+	{GST_THETAUVC_LAG_NEXT_KEY,
+	    "Wait for the next key frame from the camera", "next-key"},
+	{0, NULL, NULL}
+    };
+
+    if (g_once_init_enter(&id)) {
+	GType   tmp = g_enum_register_static("GstThetauvcLag", policy);
+	g_once_init_leave(&id, tmp);
+    }
+
+    return (GType) id;
+}
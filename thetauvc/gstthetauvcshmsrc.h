@@ -0,0 +1,72 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_THETAUVCSHMSRC_H_
+#define _GST_THETAUVCSHMSRC_H_
+
+#include <gst/gst.h>
+#include <gst/base/base.h>
+
+#include "gstthetauvcshm.h"
+
+G_BEGIN_DECLS
+#define GST_TYPE_THETAUVCSHMSRC   (gst_thetauvcshmsrc_get_type())
+#define GST_THETAUVCSHMSRC(obj)   (G_TYPE_CHECK_INSTANCE_CAST((obj),GST_TYPE_THETAUVCSHMSRC,GstThetauvcshmsrc))
+#define GST_THETAUVCSHMSRC_CLASS(klass)   (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_THETAUVCSHMSRC,GstThetauvcshmsrcClass))
+#define GST_IS_THETAUVCSHMSRC(obj)   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_THETAUVCSHMSRC))
+
+typedef struct _GstThetauvcshmsrc GstThetauvcshmsrc;
+typedef struct _GstThetauvcshmsrcClass GstThetauvcshmsrcClass;
+
+typedef enum
+{
+    GST_THETAUVC_LAG_SKIP_TO_KEY,
+    GST_THETAUVC_LAG_NEXT_KEY
+} GstThetauvcLagEnum;
+
+GType   gst_thetauvc_lag_get_type(void);
+
+struct _GstThetauvcshmsrc
+{
+    GstPushSrc base_thetauvcshmsrc;
+
+    gchar  *socket_path;
+    GstThetauvcLagEnum lag_policy;
+    guint   max_lag;
+
+    GstThetauvcShmClient *client;
+    GstCaps *caps;
+    /* next frame to read, create() only */
+    guint64 next_seq;
+    gboolean wait_key;
+    gboolean discont;
+    gint    flushing;
+    /* frames passed over, object lock */
+    guint64 skipped;
+};
+
+struct _GstThetauvcshmsrcClass
+{
+    GstPushSrcClass base_thetauvcshmsrc_class;
+};
+
+GType   gst_thetauvcshmsrc_get_type(void);
+
+G_END_DECLS
+#endif
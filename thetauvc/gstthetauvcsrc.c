@@ -27,6 +27,10 @@
  * gst-launch-1.0 -v thetauvcsrc ! h264parse ! decodebin ! autovideosink
  * ]|
  * Play live streaming from Theta V/Z1. 
+ *
+ * Frames are pushed as complete access units with key frames, SPS and PPS
+ * flagged, so elements accepting alignment=au byte-stream (e.g. rtph264pay)
+ * can be linked without h264parse.
  * </refsect2>
  */
 
@@ -39,13 +43,18 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <gst/gst.h>
 
 #include "libuvc/libuvc.h"
 #include "thetauvc.h"
 #include "gstthetauvcsrc.h"
+#include "gstthetauvcmemory.h"
+#include "gstthetauvcdevices.h"
+#include "thetauvch264.h"
 
 
 GST_DEBUG_CATEGORY_STATIC(gst_thetauvcsrc_debug_category);
@@ -55,16 +64,58 @@ GST_DEBUG_CATEGORY_STATIC(gst_thetauvcsrc_debug_category);
 				   "height = " GST_VIDEO_SIZE_RANGE ", "	\
 				   "framerate = " GST_VIDEO_FPS_RANGE ", "	\
 				   "stream-format = byte-stream, "		\
-				   "alignment = nal, "				\
+				   "alignment = au, "				\
 				   "profile = { high, constrained-baseline }"
 #define GST_THETAUVCSRC_CAPS_BASE  "video/x-h264, "			\
 				   "width = 3840, "			\
 				   "height = 1920, "			\
 				   "framerate = 30/1, "			\
 				   "stream-format = byte-stream, "	\
-				   "alignment = nal, "			\
+				   "alignment = au, "			\
 				   "profile = constrained-baseline"
 
+/* frames buffered between the libuvc callback and create() */
+#define THETAUVCSRC_QUEUE_SIZE 64
+#define THETAUVCSRC_QUEUE_MAX_SIZE 1024
+#define DEFAULT_MAX_SIZE_BUFFERS 30
+#define DEFAULT_MAX_SIZE_BYTES 0
+#define DEFAULT_MAX_SIZE_TIME 0
+#define DEFAULT_TIMEOUT 0
+#define DEFAULT_CONFIG_INTERVAL 0
+#define DEFAULT_AUTO_RECONNECT TRUE
+#define DEFAULT_REPLAY_SPEED 1.0
+#define DEFAULT_REPLAY_LOOP FALSE
+#define DEFAULT_STATS_INTERVAL 0
+#define DEFAULT_WATCHDOG 0
+#define DEFAULT_BITRATE 0
+#define DEFAULT_MAX_BITRATE 0
+#define DEFAULT_GOP_LENGTH 0
+#define DEFAULT_QP 0
+#define DEFAULT_THREAD_POLICY GST_THETAUVC_THREAD_POLICY_DEFAULT
+#define DEFAULT_THREAD_PRIORITY 0
+#define DEFAULT_PRE_EVENT_TIME 0
+#define DEFAULT_PRE_EVENT_MAX_BYTES (64 * 1024 * 1024)
+#define DEFAULT_SHM_SIZE (64 * 1024 * 1024)
+/* wait of the callback with overflow-policy=block if the frame interval
+ * is unknown (us), otherwise one frame interval */
+#define THETAUVCSRC_BLOCK_TIMEOUT (G_USEC_PER_SEC / 30)
+
+/* watchdog periods without frames before giving up */
+#define THETAUVCSRC_WATCHDOG_RESTART 1
+#define THETAUVCSRC_WATCHDOG_RESET 2
+#define THETAUVCSRC_WATCHDOG_FAIL 3
+
+/* retry of reopening and gap events (us) */
+#define THETAUVCSRC_RECONNECT_RETRY G_USEC_PER_SEC
+#define THETAUVCSRC_GAP_INTERVAL 100000
+
+/* timestamp smoothing gains and resync threshold in frame intervals */
+#define THETAUVCSRC_TS_PHASE_GAIN 16
+#define THETAUVCSRC_TS_FREQ_GAIN 256
+#define THETAUVCSRC_TS_RESYNC 8
+
+static GstCaps *capture_caps;
+
 /* prototypes */
 
 static void gst_thetauvcsrc_set_property(GObject * object,
@@ -73,6 +124,10 @@ static void gst_thetauvcsrc_get_property(GObject * object, guint property_id,
     GValue * value, GParamSpec * pspec);
 static void gst_thetauvcsrc_dispose(GObject * object);
 static void gst_thetauvcsrc_finalize(GObject * object);
+static GstStateChangeReturn gst_thetauvcsrc_change_state(GstElement *
+    element, GstStateChange transition);
+static gboolean gst_thetauvcsrc_post_message(GstElement * element,
+    GstMessage * message);
 
 static GstCaps *gst_thetauvcsrc_get_caps(GstBaseSrc * src, GstCaps * filter);
 static gboolean gst_thetauvcsrc_negotiate(GstBaseSrc * src);
@@ -101,14 +156,61 @@ static GstFlowReturn gst_thetauvcsrc_alloc(GstBaseSrc * src, guint64 offset,
 static GstFlowReturn gst_thetauvcsrc_fill(GstBaseSrc * src, guint64 offset,
     guint size, GstBuffer * buf);
 
+static gboolean thetauvcsrc_switch_format(GstThetauvcsrc * thetauvcsrc);
+static GstStructure *thetauvcsrc_stats_new(GstThetauvcsrc * thetauvcsrc,
+    gint64 since, guint64 since_bytes);
+static void thetauvcsrc_update_encoder(GstThetauvcsrc * thetauvcsrc);
+static gboolean thetauvcsrc_dump(GstThetauvcsrc * thetauvcsrc,
+    const gchar * location, guint64 duration);
+static void thetauvcsrc_dump_done(const gchar * location, guint frames,
+    guint64 bytes, const gchar * error, gpointer user_data);
+
 enum
 {
     PROP_HW_SERIAL = 1,
     PROP_DEVICE_NUM,
     PROP_MODE,
-    PROP_DEVICE_INDEX
+    PROP_DEVICE_INDEX,
+    PROP_ZERO_COPY,
+    PROP_OVERFLOW_POLICY,
+    PROP_MAX_SIZE_BUFFERS,
+    PROP_MAX_SIZE_BYTES,
+    PROP_MAX_SIZE_TIME,
+    PROP_CUR_LEVEL_BUFFERS,
+    PROP_CUR_LEVEL_BYTES,
+    PROP_CUR_LEVEL_TIME,
+    PROP_TIMEOUT,
+    PROP_CONFIG_INTERVAL,
+    PROP_AUTO_RECONNECT,
+    PROP_BRINGUP_STATS,
+    PROP_REPLAY_LOCATION,
+    PROP_REPLAY_SPEED,
+    PROP_REPLAY_LOOP,
+    PROP_RECORD_LOCATION,
+    PROP_STATS,
+    PROP_STATS_INTERVAL,
+    PROP_WATCHDOG,
+    PROP_BITRATE,
+    PROP_MAX_BITRATE,
+    PROP_GOP_LENGTH,
+    PROP_QP,
+    PROP_THREAD_POLICY,
+    PROP_THREAD_PRIORITY,
+    PROP_CPU_AFFINITY,
+    PROP_PRE_EVENT_TIME,
+    PROP_PRE_EVENT_MAX_BYTES,
+    PROP_SHM_SOCKET_PATH,
+    PROP_SHM_SIZE
+};
+
+enum
+{
+    SIGNAL_DUMP,
+    LAST_SIGNAL
 };
 
+static guint thetauvcsrc_signals[LAST_SIGNAL] = { 0 };
+
 /* class initialization */
 
 G_DEFINE_TYPE_WITH_CODE(GstThetauvcsrc, gst_thetauvcsrc, GST_TYPE_PUSH_SRC,
@@ -127,6 +229,9 @@ gst_thetauvcsrc_class_init(GstThetauvcsrcClass * klass)
      * base_class_init if you intend to subclass this class. */
     GstCaps *caps;
     caps = gst_caps_from_string(GST_THETAUVCSRC_CAPS_TEMPLATE);
+    capture_caps = gst_caps_new_empty_simple(GST_THETAUVCSRC_CAPTURE_CAPS);
+    GST_MINI_OBJECT_FLAG_SET(capture_caps,
+	GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
 
     gst_element_class_add_pad_template(GST_ELEMENT_CLASS(klass),
 	gst_pad_template_new("src", GST_PAD_SRC, GST_PAD_ALWAYS, caps));
@@ -139,12 +244,16 @@ gst_thetauvcsrc_class_init(GstThetauvcsrcClass * klass)
     gobject_class->get_property = gst_thetauvcsrc_get_property;
 //  gobject_class->dispose = gst_thetauvcsrc_dispose;
     gobject_class->finalize = gst_thetauvcsrc_finalize;
+    GST_ELEMENT_CLASS(klass)->change_state =
+	GST_DEBUG_FUNCPTR(gst_thetauvcsrc_change_state);
+    GST_ELEMENT_CLASS(klass)->post_message =
+	GST_DEBUG_FUNCPTR(gst_thetauvcsrc_post_message);
     base_src_class->get_caps = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_get_caps);
     base_src_class->negotiate = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_negotiate);
 //  base_src_class->fixate = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_fixate);
     base_src_class->set_caps = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_set_caps);
-//  base_src_class->decide_allocation =
-//  GST_DEBUG_FUNCPTR (gst_thetauvcsrc_decide_allocation);
+    base_src_class->decide_allocation =
+	GST_DEBUG_FUNCPTR(gst_thetauvcsrc_decide_allocation);
     base_src_class->start = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_start);
     base_src_class->stop = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_stop);
 //  base_src_class->get_times = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_get_times);
@@ -154,10 +263,11 @@ gst_thetauvcsrc_class_init(GstThetauvcsrcClass * klass)
 //  base_src_class->prepare_seek_segment =
 //  GST_DEBUG_FUNCPTR (gst_thetauvcsrc_prepare_seek_segment);
 //  base_src_class->do_seek = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_do_seek);
-//  base_src_class->unlock = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_unlock);
-//  base_src_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_unlock_stop);
+    base_src_class->unlock = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_unlock);
+    base_src_class->unlock_stop =
+	GST_DEBUG_FUNCPTR(gst_thetauvcsrc_unlock_stop);
     base_src_class->query = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_query);
-//  base_src_class->event = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_event);
+    base_src_class->event = GST_DEBUG_FUNCPTR(gst_thetauvcsrc_event);
 //  base_src_class->create = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_create);
 //  base_src_class->alloc = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_alloc);
 //  base_src_class->fill = GST_DEBUG_FUNCPTR (gst_thetauvcsrc_fill);
@@ -176,7 +286,7 @@ gst_thetauvcsrc_class_init(GstThetauvcsrcClass * klass)
 	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT)));
     g_object_class_install_property(gobject_class, PROP_MODE,
 	g_param_spec_enum("mode", "Video mode",
-	    "Video mode to playback",
+	    "Video mode to playback if downstream does not ask for a size",
 	    gst_thetauvc_mode_get_type(), 0,
 	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | G_PARAM_CONSTRUCT)));
     g_object_class_install_property(gobject_class, PROP_DEVICE_INDEX,
@@ -184,18 +294,268 @@ gst_thetauvcsrc_class_init(GstThetauvcsrcClass * klass)
 	    "Device index",
 	    "Index of the opened device", -1, G_MAXINT, -1,
 	    (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_ZERO_COPY,
+	g_param_spec_boolean("zero-copy",
+	    "Zero copy",
+	    "Take over the frame payload from libuvc instead of copying it",
+	    FALSE, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_OVERFLOW_POLICY,
+	g_param_spec_enum("overflow-policy", "Overflow policy",
+	    "What to drop when the frame queue overflows",
+	    gst_thetauvc_overflow_get_type(),
+	    GST_THETAUVC_OVERFLOW_DROP_OLDEST_GOP,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_BUFFERS,
+	g_param_spec_uint("max-size-buffers", "Max. size (buffers)",
+	    "Max. number of frames queued (0=disable)",
+	    0, THETAUVCSRC_QUEUE_MAX_SIZE - 1, DEFAULT_MAX_SIZE_BUFFERS,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_BYTES,
+	g_param_spec_uint("max-size-bytes", "Max. size (bytes)",
+	    "Max. amount of data queued (bytes, 0=disable)",
+	    0, G_MAXUINT, DEFAULT_MAX_SIZE_BYTES,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_TIME,
+	g_param_spec_uint64("max-size-time", "Max. size (ns)",
+	    "Max. amount of data queued (in ns, 0=disable)",
+	    0, G_MAXUINT64, DEFAULT_MAX_SIZE_TIME,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_CUR_LEVEL_BUFFERS,
+	g_param_spec_uint("current-level-buffers", "Current level (buffers)",
+	    "Current number of frames queued",
+	    0, G_MAXUINT, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_CUR_LEVEL_BYTES,
+	g_param_spec_uint("current-level-bytes", "Current level (bytes)",
+	    "Current amount of data queued (bytes)",
+	    0, G_MAXUINT, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_CUR_LEVEL_TIME,
+	g_param_spec_uint64("current-level-time", "Current level (ns)",
+	    "Current amount of data queued (in ns)",
+	    0, G_MAXUINT64, 0, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_TIMEOUT,
+	g_param_spec_uint64("timeout", "Timeout",
+	    "Post a message after timeout nanoseconds without frames "
+	    "(0 = disabled)", 0, G_MAXUINT64, DEFAULT_TIMEOUT,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_CONFIG_INTERVAL,
+	g_param_spec_int("config-interval", "SPS/PPS Send Interval",
+	    "Insert the cached SPS/PPS before IDR frames every this many "
+	    "seconds and after a discontinuity (0 = disabled, -1 = with "
+	    "every IDR frame)", -1, 3600, DEFAULT_CONFIG_INTERVAL,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_AUTO_RECONNECT,
+	g_param_spec_boolean("auto-reconnect",
+	    "Auto reconnect",
+	    "Reopen the THETA with the same serial when it comes back after "
+	    "being unplugged, instead of failing",
+	    DEFAULT_AUTO_RECONNECT, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_BRINGUP_STATS,
+	g_param_spec_boxed("bringup-stats", "Bring-up statistics",
+	    "Time spent in each phase of the last start (ns): context, open, "
+	    "configuration, negotiation, streaming and total",
+	    GST_TYPE_STRUCTURE, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_REPLAY_LOCATION,
+	g_param_spec_string("replay-location", "Replay location",
+	    "Frame log written with record-location to play instead of a "
+	    "THETA", NULL, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_REPLAY_SPEED,
+	g_param_spec_double("replay-speed", "Replay speed",
+	    "Speed of the replay relative to the recorded pace "
+	    "(0 = as fast as possible)", 0.0, 1000.0, DEFAULT_REPLAY_SPEED,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_REPLAY_LOOP,
+	g_param_spec_boolean("replay-loop", "Replay loop",
+	    "Start the frame log over at its end instead of sending EOS",
+	    DEFAULT_REPLAY_LOOP, (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_RECORD_LOCATION,
+	g_param_spec_string("record-location", "Record location",
+	    "Write the frames with their arrival times to this file, "
+	    "for replay-location", NULL,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_STATS,
+	g_param_spec_boxed("stats", "Statistics",
+	    "Frame counters, queue high-water mark, data rate, frame sizes and "
+	    "callback-to-push latency since the start",
+	    GST_TYPE_STRUCTURE, (G_PARAM_READABLE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_STATS_INTERVAL,
+	g_param_spec_uint("stats-interval", "Statistics interval",
+	    "Post the statistics as a thetauvcsrc-stats element message "
+	    "every this many milliseconds, taken at start (0 = never)",
+	    0, G_MAXUINT, DEFAULT_STATS_INTERVAL,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_WATCHDOG,
+	g_param_spec_uint("watchdog", "Watchdog",
+	    "Restart streaming after this many frame intervals without a "
+	    "frame, then reset the device, then fail (0 = disabled)",
+	    0, G_MAXUINT, DEFAULT_WATCHDOG,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_BITRATE,
+	g_param_spec_uint("bitrate", "Bitrate",
+	    "Average bitrate of the camera encoder in kbit/s "
+	    "(0 = camera default)", 0, G_MAXUINT / 1000, DEFAULT_BITRATE,
+	    (G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+		G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_MAX_BITRATE,
+	g_param_spec_uint("max-bitrate", "Maximum bitrate",
+	    "Peak bitrate of the camera encoder in kbit/s, variable bitrate "
+	    "if above bitrate (0 = camera default)", 0, G_MAXUINT / 1000,
+	    DEFAULT_MAX_BITRATE,
+	    (G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+		G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_GOP_LENGTH,
+	g_param_spec_uint("gop-length", "GOP length",
+	    "Frames from an IDR frame to the next (0 = camera default)",
+	    0, G_MAXUINT, DEFAULT_GOP_LENGTH,
+	    (G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+		G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_QP,
+	g_param_spec_uint("qp", "QP",
+	    "Constant quantizer of the camera encoder, overrides the bitrates "
+	    "(0 = camera default)", 0, 51, DEFAULT_QP,
+	    (G_PARAM_READWRITE | GST_PARAM_MUTABLE_PLAYING |
+		G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_THREAD_POLICY,
+	g_param_spec_enum("callback-thread-policy", "Callback thread policy",
+	    "Scheduling policy of the USB event, frame callback and streaming "
+	    "threads, taken at start",
+	    gst_thetauvc_thread_policy_get_type(), DEFAULT_THREAD_POLICY,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_THREAD_PRIORITY,
+	g_param_spec_int("callback-thread-priority", "Callback thread priority",
+	    "Real-time priority with the fifo and rr policies (1-99), "
+	    "nice value with the other policy (-20-19)",
+	    -20, 99, DEFAULT_THREAD_PRIORITY,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_CPU_AFFINITY,
+	g_param_spec_string("cpu-affinity", "CPU affinity",
+	    "CPUs to run the USB event, frame callback and streaming threads "
+	    "on, such as \"2-3,6\" (NULL = any), taken at start", NULL,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_PRE_EVENT_TIME,
+	g_param_spec_uint64("pre-event-time", "Pre-event time",
+	    "Keep at least this much of the latest frames in memory for dump "
+	    "(in ns, 0 = disabled), taken at start",
+	    0, G_MAXUINT64, DEFAULT_PRE_EVENT_TIME,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_PRE_EVENT_MAX_BYTES,
+	g_param_spec_uint("pre-event-max-bytes", "Pre-event max. bytes",
+	    "Memory for the frames kept by pre-event-time, older GOPs are "
+	    "dropped to stay within it, taken at start",
+	    1, G_MAXUINT, DEFAULT_PRE_EVENT_MAX_BYTES,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_SHM_SOCKET_PATH,
+	g_param_spec_string("shm-socket-path", "Shared memory socket path",
+	    "Share the frames with thetauvcshmsrc elements connecting to this "
+	    "socket (NULL = disabled), taken at start", NULL,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+    g_object_class_install_property(gobject_class, PROP_SHM_SIZE,
+	g_param_spec_uint("shm-size", "Shared memory size",
+	    "Bytes of shared memory for the frames, taken at start",
+	    1024 * 1024, G_MAXUINT, DEFAULT_SHM_SIZE,
+	    (G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS)));
+
+    /**
+     * GstThetauvcsrc::dump:
+     * @location: file to write
+     * @duration: live frames to add after the event (ns)
+     *
+     * Write the frames kept by pre-event-time and the following ones as an
+     * H.264 byte-stream, starting at a key frame.  A thetauvcsrc-dump
+     * element message is posted when the file is complete.  Returns FALSE
+     * if a dump is in progress or the file cannot be opened.
+     */
+    thetauvcsrc_signals[SIGNAL_DUMP] =
+	g_signal_new("dump", G_TYPE_FROM_CLASS(klass),
+	G_SIGNAL_RUN_LAST | G_SIGNAL_ACTION,
+	G_STRUCT_OFFSET(GstThetauvcsrcClass, dump), NULL, NULL, NULL,
+	G_TYPE_BOOLEAN, 2, G_TYPE_STRING, G_TYPE_UINT64);
+    klass->dump = thetauvcsrc_dump;
 }
 
 static void
 gst_thetauvcsrc_init(GstThetauvcsrc * thetauvcsrc)
 {
-    g_mutex_init(&thetauvcsrc->lock);
-    g_cond_init(&thetauvcsrc->cond);
-    thetauvcsrc->queue = gst_queue_array_new(5);
+    gst_base_src_set_live(GST_BASE_SRC(thetauvcsrc), TRUE);
+    gst_base_src_set_format(GST_BASE_SRC(thetauvcsrc), GST_FORMAT_TIME);
+    gst_base_src_set_async(GST_BASE_SRC(thetauvcsrc), TRUE);
+
+    thetauvcsrc->queue = gst_thetauvc_queue_new(THETAUVCSRC_QUEUE_SIZE);
+    thetauvcsrc->overflow_policy = GST_THETAUVC_OVERFLOW_DROP_OLDEST_GOP;
+    thetauvcsrc->max_size_buffers = DEFAULT_MAX_SIZE_BUFFERS;
+    thetauvcsrc->max_size_bytes = DEFAULT_MAX_SIZE_BYTES;
+    thetauvcsrc->max_size_time = DEFAULT_MAX_SIZE_TIME;
+    thetauvcsrc->timeout = DEFAULT_TIMEOUT;
     thetauvcsrc->ctx = NULL;
     thetauvcsrc->devh = NULL;
     thetauvcsrc->dev = NULL;
     thetauvcsrc->current_caps = NULL;
+    thetauvcsrc->device_caps = NULL;
+    thetauvcsrc->zero_copy = FALSE;
+    thetauvcsrc->allocator = gst_thetauvc_allocator_new();
+    thetauvcsrc->pool = NULL;
+    thetauvcsrc->pending_pool = NULL;
+    thetauvcsrc->cb_pool = NULL;
+    thetauvcsrc->pool_allocator = NULL;
+    thetauvcsrc->max_frame_size = 0;
+    thetauvcsrc->cb_sps = NULL;
+    thetauvcsrc->cb_pps = NULL;
+    thetauvcsrc->pending_headers = NULL;
+    thetauvcsrc->headers = NULL;
+    thetauvcsrc->config_interval = DEFAULT_CONFIG_INTERVAL;
+    thetauvcsrc->last_config = GST_CLOCK_TIME_NONE;
+    thetauvcsrc->config_discont = FALSE;
+    thetauvcsrc->key_unit_pending = FALSE;
+    thetauvcsrc->key_unit_all_headers = FALSE;
+    thetauvcsrc->key_unit_count = 0;
+    thetauvcsrc->context = NULL;
+    thetauvcsrc->has_devices = FALSE;
+    thetauvcsrc->devices_watch = 0;
+    thetauvcsrc->auto_reconnect = DEFAULT_AUTO_RECONNECT;
+    thetauvcsrc->reconnect_thread = NULL;
+    g_mutex_init(&thetauvcsrc->reconnect_lock);
+    g_cond_init(&thetauvcsrc->reconnect_cond);
+    thetauvcsrc->device_lost = 0;
+    thetauvcsrc->watchdog = DEFAULT_WATCHDOG;
+    thetauvcsrc->bitrate = DEFAULT_BITRATE;
+    thetauvcsrc->max_bitrate = DEFAULT_MAX_BITRATE;
+    thetauvcsrc->gop_length = DEFAULT_GOP_LENGTH;
+    thetauvcsrc->qp = DEFAULT_QP;
+    thetauvcsrc->thread_policy = DEFAULT_THREAD_POLICY;
+    thetauvcsrc->thread_priority = DEFAULT_THREAD_PRIORITY;
+    thetauvcsrc->cpu_affinity = NULL;
+    thetauvcsrc->sched.policy = GST_THETAUVC_THREAD_POLICY_DEFAULT;
+    thetauvcsrc->sched.cpus = NULL;
+    thetauvcsrc->cb_sched = FALSE;
+    thetauvcsrc->create_thread = NULL;
+    thetauvcsrc->create_saved.saved = FALSE;
+    thetauvcsrc->create_saved.cpus = NULL;
+    thetauvcsrc->ring = gst_thetauvc_ring_new(thetauvcsrc_dump_done,
+	thetauvcsrc);
+    thetauvcsrc->pre_event_time = DEFAULT_PRE_EVENT_TIME;
+    thetauvcsrc->pre_event_max_bytes = DEFAULT_PRE_EVENT_MAX_BYTES;
+    thetauvcsrc->shm = NULL;
+    thetauvcsrc->shm_socket_path = NULL;
+    thetauvcsrc->shm_size = DEFAULT_SHM_SIZE;
+    thetauvcsrc->watchdog_thread = NULL;
+    g_cond_init(&thetauvcsrc->watchdog_cond);
+    thetauvcsrc->watchdog_stop = FALSE;
+    thetauvcsrc->watchdog_resetting = FALSE;
+    thetauvcsrc->reconnects = 0;
+    thetauvcsrc->gap_start = GST_CLOCK_TIME_NONE;
+    thetauvcsrc->bringup_thread = NULL;
+    g_mutex_init(&thetauvcsrc->bringup_lock);
+    thetauvcsrc->bringup_cancel = FALSE;
+    thetauvcsrc->bringup_stats = NULL;
+    thetauvcsrc->backend = &thetauvc_backend_uvc;
+    thetauvcsrc->replay = NULL;
+    thetauvcsrc->recorder = NULL;
+    thetauvcsrc->replay_location = NULL;
+    thetauvcsrc->replay_speed = DEFAULT_REPLAY_SPEED;
+    thetauvcsrc->replay_loop = DEFAULT_REPLAY_LOOP;
+    thetauvcsrc->record_location = NULL;
+    thetauvcsrc->replay_eos = 0;
+    thetauvcsrc->stats.tick = NULL;
+    thetauvcsrc->stats_interval = DEFAULT_STATS_INTERVAL;
 }
 
 void
@@ -215,6 +575,101 @@ gst_thetauvcsrc_set_property(GObject * object, guint property_id,
 	break;
     case PROP_MODE:
 	thetauvcsrc->mode = (GstThetauvcModeEnum) g_value_get_enum(value);
+	/* a running source switches in negotiate() */
+	gst_pad_mark_reconfigure(GST_BASE_SRC_PAD(thetauvcsrc));
+	break;
+    case PROP_ZERO_COPY:
+	thetauvcsrc->zero_copy = g_value_get_boolean(value);
+	break;
+    case PROP_OVERFLOW_POLICY:
+	thetauvcsrc->overflow_policy =
+	    (GstThetauvcOverflowEnum) g_value_get_enum(value);
+	break;
+    case PROP_MAX_SIZE_BUFFERS:
+	thetauvcsrc->max_size_buffers = g_value_get_uint(value);
+	break;
+    case PROP_MAX_SIZE_BYTES:
+	thetauvcsrc->max_size_bytes = g_value_get_uint(value);
+	break;
+    case PROP_MAX_SIZE_TIME:
+	thetauvcsrc->max_size_time = g_value_get_uint64(value);
+	break;
+    case PROP_TIMEOUT:
+	thetauvcsrc->timeout = g_value_get_uint64(value);
+	break;
+    case PROP_CONFIG_INTERVAL:
+	thetauvcsrc->config_interval = g_value_get_int(value);
+	break;
+    case PROP_AUTO_RECONNECT:
+	thetauvcsrc->auto_reconnect = g_value_get_boolean(value);
+	break;
+    case PROP_REPLAY_LOCATION:
+	g_free(thetauvcsrc->replay_location);
+	thetauvcsrc->replay_location = g_value_dup_string(value);
+	break;
+    case PROP_REPLAY_SPEED:
+	thetauvcsrc->replay_speed = g_value_get_double(value);
+	break;
+    case PROP_REPLAY_LOOP:
+	thetauvcsrc->replay_loop = g_value_get_boolean(value);
+	break;
+    case PROP_RECORD_LOCATION:
+	g_free(thetauvcsrc->record_location);
+	thetauvcsrc->record_location = g_value_dup_string(value);
+	break;
+    case PROP_STATS_INTERVAL:
+	thetauvcsrc->stats_interval = g_value_get_uint(value);
+	break;
+    case PROP_WATCHDOG:
+	thetauvcsrc->watchdog = g_value_get_uint(value);
+	break;
+    case PROP_BITRATE:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	thetauvcsrc->bitrate = g_value_get_uint(value);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	thetauvcsrc_update_encoder(thetauvcsrc);
+	break;
+    case PROP_MAX_BITRATE:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	thetauvcsrc->max_bitrate = g_value_get_uint(value);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	thetauvcsrc_update_encoder(thetauvcsrc);
+	break;
+    case PROP_GOP_LENGTH:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	thetauvcsrc->gop_length = g_value_get_uint(value);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	thetauvcsrc_update_encoder(thetauvcsrc);
+	break;
+    case PROP_QP:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	thetauvcsrc->qp = g_value_get_uint(value);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	thetauvcsrc_update_encoder(thetauvcsrc);
+	break;
+    case PROP_THREAD_POLICY:
+	thetauvcsrc->thread_policy =
+	    (GstThetauvcThreadPolicy) g_value_get_enum(value);
+	break;
+    case PROP_THREAD_PRIORITY:
+	thetauvcsrc->thread_priority = g_value_get_int(value);
+	break;
+    case PROP_CPU_AFFINITY:
+	g_free(thetauvcsrc->cpu_affinity);
+	thetauvcsrc->cpu_affinity = g_value_dup_string(value);
+	break;
+    case PROP_PRE_EVENT_TIME:
+	thetauvcsrc->pre_event_time = g_value_get_uint64(value);
+	break;
+    case PROP_PRE_EVENT_MAX_BYTES:
+	thetauvcsrc->pre_event_max_bytes = g_value_get_uint(value);
+	break;
+    case PROP_SHM_SOCKET_PATH:
+	g_free(thetauvcsrc->shm_socket_path);
+	thetauvcsrc->shm_socket_path = g_value_dup_string(value);
+	break;
+    case PROP_SHM_SIZE:
+	thetauvcsrc->shm_size = g_value_get_uint(value);
 	break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
@@ -243,6 +698,116 @@ gst_thetauvcsrc_get_property(GObject * object, guint property_id,
     case PROP_DEVICE_INDEX:
 	g_value_set_int(value, thetauvcsrc->ctx ? thetauvcsrc->device_index : -1);
 	break;
+    case PROP_ZERO_COPY:
+	g_value_set_boolean(value, thetauvcsrc->zero_copy);
+	break;
+    case PROP_OVERFLOW_POLICY:
+	g_value_set_enum(value, thetauvcsrc->overflow_policy);
+	break;
+    case PROP_MAX_SIZE_BUFFERS:
+	g_value_set_uint(value, thetauvcsrc->max_size_buffers);
+	break;
+    case PROP_MAX_SIZE_BYTES:
+	g_value_set_uint(value, thetauvcsrc->max_size_bytes);
+	break;
+    case PROP_MAX_SIZE_TIME:
+	g_value_set_uint64(value, thetauvcsrc->max_size_time);
+	break;
+    case PROP_TIMEOUT:
+	g_value_set_uint64(value, thetauvcsrc->timeout);
+	break;
+    case PROP_CONFIG_INTERVAL:
+	g_value_set_int(value, thetauvcsrc->config_interval);
+	break;
+    case PROP_AUTO_RECONNECT:
+	g_value_set_boolean(value, thetauvcsrc->auto_reconnect);
+	break;
+    case PROP_REPLAY_LOCATION:
+	g_value_set_string(value, thetauvcsrc->replay_location);
+	break;
+    case PROP_REPLAY_SPEED:
+	g_value_set_double(value, thetauvcsrc->replay_speed);
+	break;
+    case PROP_REPLAY_LOOP:
+	g_value_set_boolean(value, thetauvcsrc->replay_loop);
+	break;
+    case PROP_RECORD_LOCATION:
+	g_value_set_string(value, thetauvcsrc->record_location);
+	break;
+    case PROP_STATS:
+	g_value_take_boxed(value, thetauvcsrc_stats_new(thetauvcsrc,
+		thetauvcsrc->stats.start, 0));
+	break;
+    case PROP_STATS_INTERVAL:
+	g_value_set_uint(value, thetauvcsrc->stats_interval);
+	break;
+    case PROP_WATCHDOG:
+	g_value_set_uint(value, thetauvcsrc->watchdog);
+	break;
+    case PROP_BITRATE:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value, thetauvcsrc->bitrate);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_MAX_BITRATE:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value, thetauvcsrc->max_bitrate);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_GOP_LENGTH:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value, thetauvcsrc->gop_length);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_QP:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value, thetauvcsrc->qp);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_THREAD_POLICY:
+	g_value_set_enum(value, thetauvcsrc->thread_policy);
+	break;
+    case PROP_THREAD_PRIORITY:
+	g_value_set_int(value, thetauvcsrc->thread_priority);
+	break;
+    case PROP_CPU_AFFINITY:
+	g_value_set_string(value, thetauvcsrc->cpu_affinity);
+	break;
+    case PROP_PRE_EVENT_TIME:
+	g_value_set_uint64(value, thetauvcsrc->pre_event_time);
+	break;
+    case PROP_PRE_EVENT_MAX_BYTES:
+	g_value_set_uint(value, thetauvcsrc->pre_event_max_bytes);
+	break;
+    case PROP_SHM_SOCKET_PATH:
+	g_value_set_string(value, thetauvcsrc->shm_socket_path);
+	break;
+    case PROP_SHM_SIZE:
+	g_value_set_uint(value, thetauvcsrc->shm_size);
+	break;
+    case PROP_BRINGUP_STATS:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_boxed(value, thetauvcsrc->bringup_stats);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_CUR_LEVEL_BUFFERS:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value,
+	    gst_thetauvc_queue_length(thetauvcsrc->queue));
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_CUR_LEVEL_BYTES:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint(value,
+	    gst_thetauvc_queue_level_bytes(thetauvcsrc->queue));
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
+    case PROP_CUR_LEVEL_TIME:
+	GST_OBJECT_LOCK(thetauvcsrc);
+	g_value_set_uint64(value,
+	    gst_thetauvc_queue_level_time(thetauvcsrc->queue));
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
 	break;
@@ -261,6 +826,95 @@ gst_thetauvcsrc_dispose(GObject * object)
     G_OBJECT_CLASS(gst_thetauvcsrc_parent_class)->dispose(object);
 }
 
+/* Forget the cached parameter sets.  cb() must not be running. */
+static void
+thetauvcsrc_clear_headers(GstThetauvcsrc * thetauvcsrc)
+{
+    GstBuffer *headers;
+
+    g_clear_pointer(&thetauvcsrc->cb_sps, g_bytes_unref);
+    g_clear_pointer(&thetauvcsrc->cb_pps, g_bytes_unref);
+    headers = g_atomic_pointer_exchange(&thetauvcsrc->pending_headers, NULL);
+    if (headers != NULL)
+	gst_buffer_unref(headers);
+    gst_buffer_replace(&thetauvcsrc->headers, NULL);
+    thetauvcsrc->last_config = GST_CLOCK_TIME_NONE;
+    thetauvcsrc->config_discont = FALSE;
+    GST_OBJECT_LOCK(thetauvcsrc);
+    thetauvcsrc->key_unit_pending = FALSE;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+}
+
+/*
+ * Create a libuvc context on the shared libusb context.  libuvc does not
+ * handle the events of a context it was given, the shared thread does.
+ */
+static  gboolean
+thetauvcsrc_open_context(GstThetauvcsrc * thetauvcsrc)
+{
+    if ((thetauvcsrc->context = gst_thetauvc_context_ref()) == NULL)
+	return FALSE;
+    if (gst_thetauvc_thread_sched_is_set(&thetauvcsrc->sched))
+	gst_thetauvc_context_set_sched(thetauvcsrc->context,
+	    &thetauvcsrc->sched);
+
+    if (uvc_init(&thetauvcsrc->ctx, thetauvcsrc->context->usb_ctx)
+	!= UVC_SUCCESS) {
+	thetauvcsrc->ctx = NULL;
+	gst_thetauvc_context_unref(thetauvcsrc->context);
+	thetauvcsrc->context = NULL;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Close the device and release the contexts.  Streaming must be stopped. */
+static void
+thetauvcsrc_close(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->replay != NULL) {
+	thetauvc_replay_close(thetauvcsrc->replay);
+	thetauvcsrc->replay = NULL;
+    }
+    if (thetauvcsrc->recorder != NULL) {
+	thetauvc_recorder_close(thetauvcsrc->recorder);
+	thetauvcsrc->recorder = NULL;
+    }
+
+    if (thetauvcsrc->devices_watch != 0) {
+	gst_thetauvc_devices_remove_watch(thetauvcsrc->devices_watch);
+	thetauvcsrc->devices_watch = 0;
+    }
+
+    if (thetauvcsrc->devh != NULL) {
+	uvc_close(thetauvcsrc->devh);
+	thetauvcsrc->devh = NULL;
+
+	if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC)
+	    thetauvc_switch_configuration(thetauvcsrc->context->usb_ctx,
+		thetauvcsrc->dev_bus, thetauvcsrc->dev_addr, 1);
+    }
+    if (thetauvcsrc->dev != NULL) {
+	uvc_unref_device(thetauvcsrc->dev);
+	thetauvcsrc->dev = NULL;
+    }
+    if (thetauvcsrc->ctx != NULL) {
+	uvc_exit(thetauvcsrc->ctx);
+	thetauvcsrc->ctx = NULL;
+    }
+
+    if (thetauvcsrc->context != NULL) {
+	gst_thetauvc_context_unref(thetauvcsrc->context);
+	thetauvcsrc->context = NULL;
+    }
+
+    if (thetauvcsrc->has_devices) {
+	gst_thetauvc_devices_unref();
+	thetauvcsrc->has_devices = FALSE;
+    }
+}
+
 void
 gst_thetauvcsrc_finalize(GObject * object)
 {
@@ -269,33 +923,33 @@ gst_thetauvcsrc_finalize(GObject * object)
     GST_DEBUG_OBJECT(thetauvcsrc, "finalize");
 
     /* clean up object here */
-    g_mutex_clear(&thetauvcsrc->lock);
-    g_cond_clear(&thetauvcsrc->cond);
-
     if (thetauvcsrc->queue) {
-	while (gst_queue_array_get_length(thetauvcsrc->queue) > 0) {
-	    GstBuffer *t;
-	    t = (GstBuffer *)gst_queue_array_pop_head(thetauvcsrc->queue);
-	    gst_buffer_unref(t);
-	}
-	gst_queue_array_free(thetauvcsrc->queue);
+	gst_thetauvc_queue_free(thetauvcsrc->queue);
 	thetauvcsrc->queue = NULL;
     }
 
-    if (thetauvcsrc->devh) {
-	uvc_close(thetauvcsrc->devh);
-
-	if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC) {
-	    uint16_t bus, addr;
-	    bus = uvc_get_bus_number(thetauvcsrc->dev);
-	    addr = uvc_get_device_address(thetauvcsrc->dev);
-	    thetauvc_switch_configuration(bus, addr, 1);
-	}
-
-	uvc_exit(thetauvcsrc->ctx);
-    }
+    thetauvcsrc_close(thetauvcsrc);
+    g_mutex_clear(&thetauvcsrc->reconnect_lock);
+    g_cond_clear(&thetauvcsrc->reconnect_cond);
+    g_cond_clear(&thetauvcsrc->watchdog_cond);
+    g_mutex_clear(&thetauvcsrc->bringup_lock);
+    if (thetauvcsrc->bringup_stats != NULL)
+	gst_structure_free(thetauvcsrc->bringup_stats);
+    g_free(thetauvcsrc->replay_location);
+    g_free(thetauvcsrc->record_location);
+    g_free(thetauvcsrc->cpu_affinity);
+    g_free(thetauvcsrc->shm_socket_path);
+    gst_thetauvc_thread_sched_clear(&thetauvcsrc->sched);
+    g_free(thetauvcsrc->create_saved.cpus);
+    gst_thetauvc_ring_free(thetauvcsrc->ring);
     if (thetauvcsrc->current_caps != NULL)
 	gst_caps_unref(thetauvcsrc->current_caps);
+    if (thetauvcsrc->device_caps != NULL)
+	gst_caps_unref(thetauvcsrc->device_caps);
+    thetauvcsrc_clear_headers(thetauvcsrc);
+    gst_object_unref(thetauvcsrc->allocator);
+    if (thetauvcsrc->pool_allocator != NULL)
+	gst_object_unref(thetauvcsrc->pool_allocator);
 
     G_OBJECT_CLASS(gst_thetauvcsrc_parent_class)->finalize(object);
 }
@@ -305,15 +959,38 @@ get_current_caps(GstThetauvcsrc *src)
 {
     GstCaps *caps;
 
+    GST_OBJECT_LOCK(src);
     if (src->current_caps != NULL)
 	caps = gst_caps_copy(src->current_caps);
     else
+	caps = NULL;
+    GST_OBJECT_UNLOCK(src);
+    if (caps == NULL)
 	caps = gst_pad_get_pad_template_caps(GST_BASE_SRC_PAD(src));
 
     GST_DEBUG_OBJECT(src, "%s", gst_caps_to_string(caps));
     return caps;
 }
 
+/* All formats of the device once it is open, so that downstream can ask
+ * for another one while streaming */
+static GstCaps *
+get_possible_caps(GstThetauvcsrc *src)
+{
+    GstCaps *caps;
+
+    GST_OBJECT_LOCK(src);
+    if (src->device_caps != NULL)
+	caps = gst_caps_copy(src->device_caps);
+    else
+	caps = NULL;
+    GST_OBJECT_UNLOCK(src);
+    if (caps == NULL)
+	caps = get_current_caps(src);
+
+    return caps;
+}
+
 /* get caps from subclass */
 static GstCaps *
 gst_thetauvcsrc_get_caps(GstBaseSrc * src, GstCaps * filter)
@@ -323,7 +1000,7 @@ gst_thetauvcsrc_get_caps(GstBaseSrc * src, GstCaps * filter)
 
     GST_DEBUG_OBJECT(thetauvcsrc, "get_caps");
 
-    caps = get_current_caps(thetauvcsrc);
+    caps = get_possible_caps(thetauvcsrc);
 
     if (filter) {
 	rcaps =
@@ -344,6 +1021,9 @@ gst_thetauvcsrc_negotiate(GstBaseSrc * src)
     GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
     GstCaps *caps;
 
+    if (!thetauvcsrc_switch_format(thetauvcsrc))
+	return FALSE;
+
     caps = get_current_caps(thetauvcsrc);
     gst_base_src_set_caps(src, caps);
     gst_caps_unref(caps);
@@ -376,226 +1056,1906 @@ gst_thetauvcsrc_set_caps(GstBaseSrc * src, GstCaps * caps)
     return TRUE;
 }
 
+/* Create a new pool of the given size and hand it over to cb() */
+static  gboolean
+thetauvcsrc_setup_pool(GstThetauvcsrc * thetauvcsrc, GstCaps * caps,
+    guint size)
+{
+    GstBufferPool *pool, *old;
+    GstStructure *config;
+
+    pool = gst_buffer_pool_new();
+    config = gst_buffer_pool_get_config(pool);
+    gst_buffer_pool_config_set_params(config, caps, size,
+	thetauvcsrc->pool_min, thetauvcsrc->pool_max);
+    gst_buffer_pool_config_set_allocator(config, thetauvcsrc->pool_allocator,
+	&thetauvcsrc->pool_params);
+
+    if (!gst_buffer_pool_set_config(pool, config)
+	|| !gst_buffer_pool_set_active(pool, TRUE)) {
+	GST_WARNING_OBJECT(thetauvcsrc, "Failed to set up buffer pool");
+	gst_object_unref(pool);
+	return FALSE;
+    }
+    GST_DEBUG_OBJECT(thetauvcsrc, "buffer pool size %u (min %u, max %u)",
+	size, thetauvcsrc->pool_min, thetauvcsrc->pool_max);
+
+    if (thetauvcsrc->pool != NULL)
+	gst_object_unref(thetauvcsrc->pool);
+    thetauvcsrc->pool = pool;
+    thetauvcsrc->pool_size = size;
+
+    old = g_atomic_pointer_exchange(&thetauvcsrc->pending_pool,
+	gst_object_ref(pool));
+    if (old != NULL)
+	gst_object_unref(old);
+
+    return TRUE;
+}
+
+/* Release all pools.  cb() must not be running. */
+static void
+thetauvcsrc_clear_pool(GstThetauvcsrc * thetauvcsrc)
+{
+    GstBufferPool *pool;
+
+    pool = g_atomic_pointer_exchange(&thetauvcsrc->pending_pool, NULL);
+    if (pool != NULL)
+	gst_object_unref(pool);
+    if (thetauvcsrc->cb_pool != NULL) {
+	gst_object_unref(thetauvcsrc->cb_pool);
+	thetauvcsrc->cb_pool = NULL;
+    }
+    if (thetauvcsrc->pool != NULL) {
+	gst_buffer_pool_set_active(thetauvcsrc->pool, FALSE);
+	gst_object_unref(thetauvcsrc->pool);
+	thetauvcsrc->pool = NULL;
+    }
+    thetauvcsrc->pool_size = 0;
+}
+
 /* setup allocation query */
 static  gboolean
 gst_thetauvcsrc_decide_allocation(GstBaseSrc * src, GstQuery * query)
 {
     GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+    GstAllocator *allocator;
+    GstAllocationParams params;
+    GstCaps *caps;
+    guint   size, min, max;
 
     GST_DEBUG_OBJECT(thetauvcsrc, "decide_allocation");
 
-    return TRUE;
-}
+    gst_query_parse_allocation(query, &caps, NULL);
 
-void
-cb(uvc_frame_t * frame, void *ptr)
-{
-    GstThetauvcsrc *thetauvcsrc;
-    GstBuffer *buffer;
-    GstMapInfo map;
-    guint64 interval;
+    allocator = NULL;
+    gst_allocation_params_init(&params);
+    if (gst_query_get_n_allocation_params(query) > 0)
+	gst_query_parse_nth_allocation_param(query, 0, &allocator, &params);
 
-    thetauvcsrc = (GstThetauvcsrc *) ptr;
-    buffer = gst_buffer_new_allocate(NULL, frame->data_bytes, NULL);
-    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
-    memcpy(map.data, frame->data, frame->data_bytes);
-    gst_buffer_unmap(buffer, &map);
+    size = min = max = 0;
+    if (gst_query_get_n_allocation_pools(query) > 0)
+	gst_query_parse_nth_allocation_pool(query, 0, NULL, &size, &min, &max);
 
-    interval = thetauvcsrc->ctrl.dwFrameInterval * 100;
-    GST_BUFFER_PTS(buffer) = frame->sequence * interval;
-    GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
-    GST_BUFFER_DURATION(buffer) = interval;
-    GST_BUFFER_OFFSET(buffer) = frame->sequence;
-    GST_BUFFER_TIMESTAMP(buffer) = thetauvcsrc->framecount * interval;
+    if (thetauvcsrc->pool_allocator != NULL)
+	gst_object_unref(thetauvcsrc->pool_allocator);
+    thetauvcsrc->pool_allocator = allocator;
+    thetauvcsrc->pool_params = params;
+    thetauvcsrc->pool_min = min;
+    thetauvcsrc->pool_max = max;
 
-    g_mutex_lock(&thetauvcsrc->lock);
-    if (gst_queue_array_get_length(thetauvcsrc->queue) > 30) {
-	GstBuffer *b;
-	b = (GstBuffer *)gst_queue_array_pop_head(thetauvcsrc->queue);
-	gst_buffer_unref(b);
-    }
-    gst_queue_array_push_tail(thetauvcsrc->queue, buffer);
-    thetauvcsrc->framecount++;
-    g_cond_signal(&thetauvcsrc->cond);
-    g_mutex_unlock(&thetauvcsrc->lock);
+    /* Initial guess from the frame size, bounded by what was seen so far */
+    size = MAX(size, thetauvcsrc->mode_val.width *
+	thetauvcsrc->mode_val.height / 8);
+    size = MAX(size, g_atomic_int_get(&thetauvcsrc->max_frame_size));
 
-    return;
+    if (!thetauvcsrc_setup_pool(thetauvcsrc, caps, size))
+	return FALSE;
+
+    if (gst_query_get_n_allocation_pools(query) > 0)
+	gst_query_set_nth_allocation_pool(query, 0, thetauvcsrc->pool, size,
+	    min, max);
+    else
+	gst_query_add_allocation_pool(query, thetauvcsrc->pool, size, min,
+	    max);
+
+    return TRUE;
 }
 
-static GstCaps *
-thetauvcsrc_fixate_srccaps(GstThetauvcsrc *thetauvcsrc)
+/* Grow the pool once frames larger than its buffers have been seen */
+static void
+thetauvcsrc_check_pool(GstThetauvcsrc * thetauvcsrc)
 {
-    GstCaps *caps;
-    caps = gst_caps_from_string(GST_THETAUVCSRC_CAPS_BASE);
-    gst_caps_set_simple(caps, "width", G_TYPE_INT, thetauvcsrc->mode_val.width,
-	"height", G_TYPE_INT, thetauvcsrc->mode_val.height, NULL);
-
-    if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC)
-	gst_caps_set_simple(caps, "profile", G_TYPE_STRING, "high", NULL);
+    guint   max_size;
 
-    unsigned int den, num;
-    den = 1001;
-    switch(thetauvcsrc->ctrl.dwFrameInterval) {
-    case 417083:					/* 23.98fps */
-        num = 25000;
-	break;
-    case 333667:					/* 29.97fps */
-	num = 30000;
-	break;
-    case 166833:					/* 59.94fps */
-	num = 60000;
-	break;
-    default: 						/* integer framerate */
-	num = 10000000 / thetauvcsrc->ctrl.dwFrameInterval;
-	den = 1;
-	break;
-    }
-    gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, num, den, NULL);
+    max_size = g_atomic_int_get(&thetauvcsrc->max_frame_size);
+    if (thetauvcsrc->pool == NULL || max_size <= thetauvcsrc->pool_size)
+	return;
 
-    return caps;
+    GST_DEBUG_OBJECT(thetauvcsrc, "frame size %u exceeds pool size %u",
+	max_size, thetauvcsrc->pool_size);
+    thetauvcsrc_setup_pool(thetauvcsrc, thetauvcsrc->current_caps,
+	max_size + max_size / 4);
 }
 
-/* start and stop processing, ideal for opening/closing the resource */
-static  gboolean
-gst_thetauvcsrc_start(GstBaseSrc * src)
+/* Copy the frame into a pooled buffer, runs on the libuvc thread */
+static GstBuffer *
+thetauvcsrc_copy_frame(GstThetauvcsrc * thetauvcsrc, uvc_frame_t * frame)
 {
-    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
-    uvc_device_descriptor_t *desc;
-    uvc_error_t res;
-    int mode;
+    GstBufferPoolAcquireParams params = {
+	.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT
+    };
+    GstBufferPool *pool;
+    GstBuffer *buffer;
 
-    GST_DEBUG_OBJECT(thetauvcsrc, "start");
-    GST_DEBUG_OBJECT(thetauvcsrc, "dev=%d mode=%d",
-	thetauvcsrc->device_number, thetauvcsrc->mode);
+    if (g_atomic_pointer_get(&thetauvcsrc->pending_pool) != NULL) {
+	GstStructure *config;
 
-    res = uvc_init(&thetauvcsrc->ctx, NULL);
-    if (res != UVC_SUCCESS) {
-	thetauvcsrc->ctx = NULL;
-	GST_ELEMENT_ERROR(src, LIBRARY, INIT,
-	    ("Could not initialize libuvc."), (NULL));
-	return FALSE;
-    }
+	pool = g_atomic_pointer_exchange(&thetauvcsrc->pending_pool, NULL);
+	if (thetauvcsrc->cb_pool != NULL)
+	    gst_object_unref(thetauvcsrc->cb_pool);
+	thetauvcsrc->cb_pool = pool;
 
-    if (thetauvcsrc->serial != NULL) {
-	res = thetauvc_find_device_by_serial(thetauvcsrc->ctx, &thetauvcsrc->dev,
-		thetauvcsrc->serial);
-	if (res != UVC_SUCCESS) {
-	    GST_ELEMENT_ERROR(src, RESOURCE, NOT_FOUND,
-		("Theta (serial:%s) not found.", thetauvcsrc->serial), (NULL));
-	    uvc_exit(thetauvcsrc->ctx);
-	    return FALSE;
-	}
-	thetauvcsrc->device_index = -1;
-	res = uvc_open(thetauvcsrc->dev, &thetauvcsrc->devh);
-    } else {
-	if (thetauvcsrc->device_number == -1) {
-	    int i;
-	    i = 0;
-	    while(1) {
-		res = thetauvc_find_device(thetauvcsrc->ctx, &thetauvcsrc->dev, i);
-		if (res != UVC_SUCCESS)
-		    break;
-		res = uvc_open(thetauvcsrc->dev, &thetauvcsrc->devh);
-		if (res == UVC_SUCCESS) {
-		    thetauvcsrc->device_index = i;
-		    break;
-		}
-		uvc_unref_device(thetauvcsrc->dev);
-		i++;
-	    };
-
-	    if (res != UVC_SUCCESS) {
-		if (i == 0)
-		    GST_ELEMENT_ERROR(src, RESOURCE, NOT_FOUND,
-		   	 ("Theta not found."), (NULL));
-		else
-		    GST_ELEMENT_ERROR(src, RESOURCE, NOT_FOUND,
-		   	 ("Found %d Theta(s), but none available.", i), (NULL));
-		uvc_exit(thetauvcsrc->ctx);
-		return FALSE;
-	    }
-	} else {
-	    res = thetauvc_find_device(thetauvcsrc->ctx, &thetauvcsrc->dev,
-		thetauvcsrc->device_number);
-	    if (res != UVC_SUCCESS) {
-		GST_ELEMENT_ERROR(src, RESOURCE, NOT_FOUND,
-		    ("Theta not found."), (NULL));
-		uvc_exit(thetauvcsrc->ctx);
-		return FALSE;
-	    }
-	    res = uvc_open(thetauvcsrc->dev, &thetauvcsrc->devh);
-	    thetauvcsrc->device_index = thetauvcsrc->device_number;
-	}
+	config = gst_buffer_pool_get_config(pool);
+	gst_buffer_pool_config_get_params(config, NULL,
+	    &thetauvcsrc->cb_pool_size, NULL, NULL);
+	gst_structure_free(config);
     }
 
-    if (res != UVC_SUCCESS) {
-	GST_ELEMENT_ERROR(src, RESOURCE, OPEN_READ_WRITE,
-	    ("Could not open Theta."), (NULL));
-	uvc_exit(thetauvcsrc->ctx);
-	return FALSE;
-    }
+    if (frame->data_bytes > g_atomic_int_get(&thetauvcsrc->max_frame_size))
+	g_atomic_int_set(&thetauvcsrc->max_frame_size, frame->data_bytes);
 
-    if (thetauvcsrc->serial == NULL) {
-	if (uvc_get_device_descriptor(thetauvcsrc->dev, &desc) == UVC_SUCCESS) {
-	    thetauvcsrc->serial = g_strdup(desc->serialNumber);
-	    thetauvcsrc->dev_pid = desc->idProduct;
-	    uvc_free_device_descriptor(desc);
-	}
+    buffer = NULL;
+    if (thetauvcsrc->cb_pool != NULL
+	&& frame->data_bytes <= thetauvcsrc->cb_pool_size) {
+	if (gst_buffer_pool_acquire_buffer(thetauvcsrc->cb_pool, &buffer,
+		&params) != GST_FLOW_OK)
+	    buffer = NULL;
     }
-    GST_DEBUG_OBJECT(thetauvcsrc, "Serial: %s", thetauvcsrc->serial);
-
-    if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC) {
-	uint16_t bus, addr;
-	uvc_close(thetauvcsrc->devh);
+    if (buffer == NULL)
+	buffer = gst_buffer_new_allocate(NULL, frame->data_bytes, NULL);
 
-	bus = uvc_get_bus_number(thetauvcsrc->dev);
-	addr = uvc_get_device_address(thetauvcsrc->dev);
-	thetauvc_switch_configuration(bus, addr, 2);
+    gst_buffer_fill(buffer, 0, frame->data, frame->data_bytes);
+    gst_buffer_set_size(buffer, frame->data_bytes);
 
-	uvc_open(thetauvcsrc->dev, &thetauvcsrc->devh);
-    }
+    return buffer;
+}
 
-    switch (thetauvcsrc->mode) {
-    case GST_THETAUVC_MODE_2K:
-	if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC)
-	    mode = THETAUVC_MODE_FHD_S;
-	else
-	    mode = THETAUVC_MODE_FHD;
-	break;
-    case GST_THETAUVC_MODE_4K:
-	mode = THETAUVC_MODE_UHD;
-	break;
-    }
-    res = thetauvc_get_stream_ctrl_format_size(thetauvcsrc->devh,
-	mode, &thetauvcsrc->ctrl, &thetauvcsrc->mode_val);
+/* Would queueing the frame exceed any of the max-size-* limits? */
+static  gboolean
+thetauvcsrc_queue_overflow(GstThetauvcsrc * thetauvcsrc, GstBuffer * buffer)
+{
+    GstThetauvcQueue *q = thetauvcsrc->queue;
+    guint   buffers, bytes;
+    guint64 time;
 
-    if (res != UVC_SUCCESS) {
-	GST_ELEMENT_ERROR(src, RESOURCE, OPEN_READ_WRITE,
-	    ("No available stream"), (NULL));
+    buffers = gst_thetauvc_queue_length(q);
+    if (buffers == 0)
 	return FALSE;
-    }
 
-    thetauvcsrc->current_caps = thetauvcsrc_fixate_srccaps(thetauvcsrc);
+    if (thetauvcsrc->max_size_buffers > 0
+	&& buffers >= thetauvcsrc->max_size_buffers)
+	return TRUE;
 
-    uvc_start_streaming(thetauvcsrc->devh, &thetauvcsrc->ctrl, cb,
-	thetauvcsrc, 0);
-    thetauvcsrc->framecount = 0;
+    bytes = gst_thetauvc_queue_level_bytes(q);
+    if (thetauvcsrc->max_size_bytes > 0
+	&& bytes + gst_buffer_get_size(buffer) > thetauvcsrc->max_size_bytes)
+	return TRUE;
 
-    return TRUE;
+    time = gst_thetauvc_queue_level_time(q);
+    if (GST_BUFFER_DURATION_IS_VALID(buffer))
+	time += GST_BUFFER_DURATION(buffer);
+    if (thetauvcsrc->max_size_time > 0 && time > thetauvcsrc->max_size_time)
+	return TRUE;
+
+    return FALSE;
 }
 
+/*
+ * Make room for a new frame according to the overflow policy, dropping
+ * only at points the decoder can resume from.  Returns FALSE if the new
+ * frame has to be dropped as well.
+ */
 static  gboolean
-gst_thetauvcsrc_stop(GstBaseSrc * src)
+thetauvcsrc_make_room(GstThetauvcsrc * thetauvcsrc, GstBuffer * buffer,
+    gboolean key)
 {
-    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+    GstThetauvcQueue *q = thetauvcsrc->queue;
+    gint64  deadline, now, timeout;
+    guint   head;
+
+    if (!thetauvcsrc_queue_overflow(thetauvcsrc, buffer))
+	return TRUE;
+
+    switch (thetauvcsrc->overflow_policy) {
+    case GST_THETAUVC_OVERFLOW_BLOCK:
+	/*
+	 * Longer than a frame interval the isochronous transfers of the
+	 * next frame are not handled and USB data is lost.
+	 */
+	timeout = thetauvcsrc->ctrl.dwFrameInterval > 0 ?
+	    thetauvcsrc->ctrl.dwFrameInterval / 10 : THETAUVCSRC_BLOCK_TIMEOUT;
+	deadline = g_get_monotonic_time() + timeout;
+	while (1) {
+	    head = gst_thetauvc_queue_head_index(q);
+	    if (!thetauvcsrc_queue_overflow(thetauvcsrc, buffer))
+		break;
+	    now = g_get_monotonic_time();
+	    if (now >= deadline || gst_thetauvc_queue_is_flushing(q))
+		break;
+	    gst_thetauvc_queue_wait_space(q, head, deadline - now);
+	}
+	if (!thetauvcsrc_queue_overflow(thetauvcsrc, buffer))
+	    return TRUE;
+	if (!gst_thetauvc_queue_is_flushing(q))
+	    GST_WARNING_OBJECT(thetauvcsrc,
+		"queue blocked for a frame interval, skipping to next IDR");
+	/* FALLTHROUGH */
+    case GST_THETAUVC_OVERFLOW_DROP_TO_NEXT_IDR:
+	thetauvcsrc->skip_to_idr = TRUE;
+	return FALSE;
 
-    GST_DEBUG_OBJECT(thetauvcsrc, "stop");
+    case GST_THETAUVC_OVERFLOW_NEWEST_ONLY:
+	if (key) {
+	    while (gst_thetauvc_queue_drop_head(q));
+	    return TRUE;
+	}
+	/* keep the GOP of the latest key frame only */
+	while ((gint) (gst_thetauvc_queue_head_index(q) -
+		thetauvcsrc->last_key_index) < 0
+	    && gst_thetauvc_queue_drop_head(q));
+	break;
 
-    uvc_stop_streaming(thetauvcsrc->devh);
+    case GST_THETAUVC_OVERFLOW_DROP_OLDEST_GOP:
+    default:
+	while (thetauvcsrc_queue_overflow(thetauvcsrc, buffer)) {
+	    gst_thetauvc_queue_drop_head(q);
+	    while (gst_thetauvc_queue_length(q) > 0
+		&& !gst_thetauvc_queue_head_is_key(q))
+		gst_thetauvc_queue_drop_head(q);
+	}
+	break;
+    }
+
+    if (thetauvcsrc_queue_overflow(thetauvcsrc, buffer)) {
+	while (gst_thetauvc_queue_drop_head(q));
+	thetauvcsrc->skip_to_idr = TRUE;
+	return FALSE;
+    }
+    if (gst_thetauvc_queue_length(q) == 0 && !key) {
+	/* the GOP of this frame is gone */
+	thetauvcsrc->skip_to_idr = TRUE;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Start the counters over, cb() must not be running */
+static void
+thetauvcsrc_stats_reset(GstThetauvcsrc * thetauvcsrc)
+{
+    GstThetauvcsrcStats *st = &thetauvcsrc->stats;
+
+    atomic_store(&st->received, 0);
+    atomic_store(&st->received_bytes, 0);
+    atomic_store(&st->max_size, 0);
+    atomic_store(&st->gaps, 0);
+    atomic_store(&st->lost, 0);
+    atomic_store(&st->high_water, 0);
+    atomic_store(&st->late, 0);
+    st->sequence_valid = FALSE;
+    atomic_store(&st->pushed, 0);
+    atomic_store(&st->latency_sum, 0);
+    atomic_store(&st->latency_max, 0);
+    atomic_store(&st->restarts, 0);
+    atomic_store(&st->resets, 0);
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    st->dropped_base = atomic_load(&thetauvcsrc->queue->dropped);
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    st->start = st->last_time = g_get_monotonic_time();
+    st->last_bytes = 0;
+}
+
+/* Count a frame from the device, runs on the libuvc thread */
+static void
+thetauvcsrc_stats_frame(GstThetauvcsrc * thetauvcsrc, uvc_frame_t * frame,
+    GstClockTime arrival)
+{
+    GstThetauvcsrcStats *st = &thetauvcsrc->stats;
+    GstClockTime period;
+    guint32 missing;
+
+    atomic_fetch_add_explicit(&st->received, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->received_bytes, frame->data_bytes,
+	memory_order_relaxed);
+    if (frame->data_bytes > atomic_load_explicit(&st->max_size,
+	    memory_order_relaxed))
+	atomic_store_explicit(&st->max_size, frame->data_bytes,
+	    memory_order_relaxed);
+
+    /* a jump backwards is a restarted stream, not a loss */
+    missing = frame->sequence - st->next_sequence;
+    if (st->sequence_valid && missing > 0 && missing < G_MAXINT32) {
+	atomic_fetch_add_explicit(&st->gaps, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&st->lost, missing, memory_order_relaxed);
+    }
+
+    /* late: more than one and a half frame intervals after the previous */
+    period = thetauvcsrc->ctrl.dwFrameInterval * 100;
+    if (thetauvcsrc->replay != NULL)
+	period = thetauvcsrc->replay_speed > 0 ?
+	    (GstClockTime) (period / thetauvcsrc->replay_speed) : 0;
+    if (st->sequence_valid && period > 0
+	&& arrival - st->last_arrival > period * 3 / 2)
+	atomic_fetch_add_explicit(&st->late, 1, memory_order_relaxed);
+    st->last_arrival = arrival;
+
+    st->sequence_valid = TRUE;
+    st->next_sequence = frame->sequence + 1;
+}
+
+/* Count a frame handed downstream, runs in create() */
+static void
+thetauvcsrc_stats_push(GstThetauvcsrc * thetauvcsrc, GstBuffer * buf)
+{
+    GstThetauvcsrcStats *st = &thetauvcsrc->stats;
+    GstReferenceTimestampMeta *meta;
+    GstClockTime now, latency;
+
+    atomic_fetch_add_explicit(&st->pushed, 1, memory_order_relaxed);
+
+    meta = gst_buffer_get_reference_timestamp_meta(buf, capture_caps);
+    if (meta == NULL)
+	return;
+    now = g_get_monotonic_time() * GST_USECOND;
+    latency = now > meta->timestamp ? now - meta->timestamp : 0;
+    atomic_fetch_add_explicit(&st->latency_sum, latency,
+	memory_order_relaxed);
+    if (latency > atomic_load_explicit(&st->latency_max,
+	    memory_order_relaxed))
+	atomic_store_explicit(&st->latency_max, latency,
+	    memory_order_relaxed);
+}
+
+/*
+ * The statistics as a structure.  Counters are totals since the start,
+ * bytes-per-second is the rate after the given time and byte count.
+ */
+static GstStructure *
+thetauvcsrc_stats_new(GstThetauvcsrc * thetauvcsrc, gint64 since,
+    guint64 since_bytes)
+{
+    GstThetauvcsrcStats *st = &thetauvcsrc->stats;
+    guint64 received, bytes, pushed, dropped;
+    gint64  elapsed;
+
+    received = atomic_load(&st->received);
+    bytes = atomic_load(&st->received_bytes);
+    pushed = atomic_load(&st->pushed);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    dropped = atomic_load(&thetauvcsrc->queue->dropped) - st->dropped_base;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    elapsed = g_get_monotonic_time() - since;
+
+    return gst_structure_new("thetauvcsrc-stats",
+	"frames-received", G_TYPE_UINT64, received,
+	"frames-pushed", G_TYPE_UINT64, pushed,
+	"frames-dropped", G_TYPE_UINT64, dropped,
+	"sequence-gaps", G_TYPE_UINT64, (guint64) atomic_load(&st->gaps),
+	"frames-lost", G_TYPE_UINT64, (guint64) atomic_load(&st->lost),
+	"queue-high-water", G_TYPE_UINT, (guint) atomic_load(&st->high_water),
+	"late-callbacks", G_TYPE_UINT64, (guint64) atomic_load(&st->late),
+	"bytes-per-second", G_TYPE_UINT64, elapsed > 0 ?
+	(guint64) ((bytes - since_bytes) * G_USEC_PER_SEC / elapsed) : 0,
+	"mean-frame-size", G_TYPE_UINT64, received ? bytes / received : 0,
+	"max-frame-size", G_TYPE_UINT64, (guint64) atomic_load(&st->max_size),
+	"mean-latency", G_TYPE_UINT64,
+	pushed ? (guint64) atomic_load(&st->latency_sum) / pushed : 0,
+	"max-latency", G_TYPE_UINT64, (guint64) atomic_load(&st->latency_max),
+	"watchdog-restarts", G_TYPE_UINT, (guint) atomic_load(&st->restarts),
+	"watchdog-resets", G_TYPE_UINT, (guint) atomic_load(&st->resets),
+	NULL);
+}
+
+static  gboolean
+thetauvcsrc_stats_tick(GstClock * clock, GstClockTime time, GstClockID id,
+    gpointer user_data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(user_data);
+    GstThetauvcsrcStats *st = &thetauvcsrc->stats;
+    GstStructure *s;
+    gint64  now;
+    guint64 bytes;
+
+    now = g_get_monotonic_time();
+    bytes = atomic_load(&st->received_bytes);
+    s = thetauvcsrc_stats_new(thetauvcsrc, st->last_time, st->last_bytes);
+    st->last_time = now;
+    st->last_bytes = bytes;
+
+    gst_element_post_message(GST_ELEMENT_CAST(thetauvcsrc),
+	gst_message_new_element(GST_OBJECT_CAST(thetauvcsrc), s));
+
+    return TRUE;
+}
+
+/* Post the statistics every stats-interval on the system clock thread */
+static void
+thetauvcsrc_stats_start(GstThetauvcsrc * thetauvcsrc)
+{
+    GstClock *clock;
+    GstClockTime interval;
+
+    if (thetauvcsrc->stats_interval == 0 || thetauvcsrc->stats.tick != NULL)
+	return;
+
+    interval = thetauvcsrc->stats_interval * GST_MSECOND;
+    clock = gst_system_clock_obtain();
+    thetauvcsrc->stats.tick = gst_clock_new_periodic_id(clock,
+	gst_clock_get_time(clock) + interval, interval);
+    gst_clock_id_wait_async(thetauvcsrc->stats.tick, thetauvcsrc_stats_tick,
+	gst_object_ref(thetauvcsrc), gst_object_unref);
+    gst_object_unref(clock);
+}
+
+static void
+thetauvcsrc_stats_stop(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->stats.tick == NULL)
+	return;
+
+    gst_clock_id_unschedule(thetauvcsrc->stats.tick);
+    gst_clock_id_unref(thetauvcsrc->stats.tick);
+    thetauvcsrc->stats.tick = NULL;
+}
+
+static void
+thetauvcsrc_enqueue(GstThetauvcsrc * thetauvcsrc, GstBuffer * buffer)
+{
+    gboolean key;
+    guint   length;
+
+    key = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+    if (thetauvcsrc->skip_to_idr && !key)
+	goto drop;
+    thetauvcsrc->skip_to_idr = FALSE;
+
+    if (!thetauvcsrc_make_room(thetauvcsrc, buffer, key))
+	goto drop;
+
+    if (thetauvcsrc->need_discont) {
+	GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+	thetauvcsrc->need_discont = FALSE;
+    }
+    if (key)
+	thetauvcsrc->last_key_index =
+	    gst_thetauvc_queue_tail_index(thetauvcsrc->queue);
+
+    gst_thetauvc_queue_push(thetauvcsrc->queue, buffer,
+	key ? GST_THETAUVC_QUEUE_FLAG_KEY : 0);
+    length = gst_thetauvc_queue_length(thetauvcsrc->queue);
+    if (length > atomic_load_explicit(&thetauvcsrc->stats.high_water,
+	    memory_order_relaxed))
+	atomic_store_explicit(&thetauvcsrc->stats.high_water, length,
+	    memory_order_relaxed);
+    return;
+
+  drop:
+    GST_LOG_OBJECT(thetauvcsrc, "dropping frame %" G_GUINT64_FORMAT,
+	GST_BUFFER_OFFSET(buffer));
+    gst_thetauvc_queue_count_drop(thetauvcsrc->queue);
+    thetauvcsrc->need_discont = TRUE;
+    gst_buffer_unref(buffer);
+}
+
+/* Replace a cached parameter set if it changed */
+static  gboolean
+thetauvcsrc_update_nal(GBytes ** cache, const guint8 * data, gsize size)
+{
+    gsize   len;
+    gconstpointer old;
+
+    if (*cache != NULL) {
+	old = g_bytes_get_data(*cache, &len);
+	if (len == size && memcmp(old, data, size) == 0)
+	    return FALSE;
+	g_bytes_unref(*cache);
+    }
+    *cache = g_bytes_new(data, size);
+
+    return TRUE;
+}
+
+/*
+ * Cache the SPS/PPS of the frame.  On change, the pair is handed over to
+ * create() as one byte-stream buffer, runs on the libuvc thread.
+ */
+static void
+thetauvcsrc_cache_headers(GstThetauvcsrc * thetauvcsrc, const guint8 * data,
+    const thetauvc_h264_info_t * info)
+{
+    static const guint8 start_code[] = { 0, 0, 0, 1 };
+    gboolean changed;
+    GstBuffer *headers, *old;
+    GstMapInfo map;
+    gconstpointer sps, pps;
+    gsize   sps_size, pps_size;
+
+    changed = FALSE;
+    if ((info->flags & THETAUVC_H264_FLAG_SPS) && info->sps_size > 0)
+	changed |= thetauvcsrc_update_nal(&thetauvcsrc->cb_sps,
+	    data + info->sps_offset, info->sps_size);
+    if ((info->flags & THETAUVC_H264_FLAG_PPS) && info->pps_size > 0)
+	changed |= thetauvcsrc_update_nal(&thetauvcsrc->cb_pps,
+	    data + info->pps_offset, info->pps_size);
+
+    if (!changed || thetauvcsrc->cb_sps == NULL || thetauvcsrc->cb_pps == NULL)
+	return;
+
+    sps = g_bytes_get_data(thetauvcsrc->cb_sps, &sps_size);
+    pps = g_bytes_get_data(thetauvcsrc->cb_pps, &pps_size);
+
+    headers = gst_buffer_new_allocate(NULL,
+	sizeof(start_code) * 2 + sps_size + pps_size, NULL);
+    gst_buffer_map(headers, &map, GST_MAP_WRITE);
+    memcpy(map.data, start_code, sizeof(start_code));
+    memcpy(map.data + sizeof(start_code), sps, sps_size);
+    memcpy(map.data + sizeof(start_code) + sps_size, start_code,
+	sizeof(start_code));
+    memcpy(map.data + sizeof(start_code) * 2 + sps_size, pps, pps_size);
+    gst_buffer_unmap(headers, &map);
+    GST_BUFFER_FLAG_SET(headers, GST_BUFFER_FLAG_HEADER);
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "new SPS/PPS (%" G_GSIZE_FORMAT "/%"
+	G_GSIZE_FORMAT " bytes)", sps_size, pps_size);
+
+    old = g_atomic_pointer_exchange(&thetauvcsrc->pending_headers, headers);
+    if (old != NULL)
+	gst_buffer_unref(old);
+}
+
+/* Apply callback-thread-policy and cpu-affinity to the calling thread */
+static void
+thetauvcsrc_apply_sched(GstThetauvcsrc * thetauvcsrc, const gchar * name)
+{
+    gint    ret;
+
+    if (!gst_thetauvc_thread_sched_is_set(&thetauvcsrc->sched))
+	return;
+
+    if ((ret = gst_thetauvc_thread_sched_apply(&thetauvcsrc->sched)) != 0)
+	GST_WARNING_OBJECT(thetauvcsrc, "could not set scheduling of the %s "
+	    "thread: %s", name, g_strerror(ret));
+    else
+	GST_DEBUG_OBJECT(thetauvcsrc, "scheduling of the %s thread set", name);
+}
+
+void
+cb(uvc_frame_t * frame, void *ptr)
+{
+    GstThetauvcsrc *thetauvcsrc;
+    GstBuffer *buffer;
+    GstClockTime capture;
+    guint64 interval;
+    unsigned int nal_flags;
+    thetauvc_h264_info_t info;
+
+    capture = g_get_monotonic_time() * GST_USECOND;
+    thetauvcsrc = (GstThetauvcsrc *) ptr;
+
+    /* the replay backend is out of frames */
+    if (frame == NULL) {
+	g_atomic_int_set(&thetauvcsrc->replay_eos, 1);
+	gst_thetauvc_queue_interrupt(thetauvcsrc->queue);
+	return;
+    }
+
+    /* first frame on a new libuvc thread */
+    if (!thetauvcsrc->cb_sched) {
+	thetauvcsrc->cb_sched = TRUE;
+	thetauvcsrc_apply_sched(thetauvcsrc, "callback");
+    }
+
+    if (thetauvcsrc->recorder != NULL
+	&& thetauvc_recorder_write(thetauvcsrc->recorder, frame,
+	    capture) != UVC_SUCCESS) {
+	GST_WARNING_OBJECT(thetauvcsrc, "could not write %s, recording stopped",
+	    thetauvcsrc->record_location);
+	thetauvc_recorder_close(thetauvcsrc->recorder);
+	thetauvcsrc->recorder = NULL;
+    }
+    thetauvcsrc_stats_frame(thetauvcsrc, frame, capture);
+
+    nal_flags = thetauvc_h264_scan(frame->data, frame->data_bytes, &info);
+    if (nal_flags & (THETAUVC_H264_FLAG_SPS | THETAUVC_H264_FLAG_PPS))
+	thetauvcsrc_cache_headers(thetauvcsrc, frame->data, &info);
+
+    if (thetauvcsrc->zero_copy && frame->library_owns_data
+	&& frame->data_bytes > 0) {
+	buffer = gst_buffer_new();
+	gst_buffer_append_memory(buffer,
+	    gst_thetauvc_allocator_take_frame(thetauvcsrc->allocator, frame));
+    } else {
+	buffer = thetauvcsrc_copy_frame(thetauvcsrc, frame);
+    }
+
+    /* Provisional timestamp, create() replaces it with the running time
+     * derived from the capture time once a clock is available. */
+    interval = thetauvcsrc->ctrl.dwFrameInterval * 100;
+    GST_BUFFER_PTS(buffer) = thetauvcsrc->framecount * interval;
+    GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+    GST_BUFFER_DURATION(buffer) = interval;
+    GST_BUFFER_OFFSET(buffer) = frame->sequence;
+    gst_buffer_add_reference_timestamp_meta(buffer, capture_caps, capture,
+	GST_CLOCK_TIME_NONE);
+    /* every UVC frame is one access unit */
+    if (!(nal_flags & THETAUVC_H264_FLAG_IDR))
+	GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    if (nal_flags & (THETAUVC_H264_FLAG_SPS | THETAUVC_H264_FLAG_PPS))
+	GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_HEADER);
+
+    thetauvcsrc->framecount++;
+    thetauvcsrc_enqueue(thetauvcsrc, buffer);
+
+    return;
+}
+
+/* Device handle or frame log driven by the backend */
+static  gpointer
+thetauvcsrc_backend_handle(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->replay != NULL)
+	return thetauvcsrc->replay;
+
+    return thetauvcsrc->devh;
+}
+
+/* Program the camera encoder from the properties on the open device */
+static void
+thetauvcsrc_set_encoder(GstThetauvcsrc * thetauvcsrc, gboolean gop_only)
+{
+    thetauvc_encoder_t enc = { 0 };
+    uvc_error_t res;
+
+    if (thetauvcsrc->backend->set_encoder == NULL)
+	return;
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    if (!gop_only) {
+	enc.bitrate = thetauvcsrc->bitrate * 1000;
+	enc.max_bitrate = thetauvcsrc->max_bitrate * 1000;
+	enc.qp = thetauvcsrc->qp;
+    }
+    enc.gop_length = thetauvcsrc->gop_length;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    enc.frame_interval = thetauvcsrc->ctrl.dwFrameInterval;
+
+    if (enc.bitrate == 0 && enc.max_bitrate == 0 && enc.qp == 0
+	&& enc.gop_length == 0)
+	return;
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "encoder: bitrate %u, max-bitrate %u, "
+	"gop-length %u, qp %u", enc.bitrate, enc.max_bitrate, enc.gop_length,
+	enc.qp);
+    res = thetauvcsrc->backend->set_encoder(
+	thetauvcsrc_backend_handle(thetauvcsrc), &enc);
+    if (res == UVC_ERROR_NOT_SUPPORTED)
+	GST_INFO_OBJECT(thetauvcsrc, "no encoding unit, encoder not set");
+    else if (res != UVC_SUCCESS)
+	GST_WARNING_OBJECT(thetauvcsrc, "could not set the encoder: %s",
+	    uvc_strerror(res));
+}
+
+/* Apply changed encoder properties while streaming */
+static void
+thetauvcsrc_update_encoder(GstThetauvcsrc * thetauvcsrc)
+{
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    if (thetauvcsrc_backend_handle(thetauvcsrc) != NULL
+	&& !g_atomic_int_get(&thetauvcsrc->device_lost)
+	&& !thetauvcsrc->watchdog_resetting)
+	thetauvcsrc_set_encoder(thetauvcsrc, FALSE);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+}
+
+/* Start the frames, with the encoder programmed for every (re)start */
+static  uvc_error_t
+thetauvcsrc_start_streaming(GstThetauvcsrc * thetauvcsrc)
+{
+    uvc_error_t res;
+
+    /* libuvc starts a new callback thread */
+    thetauvcsrc->cb_sched = FALSE;
+    res = thetauvcsrc->backend->start_streaming(
+	thetauvcsrc_backend_handle(thetauvcsrc), &thetauvcsrc->ctrl, cb,
+	thetauvcsrc);
+    if (res == UVC_SUCCESS)
+	thetauvcsrc_set_encoder(thetauvcsrc, FALSE);
+
+    return res;
+}
+
+static void
+thetauvcsrc_stop_streaming(GstThetauvcsrc * thetauvcsrc)
+{
+    thetauvcsrc->backend->stop_streaming(
+	thetauvcsrc_backend_handle(thetauvcsrc));
+}
+
+/* Record the frames for replay-location, cb() must not be running */
+static void
+thetauvcsrc_open_recorder(GstThetauvcsrc * thetauvcsrc)
+{
+    uvc_error_t res;
+
+    if (thetauvcsrc->record_location == NULL || thetauvcsrc->recorder != NULL)
+	return;
+
+    res = thetauvc_recorder_open(thetauvcsrc->record_location,
+	thetauvcsrc->dev_pid, &thetauvcsrc->mode_val,
+	thetauvcsrc->ctrl.dwFrameInterval, &thetauvcsrc->recorder);
+    if (res != UVC_SUCCESS) {
+	thetauvcsrc->recorder = NULL;
+	GST_ELEMENT_WARNING(thetauvcsrc, RESOURCE, OPEN_WRITE,
+	    ("Could not open %s for recording.", thetauvcsrc->record_location),
+	    ("%s", uvc_strerror(res)));
+    }
+}
+
+/* Frame rate of a UVC frame interval (100ns units) */
+static void
+thetauvcsrc_interval_to_fps(uint32_t interval, gint * num, gint * den)
+{
+    *den = 1001;
+    switch (interval) {
+    case 417083:					/* 23.98fps */
+	*num = 24000;
+	break;
+    case 333667:					/* 29.97fps */
+	*num = 30000;
+	break;
+    case 166833:					/* 59.94fps */
+	*num = 60000;
+	break;
+    default: 						/* integer framerate */
+	*num = 10000000 / interval;
+	*den = 1;
+	break;
+    }
+}
+
+static const gchar *
+thetauvcsrc_profile(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC)
+	return "high";
+
+    return "constrained-baseline";
+}
+
+static GstCaps *
+thetauvcsrc_fixate_srccaps(GstThetauvcsrc *thetauvcsrc)
+{
+    GstCaps *caps;
+    caps = gst_caps_from_string(GST_THETAUVCSRC_CAPS_BASE);
+    gst_caps_set_simple(caps, "width", G_TYPE_INT, thetauvcsrc->mode_val.width,
+	"height", G_TYPE_INT, thetauvcsrc->mode_val.height,
+	"profile", G_TYPE_STRING, thetauvcsrc_profile(thetauvcsrc), NULL);
+
+    gint    den, num;
+    thetauvcsrc_interval_to_fps(thetauvcsrc->ctrl.dwFrameInterval, &num,
+	&den);
+    gst_caps_set_simple(caps, "framerate", GST_TYPE_FRACTION, num, den, NULL);
+
+    return caps;
+}
+
+/* Caps of the H.264 frame sizes and intervals the device describes */
+static GstCaps *
+thetauvcsrc_device_caps(GstThetauvcsrc * thetauvcsrc)
+{
+    const uvc_format_desc_t *format;
+    const uvc_frame_desc_t *frame;
+    const uint32_t *interval;
+    GstStructure *s;
+    GstCaps *caps;
+    GValue  rates = G_VALUE_INIT, rate = G_VALUE_INIT;
+    gint    num, den, max_num, max_den;
+
+    caps = gst_caps_new_empty();
+    format = uvc_get_format_descs(thetauvcsrc->devh);
+    for (; format != NULL; format = format->next) {
+	if (memcmp(format->fourccFormat, "H264", 4) != 0)
+	    continue;
+
+	for (frame = format->frame_descs; frame != NULL; frame = frame->next) {
+	    s = gst_structure_new("video/x-h264",
+		"width", G_TYPE_INT, frame->wWidth,
+		"height", G_TYPE_INT, frame->wHeight,
+		"stream-format", G_TYPE_STRING, "byte-stream",
+		"alignment", G_TYPE_STRING, "au",
+		"profile", G_TYPE_STRING, thetauvcsrc_profile(thetauvcsrc),
+		NULL);
+
+	    if (frame->intervals != NULL) {
+		g_value_init(&rates, GST_TYPE_LIST);
+		g_value_init(&rate, GST_TYPE_FRACTION);
+		for (interval = frame->intervals; *interval != 0; interval++) {
+		    thetauvcsrc_interval_to_fps(*interval, &num, &den);
+		    gst_value_set_fraction(&rate, num, den);
+		    gst_value_list_append_value(&rates, &rate);
+		}
+		g_value_unset(&rate);
+	    } else if (frame->dwMinFrameInterval < frame->dwMaxFrameInterval) {
+		/* the shortest interval is the highest rate */
+		g_value_init(&rates, GST_TYPE_FRACTION_RANGE);
+		thetauvcsrc_interval_to_fps(frame->dwMaxFrameInterval, &num,
+		    &den);
+		thetauvcsrc_interval_to_fps(frame->dwMinFrameInterval,
+		    &max_num, &max_den);
+		gst_value_set_fraction_range_full(&rates, num, den, max_num,
+		    max_den);
+	    } else {
+		g_value_init(&rates, GST_TYPE_FRACTION);
+		thetauvcsrc_interval_to_fps(frame->dwMinFrameInterval, &num,
+		    &den);
+		gst_value_set_fraction(&rates, num, den);
+	    }
+
+	    if (!GST_VALUE_HOLDS_LIST(&rates))
+		gst_structure_set_value(s, "framerate", &rates);
+	    else if (gst_value_list_get_size(&rates) == 1)
+		gst_structure_set_value(s, "framerate",
+		    gst_value_list_get_value(&rates, 0));
+	    else if (gst_value_list_get_size(&rates) > 1)
+		gst_structure_set_value(s, "framerate", &rates);
+	    g_value_unset(&rates);
+
+	    gst_caps_append_structure(caps, s);
+	}
+    }
+
+    return caps;
+}
+
+/*
+ * Choose the frame size and rate among the device caps that downstream
+ * accepts.  Left open, the size follows the mode property and the rate
+ * is the highest.  fps is 0 if the device did not describe any.
+ */
+static  gboolean
+thetauvcsrc_choose_format(GstThetauvcsrc * thetauvcsrc, GstCaps * devcaps,
+    thetauvc_mode_t * fmt)
+{
+    const thetauvc_mode_t *m;
+    GstStructure *s, *pref;
+    GstCaps *peercaps, *caps;
+    guint   i, n;
+    gint    width, height, num, den;
+
+    switch (thetauvcsrc->mode) {
+    case GST_THETAUVC_MODE_4K:
+	m = thetauvc_get_mode(THETAUVC_MODE_UHD);
+	break;
+    case GST_THETAUVC_MODE_2K:
+    default:
+	if (thetauvcsrc->dev_pid == USBPID_THETAS_UVC)
+	    m = thetauvc_get_mode(THETAUVC_MODE_FHD_S);
+	else
+	    m = thetauvc_get_mode(THETAUVC_MODE_FHD);
+	break;
+    }
+
+    /* old firmware without usable descriptors, stick to the mode table */
+    if (devcaps == NULL || gst_caps_is_empty(devcaps)) {
+	*fmt = *m;
+	return TRUE;
+    }
+
+    peercaps = gst_pad_peer_query_caps(GST_BASE_SRC_PAD(thetauvcsrc),
+	devcaps);
+    caps = gst_caps_intersect_full(peercaps, devcaps,
+	GST_CAPS_INTERSECT_FIRST);
+    gst_caps_unref(peercaps);
+    GST_DEBUG_OBJECT(thetauvcsrc, "possible caps %" GST_PTR_FORMAT, caps);
+
+    if (gst_caps_is_empty(caps)) {
+	gst_caps_unref(caps);
+	return FALSE;
+    }
+
+    pref = gst_structure_new("video/x-h264",
+	"width", G_TYPE_INT, m->width, "height", G_TYPE_INT, m->height, NULL);
+    n = gst_caps_get_size(caps);
+    for (i = 0; i < n; i++) {
+	if (gst_structure_can_intersect(gst_caps_get_structure(caps, i),
+		pref))
+	    break;
+    }
+    gst_structure_free(pref);
+
+    s = gst_structure_copy(gst_caps_get_structure(caps, i < n ? i : 0));
+    gst_caps_unref(caps);
+    gst_structure_fixate_field_nearest_int(s, "width", m->width);
+    gst_structure_fixate_field_nearest_int(s, "height", m->height);
+    gst_structure_fixate_field_nearest_fraction(s, "framerate", G_MAXINT, 1);
+    gst_structure_get_int(s, "width", &width);
+    gst_structure_get_int(s, "height", &height);
+    num = 0;
+    den = 1;
+    gst_structure_get_fraction(s, "framerate", &num, &den);
+    gst_structure_free(s);
+
+    fmt->mode = (width == m->width && height == m->height)
+	? m->mode : THETAUVC_MODE_NUM;
+    fmt->width = width;
+    fmt->height = height;
+    /* libuvc matches intervals by integer frame rate */
+    fmt->fps = num / den;
+
+    return TRUE;
+}
+
+/* Probe the stream control of a chosen format and make it current */
+static  uvc_error_t
+thetauvcsrc_select_format(GstThetauvcsrc * thetauvcsrc,
+    const thetauvc_mode_t * fmt)
+{
+    uvc_error_t res;
+
+    res = uvc_get_stream_ctrl_format_size(thetauvcsrc->devh,
+	&thetauvcsrc->ctrl, UVC_FRAME_FORMAT_H264, fmt->width, fmt->height,
+	fmt->fps);
+    if (res == UVC_SUCCESS)
+	thetauvcsrc->mode_val = *fmt;
+
+    return res;
+}
+
+/*
+ * Size the ring for max-size-buffers.  Without a buffer limit the ring
+ * gets the largest size and the byte/time limits do the work.
+ */
+static void
+thetauvcsrc_setup_queue(GstThetauvcsrc * thetauvcsrc)
+{
+    GstThetauvcQueue *queue, *old;
+    guint   size;
+
+    if (thetauvcsrc->max_size_buffers > 0)
+	size = MAX(thetauvcsrc->max_size_buffers + 1, THETAUVCSRC_QUEUE_SIZE);
+    else
+	size = THETAUVCSRC_QUEUE_MAX_SIZE;
+
+    if (gst_thetauvc_queue_capacity(thetauvcsrc->queue) >= size) {
+	gst_thetauvc_queue_flush(thetauvcsrc->queue);
+	return;
+    }
+
+    queue = gst_thetauvc_queue_new(size);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    old = thetauvcsrc->queue;
+    thetauvcsrc->queue = queue;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    gst_thetauvc_queue_free(old);
+}
+
+/* Device cache watch, runs on the cache thread */
+static void
+thetauvcsrc_devices_watch(const GstThetauvcDeviceInfo * info, gboolean added,
+    gpointer user_data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(user_data);
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    if (!added) {
+	/* a device reset by the watchdog leaves and comes back */
+	if (!g_atomic_int_get(&thetauvcsrc->device_lost)
+	    && !thetauvcsrc->watchdog_resetting
+	    && info->bus == thetauvcsrc->dev_bus
+	    && info->address == thetauvcsrc->dev_addr) {
+	    GST_INFO_OBJECT(thetauvcsrc, "device %03u:%03u left",
+		thetauvcsrc->dev_bus, thetauvcsrc->dev_addr);
+	    g_atomic_int_set(&thetauvcsrc->device_lost, 1);
+	    /* wake create() to start the gap events */
+	    gst_thetauvc_queue_interrupt(thetauvcsrc->queue);
+	}
+    } else if (g_strcmp0(info->serial, thetauvcsrc->serial) == 0) {
+	thetauvcsrc->device_arrived = TRUE;
+    }
+    g_cond_signal(&thetauvcsrc->reconnect_cond);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+}
+
+/* Open the libuvc device at the bus address of a cached THETA */
+static  uvc_error_t
+thetauvcsrc_open_info(GstThetauvcsrc * thetauvcsrc, uvc_device_t ** list,
+    const GstThetauvcDeviceInfo * info)
+{
+    uvc_device_t *dev;
+    uvc_error_t res;
+    int     i;
+
+    dev = NULL;
+    for (i = 0; list[i] != NULL; i++) {
+	if (uvc_get_bus_number(list[i]) == info->bus
+	    && uvc_get_device_address(list[i]) == info->address) {
+	    dev = list[i];
+	    break;
+	}
+    }
+    if (dev == NULL)
+	return UVC_ERROR_NO_DEVICE;
+
+    res = uvc_open(dev, &thetauvcsrc->devh);
+    if (res != UVC_SUCCESS) {
+	thetauvcsrc->devh = NULL;
+	return res;
+    }
+
+    uvc_ref_device(dev);
+    thetauvcsrc->dev = dev;
+    thetauvcsrc->dev_pid = info->pid;
+    thetauvcsrc->dev_bus = info->bus;
+    thetauvcsrc->dev_addr = info->address;
+    if (thetauvcsrc->serial == NULL)
+	thetauvcsrc->serial = g_strdup(info->serial);
+
+    return UVC_SUCCESS;
+}
+
+/* THETA S streams in its second configuration */
+static  gboolean
+thetauvcsrc_setup_configuration(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->dev_pid != USBPID_THETAS_UVC)
+	return TRUE;
+
+    uvc_close(thetauvcsrc->devh);
+    thetauvcsrc->devh = NULL;
+
+    thetauvc_switch_configuration(thetauvcsrc->context->usb_ctx,
+	thetauvcsrc->dev_bus, thetauvcsrc->dev_addr, 2);
+
+    if (uvc_open(thetauvcsrc->dev, &thetauvcsrc->devh) != UVC_SUCCESS) {
+	thetauvcsrc->devh = NULL;
+	return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Open the THETA with our serial and restart streaming with the same ctrl */
+static  gboolean
+thetauvcsrc_reopen(GstThetauvcsrc * thetauvcsrc)
+{
+    GstThetauvcDeviceInfo *info;
+    uvc_device_t **list;
+    uvc_error_t res;
+
+    if ((info = gst_thetauvc_devices_lookup(thetauvcsrc->serial, -1)) == NULL)
+	return FALSE;
+
+    res = uvc_get_device_list(thetauvcsrc->ctx, &list);
+    if (res == UVC_SUCCESS) {
+	res = thetauvcsrc_open_info(thetauvcsrc, list, info);
+	uvc_free_device_list(list, 1);
+    }
+    gst_thetauvc_device_info_free(info);
+    if (res != UVC_SUCCESS)
+	return FALSE;
+
+    if (!thetauvcsrc_setup_configuration(thetauvcsrc))
+	goto fail;
+
+    /* cb() is not running, its state can be touched */
+    thetauvcsrc->need_discont = TRUE;
+    thetauvcsrc->skip_to_idr = TRUE;
+    thetauvcsrc->stats.sequence_valid = FALSE;
+    res = thetauvcsrc_start_streaming(thetauvcsrc);
+    if (res != UVC_SUCCESS) {
+	GST_DEBUG_OBJECT(thetauvcsrc, "could not restart streaming: %s",
+	    uvc_strerror(res));
+	goto fail;
+    }
+
+    return TRUE;
+
+  fail:
+    if (thetauvcsrc->devh != NULL)
+	uvc_close(thetauvcsrc->devh);
+    uvc_unref_device(thetauvcsrc->dev);
+    thetauvcsrc->devh = NULL;
+    thetauvcsrc->dev = NULL;
+    return FALSE;
+}
+
+/*
+ * Tear down a lost device and reopen it once a THETA with the same serial
+ * shows up again.  Arrivals are also polled in case a notification was
+ * missed while the device was being reopened.
+ */
+static  gpointer
+thetauvcsrc_reconnect_thread(gpointer data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(data);
+    uvc_device_handle_t *devh;
+    uvc_device_t *dev;
+    gboolean ok;
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    while (!thetauvcsrc->reconnect_stop) {
+	if (!g_atomic_int_get(&thetauvcsrc->device_lost)
+	    || thetauvcsrc->watchdog_resetting) {
+	    g_cond_wait(&thetauvcsrc->reconnect_cond,
+		&thetauvcsrc->reconnect_lock);
+	    continue;
+	}
+
+	if (thetauvcsrc->devh != NULL) {
+	    devh = thetauvcsrc->devh;
+	    dev = thetauvcsrc->dev;
+	    thetauvcsrc->devh = NULL;
+	    thetauvcsrc->dev = NULL;
+	    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+	    GST_ELEMENT_WARNING(thetauvcsrc, RESOURCE, READ,
+		("Theta (serial:%s) disconnected, waiting for it to come back.",
+		    thetauvcsrc->serial), (NULL));
+	    thetauvcsrc->backend->stop_streaming(devh);
+	    uvc_close(devh);
+	    uvc_unref_device(dev);
+
+	    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+	    continue;
+	}
+
+	thetauvcsrc->device_arrived = FALSE;
+	g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+	ok = thetauvcsrc_reopen(thetauvcsrc);
+	g_mutex_lock(&thetauvcsrc->reconnect_lock);
+
+	if (ok) {
+	    thetauvcsrc->reconnects++;
+	    GST_INFO_OBJECT(thetauvcsrc, "reconnected to %03u:%03u",
+		thetauvcsrc->dev_bus, thetauvcsrc->dev_addr);
+	    g_atomic_int_set(&thetauvcsrc->device_lost, 0);
+	    continue;
+	}
+	if (!thetauvcsrc->device_arrived && !thetauvcsrc->reconnect_stop)
+	    g_cond_wait_until(&thetauvcsrc->reconnect_cond,
+		&thetauvcsrc->reconnect_lock,
+		g_get_monotonic_time() + THETAUVCSRC_RECONNECT_RETRY);
+    }
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    return NULL;
+}
+
+/*
+ * Choose the format again after the mode property changed or downstream
+ * asked for a reconfiguration, and restart streaming if it differs.
+ * Returns FALSE if downstream accepts none of the device formats.
+ */
+static  gboolean
+thetauvcsrc_switch_format(GstThetauvcsrc * thetauvcsrc)
+{
+    thetauvc_mode_t fmt;
+    uvc_stream_ctrl_t old_ctrl;
+    GstCaps *devcaps, *caps;
+    uvc_error_t res, switch_res;
+    gint64  begin;
+    gboolean ok;
+
+    /* a frame log has a single format */
+    if (thetauvcsrc->replay != NULL)
+	return TRUE;
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    devcaps = thetauvcsrc->device_caps != NULL ?
+	gst_caps_ref(thetauvcsrc->device_caps) : NULL;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+
+    /* the reconnect thread does not touch the device while this is held */
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    if (thetauvcsrc->devh == NULL || thetauvcsrc->watchdog_resetting
+	|| g_atomic_int_get(&thetauvcsrc->device_lost)) {
+	g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+	if (devcaps != NULL)
+	    gst_caps_unref(devcaps);
+	/* try again once it is back */
+	gst_pad_mark_reconfigure(GST_BASE_SRC_PAD(thetauvcsrc));
+	return TRUE;
+    }
+
+    ok = thetauvcsrc_choose_format(thetauvcsrc, devcaps, &fmt);
+    if (devcaps != NULL)
+	gst_caps_unref(devcaps);
+    if (!ok || (fmt.width == thetauvcsrc->mode_val.width
+	    && fmt.height == thetauvcsrc->mode_val.height
+	    && (fmt.fps == 0
+		|| fmt.fps == 10000000 / thetauvcsrc->ctrl.dwFrameInterval))) {
+	g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+	return ok;
+    }
+
+    GST_INFO_OBJECT(thetauvcsrc, "switching from %ux%u to %ux%u@%u",
+	thetauvcsrc->mode_val.width, thetauvcsrc->mode_val.height,
+	fmt.width, fmt.height, fmt.fps);
+    begin = g_get_monotonic_time();
+
+    /* leave room so that the callback does not block while stopping */
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+    thetauvcsrc_stop_streaming(thetauvcsrc);
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+
+    old_ctrl = thetauvcsrc->ctrl;
+    switch_res = thetauvcsrc_select_format(thetauvcsrc, &fmt);
+    if (switch_res != UVC_SUCCESS)
+	thetauvcsrc->ctrl = old_ctrl;
+
+    /* cb() is not running, its state can be touched */
+    thetauvcsrc->need_discont = TRUE;
+    thetauvcsrc->skip_to_idr = TRUE;
+    thetauvcsrc->stats.sequence_valid = FALSE;
+    thetauvcsrc->timing.valid = FALSE;
+    thetauvcsrc_clear_headers(thetauvcsrc);
+    if (thetauvcsrc->recorder != NULL) {
+	GST_WARNING_OBJECT(thetauvcsrc, "format changed, recording stopped");
+	thetauvc_recorder_close(thetauvcsrc->recorder);
+	thetauvcsrc->recorder = NULL;
+    }
+    res = thetauvcsrc_start_streaming(thetauvcsrc);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    if (res != UVC_SUCCESS) {
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, READ,
+	    ("Could not restart streaming."), ("%s", uvc_strerror(res)));
+	return FALSE;
+    }
+
+    /* streaming goes on in the previous format */
+    if (switch_res != UVC_SUCCESS) {
+	GST_ELEMENT_WARNING(thetauvcsrc, RESOURCE, SETTINGS,
+	    ("Could not switch to %ux%u, keeping %ux%u.", fmt.width,
+		fmt.height, thetauvcsrc->mode_val.width,
+		thetauvcsrc->mode_val.height), ("%s",
+		uvc_strerror(switch_res)));
+	return TRUE;
+    }
+
+    caps = thetauvcsrc_fixate_srccaps(thetauvcsrc);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    gst_caps_replace(&thetauvcsrc->current_caps, caps);
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    gst_caps_unref(caps);
+
+    GST_INFO_OBJECT(thetauvcsrc, "streaming restarted after %"
+	G_GINT64_FORMAT " us", g_get_monotonic_time() - begin);
+
+    return TRUE;
+}
+
+/* Watch for the device leaving and coming back */
+static void
+thetauvcsrc_start_hotplug(GstThetauvcsrc * thetauvcsrc)
+{
+    g_atomic_int_set(&thetauvcsrc->device_lost, 0);
+    thetauvcsrc->device_arrived = FALSE;
+    thetauvcsrc->reconnect_stop = FALSE;
+    thetauvcsrc->gap_start = GST_CLOCK_TIME_NONE;
+
+    if (!gst_thetauvc_devices_is_live()) {
+	GST_WARNING_OBJECT(thetauvcsrc,
+	    "no hotplug support, disconnection will not be detected");
+	return;
+    }
+
+    thetauvcsrc->devices_watch =
+	gst_thetauvc_devices_add_watch(thetauvcsrc_devices_watch, thetauvcsrc);
+
+    if (thetauvcsrc->auto_reconnect)
+	thetauvcsrc->reconnect_thread = g_thread_new("thetauvc-reconnect",
+	    thetauvcsrc_reconnect_thread, thetauvcsrc);
+}
+
+static void
+thetauvcsrc_stop_hotplug(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->reconnect_thread == NULL)
+	return;
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    thetauvcsrc->reconnect_stop = TRUE;
+    g_cond_signal(&thetauvcsrc->reconnect_cond);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    g_thread_join(thetauvcsrc->reconnect_thread);
+    thetauvcsrc->reconnect_thread = NULL;
+}
+
+/* Stop and start streaming on the open device, reconnect_lock is held */
+static  uvc_error_t
+thetauvcsrc_watchdog_restart(GstThetauvcsrc * thetauvcsrc)
+{
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+    thetauvcsrc_stop_streaming(thetauvcsrc);
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+
+    /* cb() is not running, its state can be touched */
+    thetauvcsrc->need_discont = TRUE;
+    thetauvcsrc->skip_to_idr = TRUE;
+    thetauvcsrc->stats.sequence_valid = FALSE;
+
+    return thetauvcsrc_start_streaming(thetauvcsrc);
+}
+
+/*
+ * Reset the USB device and open it again, reconnect_lock is held.  If it
+ * does not come back right away, it is handed to the reconnect thread as
+ * a lost device.
+ *
+ * The lock is released meanwhile, as the reconnect thread does: the reset
+ * produces hotplug events, which take the device cache lock and then
+ * reconnect_lock, while the device lookup takes them the other way round.
+ * watchdog_resetting keeps the others away from the device.
+ */
+static  gboolean
+thetauvcsrc_watchdog_reset(GstThetauvcsrc * thetauvcsrc)
+{
+    uvc_device_handle_t *devh;
+    uvc_device_t *dev;
+    gboolean ok;
+    int     ret;
+
+    devh = thetauvcsrc->devh;
+    dev = thetauvcsrc->dev;
+    thetauvcsrc->devh = NULL;
+    thetauvcsrc->dev = NULL;
+    thetauvcsrc->watchdog_resetting = TRUE;
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+    thetauvcsrc->backend->stop_streaming(devh);
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+
+    ret = libusb_reset_device(uvc_get_libusb_handle(devh));
+    GST_DEBUG_OBJECT(thetauvcsrc, "device reset: %s", libusb_error_name(ret));
+    uvc_close(devh);
+    uvc_unref_device(dev);
+
+    ok = thetauvcsrc_reopen(thetauvcsrc);
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    thetauvcsrc->watchdog_resetting = FALSE;
+    if (ok) {
+	g_atomic_int_set(&thetauvcsrc->device_lost, 0);
+	return TRUE;
+    }
+
+    g_atomic_int_set(&thetauvcsrc->device_lost, 1);
+    gst_thetauvc_queue_interrupt(thetauvcsrc->queue);
+    g_cond_signal(&thetauvcsrc->reconnect_cond);
+
+    return FALSE;
+}
+
+static void
+thetauvcsrc_watchdog_warn(GstThetauvcsrc * thetauvcsrc, const gchar * action,
+    gint64 stalled, gboolean ok)
+{
+    GST_ELEMENT_WARNING_WITH_DETAILS(thetauvcsrc, RESOURCE, READ,
+	("Theta (serial:%s) sent no frame for %" G_GINT64_FORMAT " ms, %s %s.",
+	    thetauvcsrc->serial, stalled / 1000, action,
+	    ok ? "done" : "failed"), (NULL),
+	("action", G_TYPE_STRING, action,
+	    "success", G_TYPE_BOOLEAN, ok,
+	    "stalled", G_TYPE_UINT64, (guint64) stalled * GST_USECOND,
+	    "restarts", G_TYPE_UINT,
+	    (guint) atomic_load(&thetauvcsrc->stats.restarts),
+	    "resets", G_TYPE_UINT,
+	    (guint) atomic_load(&thetauvcsrc->stats.resets), NULL));
+}
+
+/*
+ * Recover from a camera that stays on the bus but stops sending frames.
+ * Each watchdog period without a frame escalates: restart streaming,
+ * then reset the device, then fail.  Frames coming in start over.
+ */
+static  gpointer
+thetauvcsrc_watchdog_thread(gpointer data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(data);
+    guint64 seen, received;
+    gint64  period, now, end_time, last;
+    const gchar *action;
+    guint   level;
+    gboolean ok;
+
+    period = (gint64) thetauvcsrc->watchdog *
+	thetauvcsrc->ctrl.dwFrameInterval / 10;
+    seen = atomic_load(&thetauvcsrc->stats.received);
+    last = now = g_get_monotonic_time();
+    level = 0;
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    while (!thetauvcsrc->watchdog_stop) {
+	end_time = g_get_monotonic_time() + period;
+	while (!thetauvcsrc->watchdog_stop
+	    && g_cond_wait_until(&thetauvcsrc->watchdog_cond,
+		&thetauvcsrc->reconnect_lock, end_time));
+	if (thetauvcsrc->watchdog_stop)
+	    break;
+
+	now = g_get_monotonic_time();
+	received = atomic_load(&thetauvcsrc->stats.received);
+	/* a lost device is the business of the reconnect thread */
+	if (received != seen || thetauvcsrc->devh == NULL
+	    || g_atomic_int_get(&thetauvcsrc->device_lost)) {
+	    seen = received;
+	    last = now;
+	    level = 0;
+	    continue;
+	}
+
+	level++;
+	if (level >= THETAUVCSRC_WATCHDOG_FAIL)
+	    break;
+
+	if (level == THETAUVCSRC_WATCHDOG_RESTART) {
+	    action = "restart";
+	    ok = thetauvcsrc_watchdog_restart(thetauvcsrc) == UVC_SUCCESS;
+	    atomic_fetch_add(&thetauvcsrc->stats.restarts, 1);
+	} else {
+	    action = "reset";
+	    ok = thetauvcsrc_watchdog_reset(thetauvcsrc);
+	    atomic_fetch_add(&thetauvcsrc->stats.resets, 1);
+	}
+
+	/* not holding the lock, the application may stop us from the bus */
+	g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+	thetauvcsrc_watchdog_warn(thetauvcsrc, action, now - last, ok);
+	g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    }
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    if (level >= THETAUVCSRC_WATCHDOG_FAIL)
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, READ,
+	    ("Theta (serial:%s) sent no frame for %" G_GINT64_FORMAT
+		" ms after a restart and a reset.", thetauvcsrc->serial,
+		(now - last) / 1000), (NULL));
+
+    return NULL;
+}
+
+static void
+thetauvcsrc_start_watchdog(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->watchdog == 0 || thetauvcsrc->replay != NULL
+	|| thetauvcsrc->ctrl.dwFrameInterval == 0)
+	return;
+
+    thetauvcsrc->watchdog_stop = FALSE;
+    thetauvcsrc->watchdog_thread = g_thread_new("thetauvc-watchdog",
+	thetauvcsrc_watchdog_thread, thetauvcsrc);
+}
+
+static void
+thetauvcsrc_stop_watchdog(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->watchdog_thread == NULL)
+	return;
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    thetauvcsrc->watchdog_stop = TRUE;
+    g_cond_signal(&thetauvcsrc->watchdog_cond);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    g_thread_join(thetauvcsrc->watchdog_thread);
+    thetauvcsrc->watchdog_thread = NULL;
+}
+
+/* Time spent in a bring-up phase, from *since until now */
+static void
+thetauvcsrc_bringup_mark(GstStructure * stats, const gchar * phase,
+    gint64 * since)
+{
+    gint64  now;
+
+    now = g_get_monotonic_time();
+    gst_structure_set(stats, phase, G_TYPE_UINT64,
+	(guint64) (now - *since) * GST_USECOND, NULL);
+    *since = now;
+}
+
+/* Find, open and set up the device and choose the stream format */
+static  gboolean
+thetauvcsrc_open_device(GstThetauvcsrc * thetauvcsrc, GstStructure * stats,
+    gint64 * since)
+{
+    GstThetauvcDeviceInfo *info;
+    uvc_device_t **list;
+    GList  *infos, *l;
+    GstCaps *caps;
+    uvc_error_t res;
+    thetauvc_mode_t fmt;
+    gboolean ok;
+    int found;
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "dev=%d mode=%d",
+	thetauvcsrc->device_number, thetauvcsrc->mode);
+
+    thetauvcsrc->backend = &thetauvc_backend_uvc;
+
+    if (!thetauvcsrc_open_context(thetauvcsrc)) {
+	GST_ELEMENT_ERROR(thetauvcsrc, LIBRARY, INIT,
+	    ("Could not initialize libuvc."), (NULL));
+	return FALSE;
+    }
+
+    if (!gst_thetauvc_devices_ref()) {
+	GST_ELEMENT_ERROR(thetauvcsrc, LIBRARY, INIT,
+	    ("Could not enumerate devices."), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    thetauvcsrc->has_devices = TRUE;
+    thetauvcsrc_bringup_mark(stats, "context", since);
+
+    if (uvc_get_device_list(thetauvcsrc->ctx, &list) != UVC_SUCCESS) {
+	GST_ELEMENT_ERROR(thetauvcsrc, LIBRARY, INIT,
+	    ("Could not enumerate devices."), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+
+    /* resolve against the device cache, then open by bus address */
+    found = 0;
+    res = UVC_ERROR_NO_DEVICE;
+    if (thetauvcsrc->serial != NULL || thetauvcsrc->device_number != -1) {
+	info = gst_thetauvc_devices_lookup(thetauvcsrc->serial,
+	    thetauvcsrc->device_number);
+	if (info != NULL) {
+	    found = 1;
+	    res = thetauvcsrc_open_info(thetauvcsrc, list, info);
+	    gst_thetauvc_device_info_free(info);
+	}
+	thetauvcsrc->device_index =
+	    thetauvcsrc->serial != NULL ? -1 : thetauvcsrc->device_number;
+    } else {
+	infos = gst_thetauvc_devices_list();
+	for (l = infos; l != NULL; l = l->next, found++) {
+	    res = thetauvcsrc_open_info(thetauvcsrc, list, l->data);
+	    if (res == UVC_SUCCESS) {
+		thetauvcsrc->device_index = found;
+		break;
+	    }
+	}
+	g_list_free_full(infos,
+	    (GDestroyNotify) gst_thetauvc_device_info_free);
+    }
+    uvc_free_device_list(list, 1);
+
+    if (res != UVC_SUCCESS) {
+	if (found == 0 && thetauvcsrc->serial != NULL)
+	    GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, NOT_FOUND,
+		("Theta (serial:%s) not found.", thetauvcsrc->serial), (NULL));
+	else if (found == 0)
+	    GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, NOT_FOUND,
+		("Theta not found."), (NULL));
+	else if (thetauvcsrc->device_number == -1 && thetauvcsrc->serial == NULL)
+	    GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, NOT_FOUND,
+		("Found %d Theta(s), but none available.", found), (NULL));
+	else
+	    GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ_WRITE,
+		("Could not open Theta."), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    GST_DEBUG_OBJECT(thetauvcsrc, "Serial: %s", thetauvcsrc->serial);
+    thetauvcsrc_bringup_mark(stats, "open", since);
+
+    if (!thetauvcsrc_setup_configuration(thetauvcsrc)) {
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ_WRITE,
+	    ("Could not open Theta."), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    thetauvcsrc_bringup_mark(stats, "configuration", since);
+
+    caps = thetauvcsrc_device_caps(thetauvcsrc);
+    GST_DEBUG_OBJECT(thetauvcsrc, "device caps %" GST_PTR_FORMAT, caps);
+    if (!gst_caps_is_empty(caps)) {
+	GST_OBJECT_LOCK(thetauvcsrc);
+	gst_caps_replace(&thetauvcsrc->device_caps, caps);
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+    }
+    ok = thetauvcsrc_choose_format(thetauvcsrc, caps, &fmt);
+    gst_caps_unref(caps);
+
+    if (!ok) {
+	GST_ELEMENT_ERROR(thetauvcsrc, STREAM, FORMAT,
+	    ("No stream of the Theta is accepted downstream."), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    res = thetauvcsrc_select_format(thetauvcsrc, &fmt);
+    if (res != UVC_SUCCESS) {
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ_WRITE,
+	    ("No available stream"), (NULL));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    thetauvcsrc_bringup_mark(stats, "negotiation", since);
+
+    return TRUE;
+}
+
+/* Play the frame log of replay-location instead of a device */
+static  gboolean
+thetauvcsrc_open_replay(GstThetauvcsrc * thetauvcsrc, GstStructure * stats,
+    gint64 * since)
+{
+    uint32_t interval;
+    uvc_error_t res;
+
+    res = thetauvc_replay_open(thetauvcsrc->replay_location,
+	&thetauvcsrc->replay);
+    if (res != UVC_SUCCESS) {
+	thetauvcsrc->replay = NULL;
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ,
+	    ("Could not open frame log %s.", thetauvcsrc->replay_location),
+	    ("%s", uvc_strerror(res)));
+	return FALSE;
+    }
+
+    thetauvc_replay_set_speed(thetauvcsrc->replay, thetauvcsrc->replay_speed,
+	thetauvcsrc->replay_loop);
+    thetauvc_replay_get_format(thetauvcsrc->replay, &thetauvcsrc->dev_pid,
+	&thetauvcsrc->mode_val, &interval);
+    memset(&thetauvcsrc->ctrl, 0, sizeof(thetauvcsrc->ctrl));
+    thetauvcsrc->ctrl.dwFrameInterval = interval;
+    thetauvcsrc->backend = &thetauvc_backend_replay;
+    thetauvcsrc_bringup_mark(stats, "open", since);
+
+    return TRUE;
+}
+
+/*
+ * Open the device or the frame log, then start streaming.  Runs on the
+ * bring-up thread, errors are posted and everything is closed on failure.
+ */
+static  gboolean
+thetauvcsrc_bringup(GstThetauvcsrc * thetauvcsrc, GstStructure * stats)
+{
+    GstCaps *caps;
+    uvc_error_t res;
+    gint64  since;
+
+    since = g_get_monotonic_time();
+    if (thetauvcsrc->replay_location != NULL) {
+	if (!thetauvcsrc_open_replay(thetauvcsrc, stats, &since))
+	    return FALSE;
+    } else if (!thetauvcsrc_open_device(thetauvcsrc, stats, &since)) {
+	return FALSE;
+    }
+
+    caps = thetauvcsrc_fixate_srccaps(thetauvcsrc);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    gst_caps_replace(&thetauvcsrc->current_caps, caps);
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    gst_caps_unref(caps);
+
+    thetauvcsrc_setup_queue(thetauvcsrc);
+    thetauvcsrc_stats_reset(thetauvcsrc);
+    thetauvcsrc_open_recorder(thetauvcsrc);
+
+    thetauvcsrc->framecount = 0;
+    thetauvcsrc->timing.valid = FALSE;
+    thetauvcsrc->skip_to_idr = FALSE;
+    thetauvcsrc->need_discont = FALSE;
+    thetauvcsrc->last_key_index = 0;
+    g_atomic_int_set(&thetauvcsrc->replay_eos, 0);
+    thetauvcsrc_clear_headers(thetauvcsrc);
+    res = thetauvcsrc_start_streaming(thetauvcsrc);
+    if (res != UVC_SUCCESS) {
+	GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ,
+	    ("Could not start streaming."), ("%s", uvc_strerror(res)));
+	thetauvcsrc_close(thetauvcsrc);
+	return FALSE;
+    }
+    thetauvcsrc_bringup_mark(stats, "streaming", &since);
+    if (thetauvcsrc->replay == NULL)
+	thetauvcsrc_start_hotplug(thetauvcsrc);
+    thetauvcsrc_stats_start(thetauvcsrc);
+    thetauvcsrc_start_watchdog(thetauvcsrc);
+
+    return TRUE;
+}
+
+/*
+ * Bring the device up off the state change thread, so that several
+ * sources open their THETAs at the same time.
+ */
+static  gpointer
+thetauvcsrc_bringup_thread(gpointer data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(data);
+    GstStructure *stats;
+    GstFlowReturn ret;
+    gint64  begin;
+    gboolean ok;
+
+    begin = g_get_monotonic_time();
+    stats = gst_structure_new_empty("thetauvcsrc-bringup");
+    ok = thetauvcsrc_bringup(thetauvcsrc, stats);
+    gst_structure_set(stats, "total", G_TYPE_UINT64,
+	(guint64) (g_get_monotonic_time() - begin) * GST_USECOND, NULL);
+    GST_INFO_OBJECT(thetauvcsrc, "bring-up %s: %" GST_PTR_FORMAT,
+	ok ? "done" : "failed", stats);
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    if (thetauvcsrc->bringup_stats != NULL)
+	gst_structure_free(thetauvcsrc->bringup_stats);
+    thetauvcsrc->bringup_stats = stats;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+
+    /* do not let the streaming task start once stop() is on its way */
+    g_mutex_lock(&thetauvcsrc->bringup_lock);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    if (thetauvcsrc->bringup_cancel
+	|| !GST_OBJECT_FLAG_IS_SET(thetauvcsrc, GST_BASE_SRC_FLAG_STARTING))
+	ret = GST_FLOW_FLUSHING;
+    else
+	ret = ok ? GST_FLOW_OK : GST_FLOW_ERROR;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    gst_base_src_start_complete(GST_BASE_SRC(thetauvcsrc), ret);
+    g_mutex_unlock(&thetauvcsrc->bringup_lock);
+
+    return NULL;
+}
+
+/* start and stop processing, ideal for opening/closing the resource */
+static  gboolean
+gst_thetauvcsrc_start(GstBaseSrc * src)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "start");
+
+    thetauvcsrc->sched.policy = thetauvcsrc->thread_policy;
+    thetauvcsrc->sched.priority = thetauvcsrc->thread_priority;
+    g_free(thetauvcsrc->sched.cpus);
+    thetauvcsrc->sched.cpus = g_strdup(thetauvcsrc->cpu_affinity);
+    thetauvcsrc->create_thread = NULL;
+    gst_thetauvc_ring_set_limits(thetauvcsrc->ring,
+	thetauvcsrc->pre_event_time,
+	thetauvcsrc->pre_event_time > 0 ? thetauvcsrc->pre_event_max_bytes : 0);
+
+    if (thetauvcsrc->shm_socket_path != NULL) {
+	GError *error = NULL;
+
+	thetauvcsrc->shm =
+	    gst_thetauvc_shm_server_new(thetauvcsrc->shm_socket_path,
+	    thetauvcsrc->shm_size, &error);
+	if (thetauvcsrc->shm == NULL) {
+	    GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, OPEN_READ_WRITE,
+		("Could not share frames on %s.",
+		    thetauvcsrc->shm_socket_path), ("%s", error->message));
+	    g_error_free(error);
+	    return FALSE;
+	}
+    }
+
+    thetauvcsrc->bringup_cancel = FALSE;
+    thetauvcsrc->bringup_thread = g_thread_new("thetauvc-bringup",
+	thetauvcsrc_bringup_thread, thetauvcsrc);
+
+    return TRUE;
+}
+
+/* Wait for the bring-up thread, it completes the start as flushing */
+static void
+thetauvcsrc_cancel_bringup(GstThetauvcsrc * thetauvcsrc)
+{
+    if (thetauvcsrc->bringup_thread == NULL)
+	return;
+
+    g_mutex_lock(&thetauvcsrc->bringup_lock);
+    thetauvcsrc->bringup_cancel = TRUE;
+    g_mutex_unlock(&thetauvcsrc->bringup_lock);
+    g_thread_join(thetauvcsrc->bringup_thread);
+    thetauvcsrc->bringup_thread = NULL;
+}
+
+static  gboolean
+gst_thetauvcsrc_stop(GstBaseSrc * src)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "stop");
+
+    thetauvcsrc_cancel_bringup(thetauvcsrc);
+
+    thetauvcsrc_stats_stop(thetauvcsrc);
+    thetauvcsrc_stop_watchdog(thetauvcsrc);
+    thetauvcsrc_stop_hotplug(thetauvcsrc);
+    if (thetauvcsrc_backend_handle(thetauvcsrc) != NULL)
+	thetauvcsrc_stop_streaming(thetauvcsrc);
+    thetauvcsrc_close(thetauvcsrc);
+    gst_thetauvc_queue_flush(thetauvcsrc->queue);
+    gst_thetauvc_ring_reset(thetauvcsrc->ring);
+    if (thetauvcsrc->shm != NULL) {
+	GST_INFO_OBJECT(thetauvcsrc, "shm: %" G_GUINT64_FORMAT " dropped",
+	    thetauvcsrc->shm->dropped);
+	gst_thetauvc_shm_server_free(thetauvcsrc->shm);
+	thetauvcsrc->shm = NULL;
+    }
+    thetauvcsrc_clear_pool(thetauvcsrc);
+    GST_OBJECT_LOCK(thetauvcsrc);
+    gst_caps_replace(&thetauvcsrc->device_caps, NULL);
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+
+    GST_INFO_OBJECT(thetauvcsrc, "queue: %" G_GUINT64_FORMAT " pushed, %"
+	G_GUINT64_FORMAT " producer stalls, %" G_GUINT64_FORMAT " wakeups, %"
+	G_GUINT64_FORMAT " dropped",
+	(guint64) atomic_load(&thetauvcsrc->queue->pushed),
+	(guint64) atomic_load(&thetauvcsrc->queue->stalls),
+	(guint64) atomic_load(&thetauvcsrc->queue->wakeups),
+	(guint64) atomic_load(&thetauvcsrc->queue->dropped));
 
     return TRUE;
 }
 
+/*
+ * Cancel the bring-up before the base class stops the streaming task.
+ * In stop() it would be too late: the task is already stopped and the
+ * bring-up thread could complete the start and restart it.
+ */
+static  GstStateChangeReturn
+gst_thetauvcsrc_change_state(GstElement * element, GstStateChange transition)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(element);
+
+    if (transition == GST_STATE_CHANGE_PAUSED_TO_READY)
+	thetauvcsrc_cancel_bringup(thetauvcsrc);
+
+    return GST_ELEMENT_CLASS(gst_thetauvcsrc_parent_class)->change_state(element,
+	transition);
+}
+
+/*
+ * The streaming task leaves its thread on the LEAVE stream-status, posted
+ * from that thread.  The thread goes back to the default task pool, so
+ * hand it back with the scheduling it came with.
+ */
+static  gboolean
+gst_thetauvcsrc_post_message(GstElement * element, GstMessage * message)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(element);
+    GstStreamStatusType type;
+    GstElement *owner;
+    gint    ret;
+
+    if (GST_MESSAGE_TYPE(message) == GST_MESSAGE_STREAM_STATUS
+	&& thetauvcsrc->create_thread == g_thread_self()) {
+	gst_message_parse_stream_status(message, &type, &owner);
+	if (type == GST_STREAM_STATUS_TYPE_LEAVE && owner == element) {
+	    thetauvcsrc->create_thread = NULL;
+	    if ((ret = gst_thetauvc_thread_restore(&thetauvcsrc->
+			create_saved)) != 0)
+		GST_WARNING_OBJECT(thetauvcsrc, "could not restore scheduling "
+		    "of the streaming thread: %s", g_strerror(ret));
+	}
+    }
+
+    return GST_ELEMENT_CLASS(gst_thetauvcsrc_parent_class)->post_message(element,
+	message);
+}
+
 /* given a buffer, return start and stop time when it should be pushed
  * out. The base class will sync on the clock using these times. */
 static void
@@ -663,6 +3023,8 @@ gst_thetauvcsrc_unlock(GstBaseSrc * src)
 
     GST_DEBUG_OBJECT(thetauvcsrc, "unlock");
 
+    gst_thetauvc_queue_set_flushing(thetauvcsrc->queue, TRUE);
+
     return TRUE;
 }
 
@@ -674,6 +3036,8 @@ gst_thetauvcsrc_unlock_stop(GstBaseSrc * src)
 
     GST_DEBUG_OBJECT(thetauvcsrc, "unlock_stop");
 
+    gst_thetauvc_queue_set_flushing(thetauvcsrc->queue, FALSE);
+
     return TRUE;
 }
 
@@ -698,8 +3062,9 @@ gst_thetauvcsrc_query(GstBaseSrc * src, GstQuery * query)
     case GST_QUERY_CAPS:
 	GST_DEBUG_OBJECT(thetauvcsrc, "query CAPS\n");
 	{
-	    GstCaps *caps;
-	    caps = get_current_caps(thetauvcsrc);
+	    GstCaps *caps, *filter;
+	    gst_query_parse_caps(query, &filter);
+	    caps = gst_thetauvcsrc_get_caps(src, filter);
 	    gst_query_set_caps_result(query, caps);
 	    gst_caps_unref(caps);
 	}
@@ -711,15 +3076,372 @@ gst_thetauvcsrc_query(GstBaseSrc * src, GstQuery * query)
     return ret;
 }
 
+/* Post the result of a dump, on its writer thread */
+static void
+thetauvcsrc_dump_done(const gchar * location, guint frames, guint64 bytes,
+    const gchar * error, gpointer user_data)
+{
+    GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(user_data);
+
+    if (error != NULL)
+	GST_ELEMENT_WARNING(thetauvcsrc, RESOURCE, WRITE,
+	    ("Could not write %s.", location), ("%s", error));
+    else
+	GST_INFO_OBJECT(thetauvcsrc, "dumped %u frames (%" G_GUINT64_FORMAT
+	    " bytes) to %s", frames, bytes, location);
+
+    gst_element_post_message(GST_ELEMENT_CAST(thetauvcsrc),
+	gst_message_new_element(GST_OBJECT_CAST(thetauvcsrc),
+	    gst_structure_new("thetauvcsrc-dump",
+		"location", G_TYPE_STRING, location,
+		"frames", G_TYPE_UINT, frames,
+		"bytes", G_TYPE_UINT64, bytes,
+		"success", G_TYPE_BOOLEAN, error == NULL, NULL)));
+}
+
+/* Default handler of the dump signal */
+static  gboolean
+thetauvcsrc_dump(GstThetauvcsrc * thetauvcsrc, const gchar * location,
+    guint64 duration)
+{
+    GError *error = NULL;
+
+    if (location == NULL)
+	return FALSE;
+
+    if (!gst_thetauvc_ring_dump(thetauvcsrc->ring, location, duration,
+	    &error)) {
+	GST_WARNING_OBJECT(thetauvcsrc, "dump: %s", error->message);
+	g_error_free(error);
+	return FALSE;
+    }
+    GST_DEBUG_OBJECT(thetauvcsrc, "dumping to %s", location);
+
+    return TRUE;
+}
+
+/*
+ * Ask the encoder for an IDR frame.  The request stays pending until an
+ * IDR frame is pushed, so a camera without an encoding unit answers it
+ * with its next periodic one.
+ */
+static void
+thetauvcsrc_request_key_unit(GstThetauvcsrc * thetauvcsrc,
+    gboolean all_headers, guint count)
+{
+    gpointer handle;
+    uvc_error_t res;
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    thetauvcsrc->key_unit_pending = TRUE;
+    thetauvcsrc->key_unit_all_headers |= all_headers;
+    thetauvcsrc->key_unit_count = count;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+
+    g_mutex_lock(&thetauvcsrc->reconnect_lock);
+    handle = thetauvcsrc_backend_handle(thetauvcsrc);
+    if (handle == NULL || g_atomic_int_get(&thetauvcsrc->device_lost)
+	|| thetauvcsrc->watchdog_resetting
+	|| thetauvcsrc->backend->request_key_frame == NULL) {
+	g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+	return;
+    }
+    res = thetauvcsrc->backend->request_key_frame(handle);
+    /* the request ends periodic IDR frames, gop-length sets them again */
+    if (res == UVC_SUCCESS)
+	thetauvcsrc_set_encoder(thetauvcsrc, TRUE);
+    g_mutex_unlock(&thetauvcsrc->reconnect_lock);
+
+    if (res == UVC_ERROR_NOT_SUPPORTED)
+	GST_INFO_OBJECT(thetauvcsrc, "no encoding unit, waiting for an IDR");
+    else if (res != UVC_SUCCESS)
+	GST_WARNING_OBJECT(thetauvcsrc, "key frame request failed: %s",
+	    uvc_strerror(res));
+}
+
 /* notify subclasses of an event */
 static  gboolean
 gst_thetauvcsrc_event(GstBaseSrc * src, GstEvent * event)
 {
     GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+    GstClockTime running_time;
+    gboolean all_headers;
+    guint   count;
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "event %" GST_PTR_FORMAT, event);
+
+    if (GST_EVENT_TYPE(event) == GST_EVENT_CUSTOM_UPSTREAM
+	&& gst_video_event_is_force_key_unit(event)) {
+	gst_video_event_parse_upstream_force_key_unit(event, &running_time,
+	    &all_headers, &count);
+	GST_DEBUG_OBJECT(thetauvcsrc, "force-key-unit at %" GST_TIME_FORMAT
+	    ", all-headers %d, count %u", GST_TIME_ARGS(running_time),
+	    all_headers, count);
+	thetauvcsrc_request_key_unit(thetauvcsrc, all_headers, count);
+	return TRUE;
+    }
 
-    GST_DEBUG_OBJECT(thetauvcsrc, "event");
+    return GST_BASE_SRC_CLASS(gst_thetauvcsrc_parent_class)->event(src, event);
+}
 
-    return TRUE;
+/* Running time now, with the host monotonic time it was sampled at */
+static  GstClockTime
+thetauvcsrc_running_time(GstThetauvcsrc * thetauvcsrc, GstClockTime * host_now)
+{
+    GstClock *clock;
+    GstClockTime now, base_time;
+
+    if ((clock = gst_element_get_clock(GST_ELEMENT_CAST(thetauvcsrc))) == NULL)
+	return GST_CLOCK_TIME_NONE;
+    now = gst_clock_get_time(clock);
+    if (host_now != NULL)
+	*host_now = g_get_monotonic_time() * GST_USECOND;
+    gst_object_unref(clock);
+
+    base_time = gst_element_get_base_time(GST_ELEMENT_CAST(thetauvcsrc));
+    if (now < base_time)
+	return GST_CLOCK_TIME_NONE;
+
+    return now - base_time;
+}
+
+/*
+ * Convert the host capture time of a frame to running time: take the
+ * pipeline clock now and subtract the host time elapsed since capture.
+ */
+static  GstClockTime
+thetauvcsrc_capture_running_time(GstThetauvcsrc * thetauvcsrc,
+    GstBuffer * buf)
+{
+    GstReferenceTimestampMeta *meta;
+    GstClockTime now, host_now, elapsed;
+
+    meta = gst_buffer_get_reference_timestamp_meta(buf, capture_caps);
+    if (meta == NULL)
+	return GST_CLOCK_TIME_NONE;
+
+    now = thetauvcsrc_running_time(thetauvcsrc, &host_now);
+    if (!GST_CLOCK_TIME_IS_VALID(now))
+	return GST_CLOCK_TIME_NONE;
+
+    elapsed = host_now > meta->timestamp ? host_now - meta->timestamp : 0;
+
+    return now > elapsed ? now - elapsed : 0;
+}
+
+/*
+ * Smooth the observed capture times against the camera sequence with a
+ * first order PLL.  The period estimate follows the real frame rate of
+ * the camera, the phase term keeps the timestamps locked to the clock.
+ * A sequence gap or a jump beyond the resync threshold marks DISCONT.
+ */
+static void
+thetauvcsrc_timestamp(GstThetauvcsrc * thetauvcsrc, GstBuffer * buf)
+{
+    GstThetauvcsrcTiming *t = &thetauvcsrc->timing;
+    GstClockTime observed, nominal;
+    gdouble predicted, err;
+    guint64 seq, n;
+
+    observed = thetauvcsrc_capture_running_time(thetauvcsrc, buf);
+    if (!GST_CLOCK_TIME_IS_VALID(observed))
+	return;
+
+    nominal = GST_BUFFER_DURATION(buf);
+    seq = GST_BUFFER_OFFSET(buf);
+
+    if (t->valid && seq > t->last_seq) {
+	n = seq - t->last_seq;
+	predicted = t->last + n * t->period;
+	err = (gdouble) observed - predicted;
+
+	if (fabs(err) < THETAUVCSRC_TS_RESYNC * (gdouble) nominal) {
+	    t->last = predicted + err / THETAUVCSRC_TS_PHASE_GAIN;
+	    t->period += err / (n * THETAUVCSRC_TS_FREQ_GAIN);
+	    t->period = CLAMP(t->period, nominal * 0.99, nominal * 1.01);
+	    if (n > 1) {
+		GST_DEBUG_OBJECT(thetauvcsrc, "sequence gap %" G_GUINT64_FORMAT
+		    " -> %" G_GUINT64_FORMAT, t->last_seq, seq);
+		GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_DISCONT);
+	    }
+	    goto done;
+	}
+	GST_DEBUG_OBJECT(thetauvcsrc, "timestamp off by %.0f ns, resync", err);
+    }
+
+    if (t->valid)
+	GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_DISCONT);
+    t->valid = TRUE;
+    t->last = observed;
+    t->period = nominal;
+
+  done:
+    t->last_seq = seq;
+    GST_BUFFER_PTS(buf) = (GstClockTime) t->last;
+    GST_BUFFER_DURATION(buf) = (GstClockTime) t->period;
+}
+
+/* Tell downstream there is no data up to now while the device is away */
+static void
+thetauvcsrc_push_gap(GstThetauvcsrc * thetauvcsrc)
+{
+    GstThetauvcsrcTiming *t = &thetauvcsrc->timing;
+    GstClockTime now, start;
+
+    now = thetauvcsrc_running_time(thetauvcsrc, NULL);
+    if (!GST_CLOCK_TIME_IS_VALID(now))
+	return;
+
+    start = thetauvcsrc->gap_start;
+    if (!GST_CLOCK_TIME_IS_VALID(start))
+	start = t->valid ? (GstClockTime) (t->last + t->period) : now;
+    if (now <= start)
+	return;
+
+    GST_LOG_OBJECT(thetauvcsrc, "gap %" GST_TIME_FORMAT " - %" GST_TIME_FORMAT,
+	GST_TIME_ARGS(start), GST_TIME_ARGS(now));
+    gst_pad_push_event(GST_BASE_SRC_PAD(thetauvcsrc),
+	gst_event_new_gap(start, now - start));
+    thetauvcsrc->gap_start = now;
+}
+
+/* Announce new parameter sets as streamheader in the caps */
+static void
+thetauvcsrc_update_headers(GstThetauvcsrc * thetauvcsrc)
+{
+    GstBuffer *headers;
+    GstCaps *caps;
+    GValue  array = G_VALUE_INIT;
+    GValue  value = G_VALUE_INIT;
+
+    headers = g_atomic_pointer_exchange(&thetauvcsrc->pending_headers, NULL);
+    if (headers == NULL)
+	return;
+
+    gst_buffer_replace(&thetauvcsrc->headers, NULL);
+    thetauvcsrc->headers = headers;
+
+    g_value_init(&array, GST_TYPE_ARRAY);
+    g_value_init(&value, GST_TYPE_BUFFER);
+    gst_value_set_buffer(&value, headers);
+    gst_value_array_append_and_take_value(&array, &value);
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    if (thetauvcsrc->current_caps == NULL) {
+	GST_OBJECT_UNLOCK(thetauvcsrc);
+	g_value_unset(&array);
+	return;
+    }
+    caps = gst_caps_make_writable(gst_caps_ref(thetauvcsrc->current_caps));
+    gst_caps_set_value(caps, "streamheader", &array);
+    gst_caps_replace(&thetauvcsrc->current_caps, caps);
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+    g_value_unset(&array);
+
+    GST_DEBUG_OBJECT(thetauvcsrc, "caps with streamheader %" GST_PTR_FORMAT,
+	caps);
+    gst_base_src_set_caps(GST_BASE_SRC_CAST(thetauvcsrc), caps);
+    gst_caps_unref(caps);
+}
+
+/*
+ * Prepend the cached SPS/PPS to an IDR frame which comes without them,
+ * if config-interval has elapsed, the stream was discontinuous or force
+ * is set.
+ */
+static  GstBuffer *
+thetauvcsrc_insert_headers(GstThetauvcsrc * thetauvcsrc, GstBuffer * buf,
+    gboolean force)
+{
+    GstClockTime pts;
+
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DISCONT))
+	thetauvcsrc->config_discont = TRUE;
+
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT))
+	return buf;
+
+    pts = GST_BUFFER_PTS(buf);
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_HEADER))
+	goto done;
+
+    if ((thetauvcsrc->config_interval == 0 && !force)
+	|| thetauvcsrc->headers == NULL)
+	return buf;
+
+    if (thetauvcsrc->config_interval > 0 && !thetauvcsrc->config_discont
+	&& !force
+	&& GST_CLOCK_TIME_IS_VALID(thetauvcsrc->last_config)
+	&& GST_CLOCK_TIME_IS_VALID(pts)
+	&& pts < thetauvcsrc->last_config +
+	thetauvcsrc->config_interval * GST_SECOND)
+	return buf;
+
+    GST_LOG_OBJECT(thetauvcsrc, "inserting SPS/PPS at %" GST_TIME_FORMAT,
+	GST_TIME_ARGS(pts));
+    buf = gst_buffer_make_writable(buf);
+    gst_buffer_prepend_memory(buf,
+	gst_buffer_get_all_memory(thetauvcsrc->headers));
+    GST_BUFFER_FLAG_SET(buf, GST_BUFFER_FLAG_HEADER);
+
+  done:
+    thetauvcsrc->last_config = pts;
+    thetauvcsrc->config_discont = FALSE;
+    return buf;
+}
+
+/* Answer a pending force-key-unit request with this IDR frame */
+static  GstBuffer *
+thetauvcsrc_key_unit(GstThetauvcsrc * thetauvcsrc, GstBuffer * buf)
+{
+    GstSegment *segment = &GST_BASE_SRC_CAST(thetauvcsrc)->segment;
+    GstClockTime pts, running_time, stream_time;
+    gboolean pending, all_headers;
+    guint   count;
+
+    if (GST_BUFFER_FLAG_IS_SET(buf, GST_BUFFER_FLAG_DELTA_UNIT))
+	return thetauvcsrc_insert_headers(thetauvcsrc, buf, FALSE);
+
+    GST_OBJECT_LOCK(thetauvcsrc);
+    pending = thetauvcsrc->key_unit_pending;
+    all_headers = thetauvcsrc->key_unit_all_headers;
+    count = thetauvcsrc->key_unit_count;
+    thetauvcsrc->key_unit_pending = FALSE;
+    thetauvcsrc->key_unit_all_headers = FALSE;
+    GST_OBJECT_UNLOCK(thetauvcsrc);
+
+    buf = thetauvcsrc_insert_headers(thetauvcsrc, buf, pending && all_headers);
+    if (!pending)
+	return buf;
+
+    pts = GST_BUFFER_PTS(buf);
+    running_time = gst_segment_to_running_time(segment, GST_FORMAT_TIME, pts);
+    stream_time = gst_segment_to_stream_time(segment, GST_FORMAT_TIME, pts);
+    GST_DEBUG_OBJECT(thetauvcsrc, "key unit at %" GST_TIME_FORMAT,
+	GST_TIME_ARGS(running_time));
+    gst_pad_push_event(GST_BASE_SRC_PAD(thetauvcsrc),
+	gst_video_event_new_downstream_force_key_unit(pts, stream_time,
+	    running_time, all_headers, count));
+
+    return buf;
+}
+
+/* Copy the frame to the readers in other processes */
+static void
+thetauvcsrc_publish(GstThetauvcsrc * thetauvcsrc, GstBuffer * buf)
+{
+    GstReferenceTimestampMeta *meta;
+    GstClockTime capture;
+    GstCaps *caps;
+
+    meta = gst_buffer_get_reference_timestamp_meta(buf, capture_caps);
+    capture = meta != NULL ? meta->timestamp :
+	(GstClockTime) g_get_monotonic_time() * GST_USECOND;
+    caps = gst_pad_get_current_caps(GST_BASE_SRC_PAD(thetauvcsrc));
+    if (!gst_thetauvc_shm_server_publish(thetauvcsrc->shm, buf, capture, caps))
+	GST_LOG_OBJECT(thetauvcsrc, "frame not shared");
+    if (caps != NULL)
+	gst_caps_unref(caps);
 }
 
 /* ask the subclass to create a buffer with offset and size, the default
@@ -728,17 +3450,81 @@ static  GstFlowReturn
 gst_thetauvcsrc_create(GstPushSrc * src, GstBuffer ** buf)
 {
     GstThetauvcsrc *thetauvcsrc = GST_THETAUVCSRC(src);
+    gint64  last;
 
     GST_DEBUG_OBJECT(thetauvcsrc, "create");
 
-    g_mutex_lock(&thetauvcsrc->lock);
-    while (gst_queue_array_is_empty(thetauvcsrc->queue))
-	g_cond_wait(&thetauvcsrc->cond, &thetauvcsrc->lock);
+    if (thetauvcsrc->create_thread != g_thread_self()) {
+	thetauvcsrc->create_thread = g_thread_self();
+	if (gst_thetauvc_thread_sched_is_set(&thetauvcsrc->sched)
+	    && gst_thetauvc_thread_save(&thetauvcsrc->create_saved) != 0)
+	    GST_WARNING_OBJECT(thetauvcsrc, "could not save scheduling of the "
+		"streaming thread, it stays changed after streaming");
+	thetauvcsrc_apply_sched(thetauvcsrc, "streaming");
+    }
+    thetauvcsrc_check_pool(thetauvcsrc);
+
+    last = g_get_monotonic_time();
+    while (1) {
+	gint64  timeout, now;
+	gboolean lost;
+
+	/* below 1 us the wait would return at once and spin */
+	timeout = thetauvcsrc->timeout > 0 ?
+	    MAX((gint64) (thetauvcsrc->timeout / GST_USECOND), 1) : -1;
+	lost = g_atomic_int_get(&thetauvcsrc->device_lost);
+	if (lost && (timeout < 0 || timeout > THETAUVCSRC_GAP_INTERVAL))
+	    timeout = THETAUVCSRC_GAP_INTERVAL;
+	*buf = gst_thetauvc_queue_pop_wait(thetauvcsrc->queue, timeout);
+	if (*buf != NULL)
+	    break;
+
+	if (gst_thetauvc_queue_is_flushing(thetauvcsrc->queue)) {
+	    GST_DEBUG_OBJECT(thetauvcsrc, "flushing");
+	    return GST_FLOW_FLUSHING;
+	}
+
+	if (g_atomic_int_get(&thetauvcsrc->replay_eos)) {
+	    GST_DEBUG_OBJECT(thetauvcsrc, "end of frame log");
+	    return GST_FLOW_EOS;
+	}
+
+	if (g_atomic_int_get(&thetauvcsrc->device_lost)) {
+	    if (thetauvcsrc->reconnect_thread == NULL) {
+		GST_ELEMENT_ERROR(thetauvcsrc, RESOURCE, READ,
+		    ("Theta (serial:%s) disconnected.", thetauvcsrc->serial),
+		    (NULL));
+		return GST_FLOW_ERROR;
+	    }
+	    thetauvcsrc_push_gap(thetauvcsrc);
+	}
 
-    *buf = (GstBuffer *) gst_queue_array_pop_head(thetauvcsrc->queue);
+	now = g_get_monotonic_time();
+	if (thetauvcsrc->timeout == 0
+	    || (guint64) (now - last) * GST_USECOND < thetauvcsrc->timeout)
+	    continue;
+	last = now;
+
+	GST_WARNING_OBJECT(thetauvcsrc, "no frame for %" GST_TIME_FORMAT,
+	    GST_TIME_ARGS(thetauvcsrc->timeout));
+	gst_element_post_message(GST_ELEMENT_CAST(thetauvcsrc),
+	    gst_message_new_element(GST_OBJECT_CAST(thetauvcsrc),
+		gst_structure_new("GstThetauvcSrcTimeout",
+		    "timeout", G_TYPE_UINT64, thetauvcsrc->timeout, NULL)));
+    }
+    thetauvcsrc->gap_start = GST_CLOCK_TIME_NONE;
+    thetauvcsrc_stats_push(thetauvcsrc, *buf);
+
+    if (gst_thetauvc_queue_take_discont(thetauvcsrc->queue))
+	GST_BUFFER_FLAG_SET(*buf, GST_BUFFER_FLAG_DISCONT);
+    thetauvcsrc_timestamp(thetauvcsrc, *buf);
+    thetauvcsrc_update_headers(thetauvcsrc);
+    *buf = thetauvcsrc_key_unit(thetauvcsrc, *buf);
+    gst_thetauvc_ring_push(thetauvcsrc->ring, *buf, thetauvcsrc->headers);
+    if (thetauvcsrc->shm != NULL)
+	thetauvcsrc_publish(thetauvcsrc, *buf);
     GST_DEBUG_OBJECT(thetauvcsrc, "l %lx %d", (unsigned long) *buf,
 	(*buf)->mini_object.refcount);
-    g_mutex_unlock(&thetauvcsrc->lock);
 
     return GST_FLOW_OK;
 }
@@ -785,3 +3571,50 @@ gst_thetauvc_mode_get_type(void)
 
     return (GType) id;
 }
+
+GType
+gst_thetauvc_thread_policy_get_type(void)
+{
+    static gsize id = 0;
+    static const GEnumValue policy[] = {
+	{GST_THETAUVC_THREAD_POLICY_DEFAULT,
+	    "Leave the threads as they are", "default"},
+	{GST_THETAUVC_THREAD_POLICY_OTHER,
+	    "SCHED_OTHER with the priority as nice value", "other"},
+	{GST_THETAUVC_THREAD_POLICY_FIFO, "SCHED_FIFO", "fifo"},
+	{GST_THETAUVC_THREAD_POLICY_RR, "SCHED_RR", "rr"},
+	{0, NULL, NULL}
+    };
+
+    if (g_once_init_enter(&id)) {
+	GType   tmp = g_enum_register_static("GstThetauvcThreadPolicy", policy);
+	g_once_init_leave(&id, tmp);
+    }
+
+    return (GType) id;
+}
+
+GType
+gst_thetauvc_overflow_get_type(void)
+{
+    static gsize id = 0;
+    static const GEnumValue policy[] = {
+	{GST_THETAUVC_OVERFLOW_DROP_OLDEST_GOP,
+	    "Drop the oldest GOP in the queue", "drop-oldest-gop"},
+	{GST_THETAUVC_OVERFLOW_DROP_TO_NEXT_IDR,
+	    "Drop new frames until the next IDR frame", "drop-to-next-idr"},
+	{GST_THETAUVC_OVERFLOW_NEWEST_ONLY,
+	    "Keep only the GOP of the newest IDR frame", "newest-only"},
+	{GST_THETAUVC_OVERFLOW_BLOCK,
+	    "Block the libuvc callback up to a frame interval for room, "
+	    "then drop to the next IDR", "block"},
+	{0, NULL, NULL}
+    };
+
+    if (g_once_init_enter(&id)) {
+	GType   tmp = g_enum_register_static("GstThetauvcOverflow", policy);
+	g_once_init_leave(&id, tmp);
+    }
+
+    return (GType) id;
+}
@@ -28,6 +28,11 @@
 
 #include "libuvc/libuvc.h"
 #include "thetauvc.h"
+#include "thetauvcreplay.h"
+#include "gstthetauvcqueue.h"
+#include "gstthetauvccontext.h"
+#include "gstthetauvcring.h"
+#include "gstthetauvcshm.h"
 
 G_BEGIN_DECLS
 #define GST_TYPE_THETAUVCSRC   (gst_thetauvcsrc_get_type())
@@ -36,43 +41,210 @@ G_BEGIN_DECLS
 #define GST_IS_THETAUVCSRC(obj)   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_THETAUVCSRC))
 #define GST_IS_THETAUVCSRC_CLASS(obj)   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_THETAUVCSRC))
 
+/* caps of the reference timestamp meta carrying the host capture time */
+#define GST_THETAUVCSRC_CAPTURE_CAPS "timestamp/x-thetauvc-capture"
+
 typedef struct _GstThetauvcsrc GstThetauvcsrc;
 typedef struct _GstThetauvcsrcClass GstThetauvcsrcClass;
+typedef struct _GstThetauvcsrcTiming GstThetauvcsrcTiming;
+typedef struct _GstThetauvcsrcStats GstThetauvcsrcStats;
 typedef enum
 {
     GST_THETAUVC_MODE_2K,
     GST_THETAUVC_MODE_4K
 } GstThetauvcModeEnum;
 
+typedef enum
+{
+    GST_THETAUVC_OVERFLOW_DROP_OLDEST_GOP,
+    GST_THETAUVC_OVERFLOW_DROP_TO_NEXT_IDR,
+    GST_THETAUVC_OVERFLOW_NEWEST_ONLY,
+    GST_THETAUVC_OVERFLOW_BLOCK
+} GstThetauvcOverflowEnum;
+
 GType   gst_thetauvc_mode_get_type(void);
+GType   gst_thetauvc_overflow_get_type(void);
+GType   gst_thetauvc_thread_policy_get_type(void);
+
+/* frame timestamp estimate, running time as a function of sequence */
+struct _GstThetauvcsrcTiming
+{
+    gboolean valid;
+    guint64 last_seq;
+    gdouble last;
+    gdouble period;
+};
+
+/* live statistics, each counter has a single writer */
+struct _GstThetauvcsrcStats
+{
+    /* written by cb() */
+    atomic_ullong received;
+    atomic_ullong received_bytes;
+    atomic_ullong max_size;
+    atomic_ullong gaps;
+    atomic_ullong lost;
+    atomic_uint high_water;
+    atomic_ullong late;
+    gboolean sequence_valid;
+    guint32 next_sequence;
+    GstClockTime last_arrival;
+
+    /* written by create() */
+    atomic_ullong pushed;
+    atomic_ullong latency_sum;
+    atomic_ullong latency_max;
+
+    /* written by the watchdog */
+    atomic_uint restarts;
+    atomic_uint resets;
+
+    /* set before streaming starts */
+    gint64  start;
+    guint64 dropped_base;
+
+    /* periodic message, rates are over the interval */
+    GstClockID tick;
+    gint64  last_time;
+    guint64 last_bytes;
+};
 
 struct _GstThetauvcsrc
 {
     GstPushSrc base_thetauvcsrc;
 
-    GMutex  lock;
-    GCond   cond;
-    GstQueueArray *queue;
+    GstThetauvcQueue *queue;
+    GstThetauvcOverflowEnum overflow_policy;
+    guint   max_size_buffers;
+    guint   max_size_bytes;
+    guint64 max_size_time;
+    guint64 timeout;
+    gboolean skip_to_idr;
+    gboolean need_discont;
+    guint   last_key_index;
 
     gint    device_number;
     gint    device_index;
     gchar  *serial;
     GstThetauvcModeEnum mode;
     GstCaps *current_caps;
+    /* all streams of the opened device */
+    GstCaps *device_caps;
     thetauvc_mode_t mode_val;
 
     uvc_context_t *ctx;
     uvc_device_t *dev;
     uvc_device_handle_t *devh;
     uvc_stream_ctrl_t ctrl;
+    uint8_t dev_bus, dev_addr;
+
+    /* where the frames come from, the device or a frame log */
+    const thetauvc_backend_t *backend;
+    thetauvc_replay_t *replay;
+    gchar  *replay_location;
+    gdouble replay_speed;
+    gboolean replay_loop;
+    gint    replay_eos;
+    /* written by cb() while streaming */
+    thetauvc_recorder_t *recorder;
+    gchar  *record_location;
+
+    /* shared libusb context, its thread handles the events */
+    GstThetauvcContext *context;
+    /* reference to the device cache and its watch */
+    gboolean has_devices;
+    guint   devices_watch;
+
+    /* reconnection after the device went away */
+    gboolean auto_reconnect;
+    GThread *reconnect_thread;
+    GMutex  reconnect_lock;
+    GCond   reconnect_cond;
+    gboolean reconnect_stop;
+    gboolean device_arrived;
+    gint    device_lost;
+    guint   reconnects;
+    GstClockTime gap_start;
+
+    /* stall recovery, shares reconnect_lock */
+    guint   watchdog;
+    GThread *watchdog_thread;
+    GCond   watchdog_cond;
+    gboolean watchdog_stop;
+    /* the watchdog resets the device without reconnect_lock held */
+    gboolean watchdog_resetting;
+
+    /* asynchronous start, stats are protected by the object lock */
+    GThread *bringup_thread;
+    GMutex  bringup_lock;
+    gboolean bringup_cancel;
+    GstStructure *bringup_stats;
 
     guint64 framecount;
     uint16_t dev_pid;
+    GstThetauvcsrcTiming timing;
+    GstThetauvcsrcStats stats;
+    guint   stats_interval;
+
+    /* encoder properties, object lock, 0 keeps the camera default */
+    guint   bitrate, max_bitrate;
+    guint   gop_length;
+    guint   qp;
+
+    /* scheduling of the callback, event and streaming threads */
+    GstThetauvcThreadPolicy thread_policy;
+    gint    thread_priority;
+    gchar  *cpu_affinity;
+    /* taken at start, cb() and create() apply it on their threads */
+    GstThetauvcThreadSched sched;
+    gboolean cb_sched;
+    GThread *create_thread;
+    /* the streaming thread is pooled, put back on LEAVE stream-status */
+    GstThetauvcThreadSaved create_saved;
+
+    /* frames pushed in the last pre-event-time, for dump */
+    GstThetauvcRing *ring;
+    guint64 pre_event_time;
+    guint   pre_event_max_bytes;
+
+    /* frames shared with thetauvcshmsrc in other processes */
+    GstThetauvcShmServer *shm;
+    gchar  *shm_socket_path;
+    guint   shm_size;
+
+    /* latest SPS/PPS, cb_sps/cb_pps are owned by the libuvc thread */
+    GBytes *cb_sps, *cb_pps;
+    GstBuffer *pending_headers;
+    GstBuffer *headers;
+    gint    config_interval;
+    GstClockTime last_config;
+    gboolean config_discont;
+
+    /* force-key-unit request waiting for an IDR frame, object lock */
+    gboolean key_unit_pending;
+    gboolean key_unit_all_headers;
+    guint   key_unit_count;
+
+    gboolean zero_copy;
+    GstAllocator *allocator;
+
+    GstBufferPool *pool;
+    GstBufferPool *pending_pool;
+    GstBufferPool *cb_pool;
+    guint   pool_size;
+    guint   cb_pool_size;
+    guint   pool_min, pool_max;
+    GstAllocator *pool_allocator;
+    GstAllocationParams pool_params;
+    guint   max_frame_size;
 };
 
 struct _GstThetauvcsrcClass
 {
     GstPushSrcClass base_thetauvcsrc_class;
+
+    /* action signals */
+    gboolean (*dump) (GstThetauvcsrc *, const gchar *, guint64);
 };
 
 GType   gst_thetauvcsrc_get_type(void);
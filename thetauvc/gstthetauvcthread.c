@@ -0,0 +1,217 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+
+/*
+ * Scheduling policy, priority and CPU affinity of the threads on the
+ * frame path.  Each thread applies them to itself, the threads of libuvc
+ * and GstTask are not reachable from outside.
+ */
+
+/* pthread_setaffinity_np() */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+#include "gstthetauvcthread.h"
+
+gboolean
+gst_thetauvc_thread_sched_is_set(const GstThetauvcThreadSched * sched)
+{
+    return sched->policy != GST_THETAUVC_THREAD_POLICY_DEFAULT
+	|| (sched->cpus != NULL && sched->cpus[0] != '\0');
+}
+
+void
+gst_thetauvc_thread_sched_copy(GstThetauvcThreadSched * dest,
+    const GstThetauvcThreadSched * src)
+{
+    g_free(dest->cpus);
+    dest->policy = src->policy;
+    dest->priority = src->priority;
+    dest->cpus = g_strdup(src->cpus);
+}
+
+void
+gst_thetauvc_thread_sched_clear(GstThetauvcThreadSched * sched)
+{
+    g_clear_pointer(&sched->cpus, g_free);
+    sched->policy = GST_THETAUVC_THREAD_POLICY_DEFAULT;
+    sched->priority = 0;
+}
+
+#if defined(__linux__)
+/* "0-3,6" to a CPU set */
+static  gboolean
+thread_parse_cpus(const gchar * list, cpu_set_t * set)
+{
+    gchar **ranges, *end;
+    guint64 first, last, i;
+    gboolean ok;
+    gint    n;
+
+    CPU_ZERO(set);
+    ranges = g_strsplit(list, ",", -1);
+    ok = ranges[0] != NULL;
+    for (n = 0; ok && ranges[n] != NULL; n++) {
+	g_strstrip(ranges[n]);
+	first = g_ascii_strtoull(ranges[n], &end, 10);
+	ok = end != ranges[n];
+	last = first;
+	if (ok && *end == '-') {
+	    gchar  *start = end + 1;
+
+	    last = g_ascii_strtoull(start, &end, 10);
+	    ok = end != start;
+	}
+	ok = ok && *end == '\0' && first <= last && last < CPU_SETSIZE;
+	for (i = first; ok && i <= last; i++)
+	    CPU_SET(i, set);
+    }
+    g_strfreev(ranges);
+
+    return ok;
+}
+#endif
+
+/* Apply to the calling thread, 0 or an errno value */
+gint
+gst_thetauvc_thread_sched_apply(const GstThetauvcThreadSched * sched)
+{
+    struct sched_param param = { 0 };
+    gint    policy, ret;
+#if defined(__linux__)
+    cpu_set_t set;
+
+    if (sched->cpus != NULL && sched->cpus[0] != '\0') {
+	if (!thread_parse_cpus(sched->cpus, &set))
+	    return EINVAL;
+	if ((ret = pthread_setaffinity_np(pthread_self(), sizeof(set),
+		    &set)) != 0)
+	    return ret;
+    }
+#else
+    if (sched->cpus != NULL && sched->cpus[0] != '\0')
+	return ENOTSUP;
+#endif
+
+    switch (sched->policy) {
+    case GST_THETAUVC_THREAD_POLICY_FIFO:
+    case GST_THETAUVC_THREAD_POLICY_RR:
+	policy = sched->policy == GST_THETAUVC_THREAD_POLICY_FIFO ?
+	    SCHED_FIFO : SCHED_RR;
+	param.sched_priority = sched->priority;
+	return pthread_setschedparam(pthread_self(), policy, &param);
+
+    case GST_THETAUVC_THREAD_POLICY_OTHER:
+	if ((ret = pthread_setschedparam(pthread_self(), SCHED_OTHER,
+		    &param)) != 0)
+	    return ret;
+#if defined(__linux__)
+	/* the nice value is per thread on Linux */
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+		sched->priority) != 0)
+	    return errno;
+#endif
+	return 0;
+
+    case GST_THETAUVC_THREAD_POLICY_DEFAULT:
+    default:
+	return 0;
+    }
+}
+
+/* Save the scheduling of the calling thread before changing it */
+gint
+gst_thetauvc_thread_save(GstThetauvcThreadSaved * saved)
+{
+    struct sched_param param;
+    gint    ret;
+
+    if ((ret = pthread_getschedparam(pthread_self(), &saved->policy,
+		&param)) != 0)
+	return ret;
+    saved->priority = param.sched_priority;
+    saved->nice = 0;
+#if defined(__linux__)
+    errno = 0;
+    saved->nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    if (saved->nice == -1 && errno != 0)
+	return errno;
+
+    g_free(saved->cpus);
+    saved->cpus = g_new(cpu_set_t, 1);
+    if ((ret = pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		saved->cpus)) != 0) {
+	g_clear_pointer(&saved->cpus, g_free);
+	return ret;
+    }
+#endif
+    saved->saved = TRUE;
+
+    return 0;
+}
+
+/* Put back what gst_thetauvc_thread_save() took, on the same thread */
+gint
+gst_thetauvc_thread_restore(GstThetauvcThreadSaved * saved)
+{
+    struct sched_param param = { 0 };
+    gint    ret = 0, err;
+
+    if (!saved->saved)
+	return 0;
+    saved->saved = FALSE;
+
+    param.sched_priority = saved->priority;
+    if ((err = pthread_setschedparam(pthread_self(), saved->policy,
+		&param)) != 0)
+	ret = err;
+#if defined(__linux__)
+    if (saved->policy == SCHED_OTHER || saved->policy == SCHED_BATCH
+	|| saved->policy == SCHED_IDLE) {
+	if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), saved->nice) != 0
+	    && ret == 0)
+	    ret = errno;
+    }
+    if (saved->cpus != NULL) {
+	if ((err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		    saved->cpus)) != 0 && ret == 0)
+	    ret = err;
+	g_clear_pointer(&saved->cpus, g_free);
+    }
+#endif
+
+    return ret;
+}
@@ -0,0 +1,69 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef _GST_THETAUVCTHREAD_H_
+#define _GST_THETAUVCTHREAD_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstThetauvcThreadSched GstThetauvcThreadSched;
+typedef struct _GstThetauvcThreadSaved GstThetauvcThreadSaved;
+
+typedef enum
+{
+    GST_THETAUVC_THREAD_POLICY_DEFAULT,
+    GST_THETAUVC_THREAD_POLICY_OTHER,
+    GST_THETAUVC_THREAD_POLICY_FIFO,
+    GST_THETAUVC_THREAD_POLICY_RR
+} GstThetauvcThreadPolicy;
+
+/* scheduling of a thread, applied by the thread itself */
+struct _GstThetauvcThreadSched
+{
+    GstThetauvcThreadPolicy policy;
+    /* real-time priority, or nice value for the other policy */
+    gint    priority;
+    /* CPU list such as "0-3,6", NULL for any CPU */
+    gchar  *cpus;
+};
+
+/* scheduling of a borrowed thread, to hand it back as it was */
+struct _GstThetauvcThreadSaved
+{
+    gboolean saved;
+    gint    policy;
+    gint    priority;
+    gint    nice;
+    /* cpu_set_t, NULL when the affinity was not saved */
+    gpointer cpus;
+};
+
+gboolean gst_thetauvc_thread_sched_is_set(const GstThetauvcThreadSched *);
+void    gst_thetauvc_thread_sched_copy(GstThetauvcThreadSched *,
+    const GstThetauvcThreadSched *);
+void    gst_thetauvc_thread_sched_clear(GstThetauvcThreadSched *);
+gint    gst_thetauvc_thread_sched_apply(const GstThetauvcThreadSched *);
+gint    gst_thetauvc_thread_save(GstThetauvcThreadSaved *);
+gint    gst_thetauvc_thread_restore(GstThetauvcThreadSaved *);
+
+G_END_DECLS
+#endif
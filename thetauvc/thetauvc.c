@@ -38,6 +38,21 @@
 #include "libuvc/libuvc.h"
 #include "thetauvc.h"
 
+/* UVC 1.5 class-specific descriptors and controls, not all in libuvc */
+#define THETAUVC_SC_VIDEOCONTROL 0x01
+#define THETAUVC_CS_INTERFACE 0x24
+#define THETAUVC_VC_ENCODING_UNIT 0x07
+#define THETAUVC_EU_RATE_CONTROL_MODE_CONTROL 0x06
+#define THETAUVC_EU_AVERAGE_BITRATE_CONTROL 0x07
+#define THETAUVC_EU_PEAK_BIT_RATE_CONTROL 0x09
+#define THETAUVC_EU_QUANTIZATION_PARAMS_CONTROL 0x0a
+#define THETAUVC_EU_SYNC_REF_FRAME_CONTROL 0x0b
+
+/* bRateControlMode */
+#define THETAUVC_EU_RATE_CBR 0x01
+#define THETAUVC_EU_RATE_VBR 0x02
+#define THETAUVC_EU_RATE_CONSTANT_QP 0x03
+
 static thetauvc_mode_t stream_mode[] = {
     {
      .mode = THETAUVC_MODE_UHD,
@@ -65,7 +80,7 @@ static thetauvc_mode_t stream_mode[] = {
      }
 };
 
-static const char iProduct[] = "RICOH THETA";
+static const char iProduct[] = THETAUVC_PRODUCT_PREFIX;
 
 uvc_error_t
 thetauvc_find_devices(uvc_context_t * ctx, uvc_device_t *** devs)
@@ -261,15 +276,51 @@ thetauvc_get_stream_ctrl_format_size(uvc_device_handle_t * devh,
     return res;
 }
 
+const thetauvc_mode_t *
+thetauvc_get_mode(unsigned int mode)
+{
+    int     i;
+
+    for (i = 0; i < THETAUVC_MODE_NUM; i++) {
+	if (stream_mode[i].mode == mode)
+	    return &stream_mode[i];
+    }
+
+    return NULL;
+}
+
+/* THETA S streams 1920x1080 only, the later models 4K and 2K */
+int
+thetauvc_mode_supported(uint16_t pid, unsigned int mode)
+{
+    if (pid == USBPID_THETAS_UVC)
+	return mode == THETAUVC_MODE_FHD_S;
+
+    return mode == THETAUVC_MODE_UHD || mode == THETAUVC_MODE_FHD;
+}
+
+/*
+ * Select configuration ncfg of the device at bus/addr.  A private libusb
+ * context is used if ctx is NULL.
+ */
 uvc_error_t
-thetauvc_switch_configuration(uint8_t bus, uint8_t addr, uint8_t ncfg)
+thetauvc_switch_configuration(libusb_context * ctx, uint8_t bus, uint8_t addr,
+			      uint8_t ncfg)
 {
-    libusb_context *ctx;
+    libusb_context *own_ctx;
     libusb_device_handle *devh;
     libusb_device **udev, *dev;
+    uvc_error_t res;
     int cfg, sz, i;
 
-    libusb_init(&ctx);
+    own_ctx = NULL;
+    if (ctx == NULL) {
+	if (libusb_init(&own_ctx) != LIBUSB_SUCCESS)
+	    return UVC_ERROR_OTHER;
+	ctx = own_ctx;
+    }
+
+    res = UVC_SUCCESS;
     sz = libusb_get_device_list(ctx, &udev);
     for (i = 0; i < sz; i++) {
 	dev = udev[i];
@@ -279,22 +330,213 @@ thetauvc_switch_configuration(uint8_t bus, uint8_t addr, uint8_t ncfg)
 	    break;
     }
 
-    if (i == sz)
-        return UVC_ERROR_INVALID_PARAM;
+    if (i >= sz) {
+	res = UVC_ERROR_INVALID_PARAM;
+    } else if (libusb_open(dev, &devh) != LIBUSB_SUCCESS) {
+	res = UVC_ERROR_ACCESS;
+    } else {
+	libusb_get_configuration(devh, &cfg);
 
-    libusb_open(dev, &devh);
-    libusb_get_configuration(devh, &cfg);
+	if (cfg != ncfg) {
+	    libusb_detach_kernel_driver(devh, 0);
+	    libusb_detach_kernel_driver(devh, 2);
+	    libusb_detach_kernel_driver(devh, 3);
+	    libusb_set_configuration(devh, ncfg);
+	}
 
-    if (cfg != ncfg) {
-        libusb_detach_kernel_driver(devh, 0);
-	libusb_detach_kernel_driver(devh, 2);
-	libusb_detach_kernel_driver(devh, 3);
-	libusb_set_configuration(devh, ncfg);
+	libusb_close(devh);
     }
 
-    libusb_close(devh);
-    libusb_free_device_list(udev, 1);
-    libusb_exit(ctx);
+    if (sz >= 0)
+	libusb_free_device_list(udev, 1);
+    if (own_ctx != NULL)
+	libusb_exit(own_ctx);
 
-    return UVC_SUCCESS;
+    return res;
+}
+
+/*
+ * ID of the UVC 1.5 encoding unit of the device, 0 if it has none.  The
+ * unit is looked up in the class-specific descriptors of the video control
+ * interface, libuvc does not parse it.
+ */
+int
+thetauvc_get_encoding_unit(uvc_device_handle_t * devh)
+{
+    struct libusb_config_descriptor *config;
+    const struct libusb_interface_descriptor *intf;
+    const unsigned char *p, *end;
+    int unit, i, j;
+
+    if (libusb_get_active_config_descriptor(
+	libusb_get_device(uvc_get_libusb_handle(devh)), &config) != 0)
+	return 0;
+
+    unit = 0;
+    for (i = 0; unit == 0 && i < config->bNumInterfaces; i++) {
+	for (j = 0; unit == 0 && j < config->interface[i].num_altsetting;
+	     j++) {
+	    intf = &config->interface[i].altsetting[j];
+	    if (intf->bInterfaceClass != LIBUSB_CLASS_VIDEO
+		|| intf->bInterfaceSubClass != THETAUVC_SC_VIDEOCONTROL)
+		continue;
+
+	    p = intf->extra;
+	    end = p + intf->extra_length;
+	    for (; p + 4 <= end && p[0] >= 4 && p + p[0] <= end; p += p[0]) {
+		if (p[1] == THETAUVC_CS_INTERFACE
+		    && p[2] == THETAUVC_VC_ENCODING_UNIT) {
+		    unit = p[3];
+		    break;
+		}
+	    }
+	}
+    }
+    libusb_free_config_descriptor(config);
+
+    return unit;
+}
+
+/*
+ * Ask the encoder for an IDR frame now, through the synchronization
+ * frame control of the encoding unit.
+ */
+uvc_error_t
+thetauvc_request_key_frame(uvc_device_handle_t * devh)
+{
+    /* bSyncFrameType: IDR, wSyncFrameInterval: once, bGradualDecoderRefresh */
+    uint8_t data[4] = { 1, 0, 0, 0 };
+    int unit, ret;
+
+    if ((unit = thetauvc_get_encoding_unit(devh)) == 0)
+	return UVC_ERROR_NOT_SUPPORTED;
+
+    ret = uvc_set_ctrl(devh, unit, THETAUVC_EU_SYNC_REF_FRAME_CONTROL, data,
+		       sizeof(data));
+
+    return ret < 0 ? ret : UVC_SUCCESS;
+}
+
+/* Little endian fields of control requests and frame logs */
+void
+thetauvc_put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
 }
+
+void
+thetauvc_put_le32(uint8_t *p, uint32_t v)
+{
+    thetauvc_put_le16(p, v & 0xffff);
+    thetauvc_put_le16(p + 2, v >> 16);
+}
+
+static int
+set_eu_ctrl(uvc_device_handle_t * devh, int unit, uint8_t selector,
+	    uint8_t *data, int len, int ret)
+{
+    int res;
+
+    res = uvc_set_ctrl(devh, unit, selector, data, len);
+
+    /* the first error, the other controls are still tried */
+    return (ret < 0 || res >= 0) ? ret : res;
+}
+
+/*
+ * Program the H.264 encoder through the encoding unit.  Constant QP is
+ * used when qp is set, VBR when the peak bitrate is above the average,
+ * CBR otherwise.  gop_length is set as the interval of periodic IDR
+ * frames.
+ */
+uvc_error_t
+thetauvc_set_encoder(uvc_device_handle_t * devh,
+		     const thetauvc_encoder_t * enc)
+{
+    uint8_t data[6];
+    uint32_t ms;
+    int unit, ret;
+
+    if ((unit = thetauvc_get_encoding_unit(devh)) == 0)
+	return UVC_ERROR_NOT_SUPPORTED;
+
+    ret = 0;
+    data[0] = 0;
+    if (enc->qp > 0)
+	data[0] = THETAUVC_EU_RATE_CONSTANT_QP;
+    else if (enc->max_bitrate > enc->bitrate)
+	data[0] = THETAUVC_EU_RATE_VBR;
+    else if (enc->bitrate > 0)
+	data[0] = THETAUVC_EU_RATE_CBR;
+    if (data[0] != 0)
+	ret = set_eu_ctrl(devh, unit, THETAUVC_EU_RATE_CONTROL_MODE_CONTROL,
+			  data, 1, ret);
+
+    if (enc->qp > 0) {
+	/* wQpPrime_I, wQpPrime_P, wQpPrime_B */
+	thetauvc_put_le16(data, enc->qp);
+	thetauvc_put_le16(data + 2, enc->qp);
+	thetauvc_put_le16(data + 4, enc->qp);
+	ret = set_eu_ctrl(devh, unit, THETAUVC_EU_QUANTIZATION_PARAMS_CONTROL,
+			  data, 6, ret);
+    }
+
+    if (enc->bitrate > 0) {
+	thetauvc_put_le32(data, enc->bitrate);
+	ret = set_eu_ctrl(devh, unit, THETAUVC_EU_AVERAGE_BITRATE_CONTROL,
+			  data, 4, ret);
+    }
+
+    if (enc->max_bitrate > 0) {
+	thetauvc_put_le32(data, enc->max_bitrate);
+	ret = set_eu_ctrl(devh, unit, THETAUVC_EU_PEAK_BIT_RATE_CONTROL,
+			  data, 4, ret);
+    }
+
+    if (enc->gop_length > 0 && enc->frame_interval > 0) {
+	/* wSyncFrameInterval is in ms */
+	ms = (uint64_t) enc->gop_length * enc->frame_interval / 10000;
+	data[0] = 1;
+	thetauvc_put_le16(data + 1, ms > 0xffff ? 0xffff : (ms > 0 ? ms : 1));
+	data[3] = 0;
+	ret = set_eu_ctrl(devh, unit, THETAUVC_EU_SYNC_REF_FRAME_CONTROL,
+			  data, 4, ret);
+    }
+
+    return ret < 0 ? ret : UVC_SUCCESS;
+}
+
+static uvc_error_t
+backend_uvc_start(void *handle, uvc_stream_ctrl_t * ctrl,
+		  uvc_frame_callback_t * cb, void *user_ptr)
+{
+    return uvc_start_streaming((uvc_device_handle_t *) handle, ctrl, cb,
+			       user_ptr, 0);
+}
+
+static void
+backend_uvc_stop(void *handle)
+{
+    uvc_stop_streaming((uvc_device_handle_t *) handle);
+}
+
+static uvc_error_t
+backend_uvc_request_key_frame(void *handle)
+{
+    return thetauvc_request_key_frame((uvc_device_handle_t *) handle);
+}
+
+static uvc_error_t
+backend_uvc_set_encoder(void *handle, const thetauvc_encoder_t * enc)
+{
+    return thetauvc_set_encoder((uvc_device_handle_t *) handle, enc);
+}
+
+const thetauvc_backend_t thetauvc_backend_uvc = {
+    .name = "uvc",
+    .start_streaming = backend_uvc_start,
+    .stop_streaming = backend_uvc_stop,
+    .request_key_frame = backend_uvc_request_key_frame,
+    .set_encoder = backend_uvc_set_encoder,
+};
@@ -42,6 +42,9 @@ extern "C" {
 #define USBPID_THETAZ1_UVC 0x2715
 #define USBPID_THETAX_UVC 0x2717
 
+/* iProduct of all THETA models starts with this */
+#define THETAUVC_PRODUCT_PREFIX "RICOH THETA"
+
 enum thetauvc_mode_code {
 	THETAUVC_MODE_FHD = 0,
 	THETAUVC_MODE_UHD,
@@ -59,6 +62,38 @@ struct thetauvc_mode
 
 typedef struct thetauvc_mode thetauvc_mode_t;
 
+/* H.264 encoder settings, fields left 0 are not changed */
+struct thetauvc_encoder
+{
+    uint32_t bitrate;		/* average, bit/s */
+    uint32_t max_bitrate;	/* peak, bit/s */
+    uint32_t gop_length;	/* frames from an IDR frame to the next */
+    uint32_t frame_interval;	/* 100ns, for gop_length */
+    uint8_t qp;			/* constant QP, overrides the bitrates */
+};
+
+typedef struct thetauvc_encoder thetauvc_encoder_t;
+
+/*
+ * Source of frames for a libuvc frame callback.  The handle is a
+ * uvc_device_handle_t for thetauvc_backend_uvc.
+ */
+struct thetauvc_backend
+{
+    const char *name;
+    uvc_error_t (*start_streaming)(void *, uvc_stream_ctrl_t *,
+	uvc_frame_callback_t *, void *);
+    void    (*stop_streaming)(void *);
+    /* IDR frame as soon as possible */
+    uvc_error_t (*request_key_frame)(void *);
+    /* NULL if the frames cannot be encoded differently */
+    uvc_error_t (*set_encoder)(void *, const thetauvc_encoder_t *);
+};
+
+typedef struct thetauvc_backend thetauvc_backend_t;
+
+extern const thetauvc_backend_t thetauvc_backend_uvc;
+
 extern uvc_error_t thetauvc_find_devices(uvc_context_t *, uvc_device_t ***);
 extern uvc_error_t thetauvc_print_devices(uvc_context_t *, FILE *);
 extern uvc_error_t thetauvc_find_device(uvc_context_t *, uvc_device_t **,
@@ -69,7 +104,16 @@ extern uvc_error_t thetauvc_get_stream_ctrl_format_size(uvc_device_handle_t *,
 	unsigned int, uvc_stream_ctrl_t *, thetauvc_mode_t *);
 extern uvc_error_t thetauvc_run_streaming(uvc_device_t *, uvc_device_handle_t **,
 	unsigned int, uvc_frame_callback_t *, void *);
-extern uvc_error_t thetauvc_switch_configuration(uint8_t, uint8_t, uint8_t);
+extern uvc_error_t thetauvc_switch_configuration(libusb_context *, uint8_t,
+	uint8_t, uint8_t);
+extern const thetauvc_mode_t *thetauvc_get_mode(unsigned int);
+extern int thetauvc_mode_supported(uint16_t, unsigned int);
+extern int thetauvc_get_encoding_unit(uvc_device_handle_t *);
+extern uvc_error_t thetauvc_request_key_frame(uvc_device_handle_t *);
+extern uvc_error_t thetauvc_set_encoder(uvc_device_handle_t *,
+	const thetauvc_encoder_t *);
+extern void thetauvc_put_le16(uint8_t *, uint16_t);
+extern void thetauvc_put_le32(uint8_t *, uint32_t);
 
 #if defined(__cplsplus)
 }
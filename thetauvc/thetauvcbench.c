@@ -0,0 +1,564 @@
+/* GStreamer
+ * Copyright (C) 2021 Koji TAKEO <nickel110@icloud.com>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/*
+ * Benchmark of thetauvcsrc.
+ *
+ * Runs one "thetauvcsrc ! fakesink" pipeline per simulated camera, all
+ * replaying a synthetic frame log (or a recorded one), and reports for
+ * each configuration:
+ *
+ *   latency   time from the frame callback until create() returns the
+ *             frame, taken at the source pad, percentiles in us
+ *   MB/s      data pushed by all sources
+ *   cb MB/s   data handled per second spent in the frame callback, the
+ *             copy bandwidth unless zero-copy is set
+ *   alloc/f   malloc(), calloc() and realloc() calls per frame, process
+ *             wide
+ *   wait/f    time create() slept for a frame and the callback for room
+ *             in the queue, us per frame
+ *   drops     frames dropped by the queue
+ *   late      frames the replay delivered over a frame interval late
+ *
+ * The element is linked in rather than loaded, so its queue and replay
+ * counters can be read directly.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include "gstthetauvcsrc.h"
+
+/* synthetic stream, 29.97 fps with an IDR frame every second */
+#define BENCH_INTERVAL 333667
+#define BENCH_GOP 30
+#define BENCH_IDR_RATIO 4
+#define BENCH_LOG_FRAMES (BENCH_GOP * 2)
+
+/* 1 us buckets, the last one takes everything above */
+#define BENCH_LATENCY_BUCKETS 100000
+
+typedef struct _BenchCamera BenchCamera;
+typedef struct _BenchCounters BenchCounters;
+
+struct _BenchCamera
+{
+    GstElement *pipeline;
+    GstElement *src;
+
+    /* written by the streaming thread while measuring */
+    gint    measuring;
+    guint64 frames;
+    guint64 bytes;
+    guint64 latency_max;
+    guint32 *latency;
+};
+
+/* source side counters, summed over the cameras */
+struct _BenchCounters
+{
+    guint64 dropped;
+    guint64 wait_time;
+    guint64 space_wait_time;
+    guint64 replay_bytes;
+    guint64 callback_ns;
+    guint64 late;
+    guint64 allocs;
+};
+
+static gint bench_duration = 5;
+static gint bench_warmup = 1;
+static gint bench_cameras = 0;
+static gchar *bench_mode = NULL;
+static gint bench_bitrate_2k = 16000;
+static gint bench_bitrate_4k = 56000;
+static gdouble bench_speed = 1.0;
+static gboolean bench_zero_copy = FALSE;
+static gchar *bench_log = NULL;
+static gchar **bench_props = NULL;
+
+static GOptionEntry bench_options[] = {
+    {"mode", 'm', 0, G_OPTION_ARG_STRING, &bench_mode,
+	"Stream mode of the synthetic log, 2K or 4K (default: both)", "MODE"},
+    {"cameras", 'c', 0, G_OPTION_ARG_INT, &bench_cameras,
+	"Number of simulated cameras (default: 1, 2, 4, 8 and 16)", "N"},
+    {"duration", 'd', 0, G_OPTION_ARG_INT, &bench_duration,
+	"Seconds measured per configuration (default: 5)", "S"},
+    {"warmup", 'w', 0, G_OPTION_ARG_INT, &bench_warmup,
+	"Seconds run before measuring (default: 1)", "S"},
+    {"bitrate-2k", 0, 0, G_OPTION_ARG_INT, &bench_bitrate_2k,
+	"Bit rate of the synthetic 2K stream in kbit/s (default: 16000)",
+	"KBPS"},
+    {"bitrate-4k", 0, 0, G_OPTION_ARG_INT, &bench_bitrate_4k,
+	"Bit rate of the synthetic 4K stream in kbit/s (default: 56000)",
+	"KBPS"},
+    {"speed", 's', 0, G_OPTION_ARG_DOUBLE, &bench_speed,
+	"Replay speed, 0 for as fast as possible (default: 1)", "X"},
+    {"zero-copy", 'z', 0, G_OPTION_ARG_NONE, &bench_zero_copy,
+	"Set zero-copy on the sources", NULL},
+    {"log", 'l', 0, G_OPTION_ARG_FILENAME, &bench_log,
+	"Replay this frame log instead of a synthetic one", "FILE"},
+    {"set", 'o', 0, G_OPTION_ARG_STRING_ARRAY, &bench_props,
+	"Set a property of the sources, may be repeated", "NAME=VALUE"},
+    {NULL}
+};
+
+static GstCaps *capture_caps;
+static atomic_ullong allocs;
+
+#if defined(__GLIBC__)
+/* count the allocations of the whole process */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void   *
+malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void   *
+calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void   *
+realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&allocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+#define BENCH_COUNT_ALLOCS 1
+#endif
+
+/*
+ * Write a frame log of BENCH_LOG_FRAMES frames.  The frames are byte
+ * streams of the NAL types the source looks at, SPS/PPS in front of the
+ * IDR frames, with filler free of start codes.
+ */
+static  gboolean
+bench_write_log(const gchar * path, unsigned int mode, gint kbps)
+{
+    static const guint8 sps[] = {
+	0, 0, 0, 1, 0x67, 0x64, 0x00, 0x33, 0xac, 0x2b, 0x40, 0x3c, 0x01, 0xf3
+    };
+    static const guint8 pps[] = { 0, 0, 0, 1, 0x68, 0xee, 0x3c, 0xb0 };
+    static const guint8 idr[] = { 0, 0, 0, 1, 0x65, 0x88 };
+    static const guint8 slice[] = { 0, 0, 0, 1, 0x41, 0x9a };
+    thetauvc_recorder_t *rec;
+    uvc_frame_t frame;
+    guint8 *data;
+    gsize   size_p, size_idr, hdr, i;
+    guint32 x;
+    gboolean ok;
+
+    /* average frame size, IDR frames BENCH_IDR_RATIO times the others */
+    size_p = (guint64) kbps * 1000 / 8 * BENCH_INTERVAL / 10000000;
+    size_p = size_p * BENCH_GOP / (BENCH_GOP + BENCH_IDR_RATIO - 1);
+    size_idr = size_p * BENCH_IDR_RATIO;
+
+    data = g_malloc(size_idr);
+    for (x = 2463534242u, i = 0; i < size_idr; i++) {
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	data[i] = x | 0x80;
+    }
+
+    if (thetauvc_recorder_open(path, USBPID_THETAV_UVC,
+	    thetauvc_get_mode(mode), BENCH_INTERVAL, &rec) != UVC_SUCCESS) {
+	g_free(data);
+	return FALSE;
+    }
+
+    memset(&frame, 0, sizeof(frame));
+    frame.data = data;
+    ok = TRUE;
+    for (i = 0; ok && i < BENCH_LOG_FRAMES; i++) {
+	if (i % BENCH_GOP == 0) {
+	    hdr = 0;
+	    memcpy(data + hdr, sps, sizeof(sps));
+	    hdr += sizeof(sps);
+	    memcpy(data + hdr, pps, sizeof(pps));
+	    hdr += sizeof(pps);
+	    memcpy(data + hdr, idr, sizeof(idr));
+	    frame.data_bytes = size_idr;
+	} else {
+	    memcpy(data, slice, sizeof(slice));
+	    frame.data_bytes = size_p;
+	}
+	frame.sequence = i;
+	ok = thetauvc_recorder_write(rec, &frame,
+	    (uint64_t) i * BENCH_INTERVAL * 100) == UVC_SUCCESS;
+    }
+    thetauvc_recorder_close(rec);
+    g_free(data);
+
+    return ok;
+}
+
+/* Frames leaving create(), on the streaming thread */
+static  GstPadProbeReturn
+bench_probe(GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+    BenchCamera *cam = user_data;
+    GstReferenceTimestampMeta *meta;
+    GstBuffer *buf = GST_PAD_PROBE_INFO_BUFFER(info);
+    guint64 now, latency;
+
+    if (!g_atomic_int_get(&cam->measuring))
+	return GST_PAD_PROBE_OK;
+
+    now = g_get_monotonic_time() * GST_USECOND;
+    meta = gst_buffer_get_reference_timestamp_meta(buf, capture_caps);
+    if (meta == NULL)
+	return GST_PAD_PROBE_OK;
+    latency = now > meta->timestamp ? now - meta->timestamp : 0;
+    if (latency > cam->latency_max)
+	cam->latency_max = latency;
+    cam->latency[MIN(latency / GST_USECOND, BENCH_LATENCY_BUCKETS - 1)]++;
+
+    return GST_PAD_PROBE_OK;
+}
+
+static void
+bench_handoff(GstElement * sink, GstBuffer * buf, GstPad * pad,
+    gpointer user_data)
+{
+    BenchCamera *cam = user_data;
+
+    if (!g_atomic_int_get(&cam->measuring))
+	return;
+
+    cam->frames++;
+    cam->bytes += gst_buffer_get_size(buf);
+}
+
+static  gboolean
+bench_camera_init(BenchCamera * cam, const gchar * path)
+{
+    GstElement *sink;
+    GstPad *pad;
+    gchar **prop, **kv;
+
+    cam->pipeline = gst_pipeline_new(NULL);
+    cam->src = gst_element_factory_make("thetauvcsrc", NULL);
+    sink = gst_element_factory_make("fakesink", NULL);
+    if (cam->src == NULL || sink == NULL) {
+	g_printerr("could not create the elements\n");
+	return FALSE;
+    }
+
+    g_object_set(cam->src, "replay-location", path, "replay-speed",
+	bench_speed, "replay-loop", TRUE, "zero-copy", bench_zero_copy, NULL);
+    for (prop = bench_props; prop != NULL && *prop != NULL; prop++) {
+	kv = g_strsplit(*prop, "=", 2);
+	if (kv[0] == NULL || kv[1] == NULL
+	    || !g_object_class_find_property(G_OBJECT_GET_CLASS(cam->src),
+		kv[0])) {
+	    g_printerr("bad property %s\n", *prop);
+	    g_strfreev(kv);
+	    return FALSE;
+	}
+	gst_util_set_object_arg(G_OBJECT(cam->src), kv[0], kv[1]);
+	g_strfreev(kv);
+    }
+    g_object_set(sink, "sync", FALSE, "signal-handoffs", TRUE, NULL);
+    g_signal_connect(sink, "handoff", G_CALLBACK(bench_handoff), cam);
+    pad = gst_element_get_static_pad(cam->src, "src");
+    gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER, bench_probe, cam, NULL);
+    gst_object_unref(pad);
+
+    gst_bin_add_many(GST_BIN(cam->pipeline), cam->src, sink, NULL);
+    if (!gst_element_link(cam->src, sink)) {
+	g_printerr("could not link thetauvcsrc to fakesink\n");
+	return FALSE;
+    }
+    cam->latency = g_new0(guint32, BENCH_LATENCY_BUCKETS);
+
+    return TRUE;
+}
+
+static void
+bench_camera_clear(BenchCamera * cam)
+{
+    if (cam->pipeline != NULL) {
+	gst_element_set_state(cam->pipeline, GST_STATE_NULL);
+	gst_object_unref(cam->pipeline);
+    }
+    g_free(cam->latency);
+}
+
+/* Counters of the running sources, must be taken before they stop */
+static void
+bench_counters(BenchCamera * cams, gint n, BenchCounters * c)
+{
+    GstThetauvcsrc *src;
+    thetauvc_replay_stats_t stats;
+    gint    i;
+
+    memset(c, 0, sizeof(*c));
+    for (i = 0; i < n; i++) {
+	src = GST_THETAUVCSRC(cams[i].src);
+	c->dropped += atomic_load(&src->queue->dropped);
+	c->wait_time += atomic_load(&src->queue->wait_time);
+	c->space_wait_time += atomic_load(&src->queue->space_wait_time);
+	if (src->replay != NULL) {
+	    thetauvc_replay_get_stats(src->replay, &stats);
+	    c->replay_bytes += stats.bytes;
+	    c->callback_ns += stats.callback_ns;
+	    c->late += stats.late;
+	}
+    }
+    c->allocs = atomic_load(&allocs);
+}
+
+/* Latency in us at the given fraction of the samples */
+static  guint64
+bench_percentile(const guint32 * hist, guint64 total, gdouble p)
+{
+    guint64 rank, count;
+    guint   i;
+
+    rank = (guint64) (total * p);
+    for (count = 0, i = 0; i < BENCH_LATENCY_BUCKETS - 1; i++) {
+	count += hist[i];
+	if (count > rank)
+	    break;
+    }
+
+    return i;
+}
+
+static  gboolean
+bench_post_errors(BenchCamera * cams, gint n)
+{
+    GstMessage *msg;
+    GError *err;
+    gchar  *dbg;
+    gboolean ok;
+    gint    i;
+
+    ok = TRUE;
+    for (i = 0; i < n; i++) {
+	GstBus *bus = gst_element_get_bus(cams[i].pipeline);
+
+	while ((msg = gst_bus_pop_filtered(bus, GST_MESSAGE_ERROR)) != NULL) {
+	    gst_message_parse_error(msg, &err, &dbg);
+	    g_printerr("camera %d: %s (%s)\n", i, err->message,
+		dbg != NULL ? dbg : "");
+	    g_clear_error(&err);
+	    g_free(dbg);
+	    gst_message_unref(msg);
+	    ok = FALSE;
+	}
+	gst_object_unref(bus);
+    }
+
+    return ok;
+}
+
+static  gboolean
+bench_run(const gchar * path, const gchar * label, gint n)
+{
+    BenchCamera *cams;
+    BenchCounters before, after;
+    guint32 *hist;
+    guint64 frames, bytes, latency_max, allocs_delta;
+    gint64  start, elapsed;
+    gboolean ok;
+    gint    i, j;
+
+    cams = g_new0(BenchCamera, n);
+    ok = TRUE;
+    for (i = 0; ok && i < n; i++)
+	ok = bench_camera_init(&cams[i], path);
+
+    for (i = 0; ok && i < n; i++) {
+	if (gst_element_set_state(cams[i].pipeline,
+		GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE)
+	    ok = FALSE;
+    }
+    for (i = 0; ok && i < n; i++) {
+	if (gst_element_get_state(cams[i].pipeline, NULL, NULL,
+		10 * GST_SECOND) != GST_STATE_CHANGE_SUCCESS)
+	    ok = FALSE;
+    }
+    if (!ok) {
+	bench_post_errors(cams, n);
+	g_printerr("%s x%d: could not start\n", label, n);
+	goto out;
+    }
+
+    g_usleep((gulong) bench_warmup * G_USEC_PER_SEC);
+
+    bench_counters(cams, n, &before);
+    for (i = 0; i < n; i++)
+	g_atomic_int_set(&cams[i].measuring, 1);
+    start = g_get_monotonic_time();
+    g_usleep((gulong) bench_duration * G_USEC_PER_SEC);
+    for (i = 0; i < n; i++)
+	g_atomic_int_set(&cams[i].measuring, 0);
+    elapsed = g_get_monotonic_time() - start;
+    bench_counters(cams, n, &after);
+    allocs_delta = after.allocs - before.allocs;
+
+    if (!bench_post_errors(cams, n)) {
+	ok = FALSE;
+	goto out;
+    }
+    for (i = 0; i < n; i++)
+	gst_element_set_state(cams[i].pipeline, GST_STATE_NULL);
+
+    hist = g_new0(guint32, BENCH_LATENCY_BUCKETS);
+    frames = bytes = latency_max = 0;
+    for (i = 0; i < n; i++) {
+	frames += cams[i].frames;
+	bytes += cams[i].bytes;
+	latency_max = MAX(latency_max, cams[i].latency_max);
+	for (j = 0; j < BENCH_LATENCY_BUCKETS; j++)
+	    hist[j] += cams[i].latency[j];
+    }
+
+    g_print("%-4s %4d %8" G_GUINT64_FORMAT " %7.2f %8.2f %8.1f"
+	" %7" G_GUINT64_FORMAT " %7" G_GUINT64_FORMAT " %7" G_GUINT64_FORMAT
+	" %7" G_GUINT64_FORMAT " %7" G_GUINT64_FORMAT,
+	label, n, frames, (gdouble) frames * G_USEC_PER_SEC / elapsed / n,
+	(gdouble) bytes / elapsed,
+	after.callback_ns > before.callback_ns ?
+	(gdouble) (after.replay_bytes - before.replay_bytes) * 1000 /
+	(after.callback_ns - before.callback_ns) : 0.0,
+	bench_percentile(hist, frames, 0.5),
+	bench_percentile(hist, frames, 0.9),
+	bench_percentile(hist, frames, 0.99),
+	bench_percentile(hist, frames, 0.999), latency_max / GST_USECOND);
+#if defined(BENCH_COUNT_ALLOCS)
+    g_print(" %7.1f", frames ? (gdouble) allocs_delta / frames : 0.0);
+#else
+    g_print(" %7s", "-");
+#endif
+    g_print(" %7.1f %7.1f %6" G_GUINT64_FORMAT " %6" G_GUINT64_FORMAT "\n",
+	frames ? (gdouble) (after.wait_time - before.wait_time) / frames : 0.0,
+	frames ? (gdouble) (after.space_wait_time - before.space_wait_time) /
+	frames : 0.0, after.dropped - before.dropped, after.late - before.late);
+    g_free(hist);
+
+  out:
+    for (i = 0; i < n; i++)
+	bench_camera_clear(&cams[i]);
+    g_free(cams);
+
+    return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const gint camera_counts[] = { 1, 2, 4, 8, 16 };
+    GOptionContext *octx;
+    GError *err = NULL;
+    gchar  *path;
+    guint   i;
+    gint    k, fd;
+    gboolean ok;
+
+    octx = g_option_context_new("- benchmark thetauvcsrc");
+    g_option_context_add_main_entries(octx, bench_options, NULL);
+    g_option_context_add_group(octx, gst_init_get_option_group());
+    if (!g_option_context_parse(octx, &argc, &argv, &err)) {
+	g_printerr("%s\n", err->message);
+	return 1;
+    }
+    g_option_context_free(octx);
+
+    if (bench_duration <= 0 || bench_warmup < 0 || bench_cameras < 0
+	|| bench_speed < 0
+	|| (bench_mode != NULL && g_ascii_strcasecmp(bench_mode, "2K") != 0
+	    && g_ascii_strcasecmp(bench_mode, "4K") != 0)) {
+	g_printerr("bad arguments, see --help\n");
+	return 1;
+    }
+
+    if (!gst_element_register(NULL, "thetauvcsrc", GST_RANK_NONE,
+	    GST_TYPE_THETAUVCSRC))
+	return 1;
+    capture_caps = gst_caps_new_empty_simple(GST_THETAUVCSRC_CAPTURE_CAPS);
+
+    g_print("%-4s %4s %8s %7s %8s %8s %7s %7s %7s %7s %7s %7s %7s %7s "
+	"%6s %6s\n", "mode", "cams", "frames", "fps/cam", "MB/s", "cb MB/s",
+	"p50", "p90", "p99", "p99.9", "max", "alloc/f", "wait/f", "block/f",
+	"drops", "late");
+
+    ok = TRUE;
+    for (k = 0; ok && k < 2; k++) {
+	const gchar *label = k == 0 ? "2K" : "4K";
+
+	if (bench_log != NULL) {
+	    if (k > 0)
+		break;
+	    path = g_strdup(bench_log);
+	    label = "log";
+	} else {
+	    if (bench_mode != NULL && g_ascii_strcasecmp(bench_mode, label))
+		continue;
+	    fd = g_file_open_tmp("thetauvcbench-XXXXXX.log", &path, &err);
+	    if (fd < 0) {
+		g_printerr("%s\n", err->message);
+		return 1;
+	    }
+	    g_close(fd, NULL);
+	    if (!bench_write_log(path, k == 0 ? THETAUVC_MODE_FHD :
+		    THETAUVC_MODE_UHD, k == 0 ? bench_bitrate_2k :
+		    bench_bitrate_4k)) {
+		g_printerr("could not write %s\n", path);
+		g_unlink(path);
+		return 1;
+	    }
+	}
+
+	if (bench_cameras > 0) {
+	    ok = bench_run(path, label, bench_cameras);
+	} else {
+	    for (i = 0; ok && i < G_N_ELEMENTS(camera_counts); i++)
+		ok = bench_run(path, label, camera_counts[i]);
+	}
+
+	if (bench_log == NULL)
+	    g_unlink(path);
+	g_free(path);
+    }
+
+    gst_caps_unref(capture_caps);
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2020-2022 K. Takeo. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ * 3. Neither the name of the author nor other contributors may be
+ * used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#include "thetauvch264.h"
+
+/* Return the next 00 00 01 start code at or after p, or end */
+static const uint8_t *
+find_start_code(const uint8_t * p, const uint8_t * end)
+{
+    while (p + 3 <= end) {
+	if (p[2] > 1)
+	    p += 3;
+	else if (p[2] == 0)
+	    p++;
+	else {
+	    if (p[0] == 0 && p[1] == 0)
+		return p;
+	    p += 3;
+	}
+    }
+
+    return end;
+}
+
+/* Size of the NAL unit at p, up to the next start code without the
+ * trailing zero bytes */
+static size_t
+nal_size(const uint8_t * p, const uint8_t * next)
+{
+    while (next > p && next[-1] == 0)
+	next--;
+
+    return next - p;
+}
+
+/*
+ * Scan the NAL units of an access unit in byte-stream format.  Scanning
+ * stops at the first slice, the rest of the frame is slice data of the
+ * same picture.  Returns the THETAUVC_H264_FLAG_* found.
+ */
+unsigned int
+thetauvc_h264_scan(const uint8_t * data, size_t size,
+		   thetauvc_h264_info_t * info)
+{
+    const uint8_t *p, *next, *end;
+    unsigned int flags, type;
+
+    flags = 0;
+    end = data + size;
+
+    for (p = find_start_code(data, end); p < end; p = next) {
+	p += 3;
+	if (p >= end)
+	    break;
+
+	type = *p & 0x1f;
+	switch (type) {
+	case THETAUVC_H264_NAL_SPS:
+	    if (info != NULL && !(flags & THETAUVC_H264_FLAG_SPS)) {
+		next = find_start_code(p, end);
+		info->sps_offset = p - data;
+		info->sps_size = nal_size(p, next);
+	    }
+	    flags |= THETAUVC_H264_FLAG_SPS;
+	    break;
+	case THETAUVC_H264_NAL_PPS:
+	    if (info != NULL && !(flags & THETAUVC_H264_FLAG_PPS)) {
+		next = find_start_code(p, end);
+		info->pps_offset = p - data;
+		info->pps_size = nal_size(p, next);
+	    }
+	    flags |= THETAUVC_H264_FLAG_PPS;
+	    break;
+	case THETAUVC_H264_NAL_IDR:
+	    flags |= THETAUVC_H264_FLAG_IDR;
+	    /* FALLTHROUGH */
+	case THETAUVC_H264_NAL_SLICE:
+	case 2:
+	case 3:
+	case 4:
+	    flags |= THETAUVC_H264_FLAG_SLICE;
+	    break;
+	default:
+	    break;
+	}
+
+	if (flags & THETAUVC_H264_FLAG_SLICE)
+	    break;
+
+	next = find_start_code(p, end);
+    }
+
+    if (info != NULL)
+	info->flags = flags;
+
+    return flags;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2020-2022 K. Takeo. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ * 3. Neither the name of the author nor other contributors may be
+ * used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if !defined(__THETAUVC_H264_H__)
+#define __THETAUVC_H264_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#define THETAUVC_H264_NAL_SLICE 1
+#define THETAUVC_H264_NAL_IDR 5
+#define THETAUVC_H264_NAL_SEI 6
+#define THETAUVC_H264_NAL_SPS 7
+#define THETAUVC_H264_NAL_PPS 8
+#define THETAUVC_H264_NAL_AUD 9
+
+#define THETAUVC_H264_FLAG_IDR (1 << 0)
+#define THETAUVC_H264_FLAG_SPS (1 << 1)
+#define THETAUVC_H264_FLAG_PPS (1 << 2)
+#define THETAUVC_H264_FLAG_SLICE (1 << 3)
+
+struct thetauvc_h264_info
+{
+    unsigned int flags;
+    /* NAL units without start code, valid if the flag is set */
+    size_t  sps_offset, sps_size;
+    size_t  pps_offset, pps_size;
+};
+
+typedef struct thetauvc_h264_info thetauvc_h264_info_t;
+
+extern unsigned int thetauvc_h264_scan(const uint8_t *, size_t,
+	thetauvc_h264_info_t *);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif
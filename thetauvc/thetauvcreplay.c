@@ -0,0 +1,524 @@
+/*
+ * Copyright 2020-2022 K. Takeo. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ * 3. Neither the name of the author nor other contributors may be
+ * used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Frame logs of a THETA stream and their replay.
+ *
+ * A log is a header followed by one record per frame, all numbers in
+ * little endian:
+ *
+ *   header: "THETALOG", version (u32), USB product id, width, height,
+ *           reserved (u16 each), frame interval in 100ns (u32)
+ *   record: payload size (u32), sequence (u32), arrival time in ns
+ *           since the first frame (u64), payload
+ *
+ * The replay calls the frame callback from a thread of its own, as
+ * libuvc does, at the recorded pace divided by a speed factor or as fast
+ * as possible.  A NULL frame is passed once the log is over.  A key frame
+ * request skips ahead to the next IDR frame, which is played at once.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+#include "libuvc/libuvc.h"
+#include "thetauvc.h"
+#include "thetauvch264.h"
+#include "thetauvcreplay.h"
+
+#define LOG_MAGIC "THETALOG"
+#define LOG_MAGIC_SIZE 8
+#define LOG_VERSION 1
+#define LOG_HEADER_SIZE 24
+#define LOG_RECORD_SIZE 16
+
+struct thetauvc_replay
+{
+    FILE   *fp;
+    uint16_t pid;
+    thetauvc_mode_t mode;
+    uint32_t interval;
+
+    double  speed;
+    int     loop;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int     running;
+    int     stop;
+    int     key_request;
+
+    uvc_frame_callback_t *cb;
+    void   *user_ptr;
+
+    /* protected by lock */
+    thetauvc_replay_stats_t stats;
+};
+
+struct thetauvc_recorder
+{
+    FILE   *fp;
+    int     started;
+    uint64_t first;
+};
+
+static void
+put_le64(uint8_t * p, uint64_t v)
+{
+    thetauvc_put_le32(p, v);
+    thetauvc_put_le32(p + 4, v >> 32);
+}
+
+static uint16_t
+get_le16(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+get_le32(const uint8_t * p)
+{
+    return get_le16(p) | ((uint32_t) get_le16(p + 2) << 16);
+}
+
+static uint64_t
+get_le64(const uint8_t * p)
+{
+    return get_le32(p) | ((uint64_t) get_le32(p + 4) << 32);
+}
+
+static void
+timespec_add_ns(struct timespec *ts, uint64_t ns)
+{
+    ns += ts->tv_nsec;
+    ts->tv_sec += ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+static uint64_t
+timespec_to_ns(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+/* a - b, a must not be earlier than b */
+static uint64_t
+timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (uint64_t) (a->tv_sec - b->tv_sec) * 1000000000
+	+ a->tv_nsec - b->tv_nsec;
+}
+
+uvc_error_t
+thetauvc_replay_open(const char *path, thetauvc_replay_t ** replay)
+{
+    thetauvc_replay_t *r;
+    pthread_condattr_t attr;
+    uint8_t hdr[LOG_HEADER_SIZE];
+    FILE   *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	return UVC_ERROR_NOT_FOUND;
+
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1
+	|| memcmp(hdr, LOG_MAGIC, LOG_MAGIC_SIZE) != 0
+	|| get_le32(hdr + 8) != LOG_VERSION || get_le32(hdr + 20) == 0) {
+	fclose(fp);
+	return UVC_ERROR_INVALID_PARAM;
+    }
+
+    r = calloc(1, sizeof(thetauvc_replay_t));
+    if (r == NULL) {
+	fclose(fp);
+	return UVC_ERROR_NO_MEM;
+    }
+
+    r->fp = fp;
+    r->pid = get_le16(hdr + 12);
+    r->mode.mode = THETAUVC_MODE_NUM;
+    r->mode.width = get_le16(hdr + 14);
+    r->mode.height = get_le16(hdr + 16);
+    r->interval = get_le32(hdr + 20);
+    r->mode.fps = 10000000 / r->interval;
+    r->speed = 1.0;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&r->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    *replay = r;
+
+    return UVC_SUCCESS;
+}
+
+void
+thetauvc_replay_close(thetauvc_replay_t * r)
+{
+    thetauvc_replay_stop(r);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    fclose(r->fp);
+    free(r);
+}
+
+void
+thetauvc_replay_get_format(thetauvc_replay_t * r, uint16_t * pid,
+			   thetauvc_mode_t * mode, uint32_t * interval)
+{
+    *pid = r->pid;
+    *mode = r->mode;
+    *interval = r->interval;
+}
+
+/* speed 1.0 is real time, 0 as fast as possible */
+void
+thetauvc_replay_set_speed(thetauvc_replay_t * r, double speed, int loop)
+{
+    r->speed = speed;
+    r->loop = loop;
+}
+
+/* Read the next record into frame, reallocating the payload as libuvc
+ * does.  Returns 0 at the end of the log. */
+static int
+replay_read(thetauvc_replay_t * r, uvc_frame_t * frame, uint32_t * seq,
+	    uint64_t * arrival)
+{
+    uint8_t rec[LOG_RECORD_SIZE];
+    uint32_t size;
+    void   *data;
+
+    if (fread(rec, sizeof(rec), 1, r->fp) != 1)
+	return 0;
+
+    size = get_le32(rec);
+    *seq = get_le32(rec + 4);
+    *arrival = get_le64(rec + 8);
+
+    if (frame->data == NULL || frame->data_bytes != size) {
+	if ((data = realloc(frame->data, size ? size : 1)) == NULL)
+	    return 0;
+	frame->data = data;
+	frame->data_bytes = size;
+    }
+
+    return size == 0 || fread(frame->data, size, 1, r->fp) == 1;
+}
+
+/* Sleep until due, returns non-zero if the replay is being stopped */
+static int
+replay_wait(thetauvc_replay_t * r, const struct timespec *due)
+{
+    int     stop;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stop
+	   && pthread_cond_timedwait(&r->cond, &r->lock, due) != ETIMEDOUT);
+    stop = r->stop;
+    pthread_mutex_unlock(&r->lock);
+
+    return stop;
+}
+
+static void *
+replay_thread(void *arg)
+{
+    thetauvc_replay_t *r = arg;
+    uvc_frame_t frame;
+    struct timespec start, due, t0, t1;
+    uint64_t arrival, first, last, offset, elapsed;
+    size_t  size;
+    uint32_t seq, first_seq, last_seq, seq_offset;
+    int     has_first, stopped, key_request;
+    thetauvc_h264_info_t info;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.width = r->mode.width;
+    frame.height = r->mode.height;
+    frame.frame_format = UVC_FRAME_FORMAT_H264;
+    frame.library_owns_data = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    first = last = offset = 0;
+    first_seq = last_seq = seq_offset = 0;
+    has_first = 0;
+    stopped = 0;
+
+    for (;;) {
+	if (!replay_read(r, &frame, &seq, &arrival)) {
+	    /* no IDR frame up to the end */
+	    pthread_mutex_lock(&r->lock);
+	    r->key_request = 0;
+	    pthread_mutex_unlock(&r->lock);
+
+	    if (!r->loop || !has_first
+		|| fseek(r->fp, LOG_HEADER_SIZE, SEEK_SET) != 0)
+		break;
+
+	    /* the next round follows one frame interval after the last */
+	    offset += last - first + (uint64_t) r->interval * 100;
+	    seq_offset += last_seq - first_seq + 1;
+	    continue;
+	}
+
+	if (!has_first) {
+	    first = arrival;
+	    first_seq = seq;
+	    has_first = 1;
+	}
+
+	pthread_mutex_lock(&r->lock);
+	key_request = r->key_request;
+	pthread_mutex_unlock(&r->lock);
+	if (key_request) {
+	    if (!(thetauvc_h264_scan(frame.data, frame.data_bytes, &info)
+		  & THETAUVC_H264_FLAG_IDR)) {
+		/* the sequence goes on without the skipped frames */
+		seq_offset--;
+		last = arrival;
+		last_seq = seq;
+		continue;
+	    }
+
+	    pthread_mutex_lock(&r->lock);
+	    r->key_request = 0;
+	    pthread_mutex_unlock(&r->lock);
+
+	    /* move the start so that this frame is due now */
+	    if (r->speed > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		elapsed = (uint64_t) ((offset + arrival - first) / r->speed);
+		if (timespec_to_ns(&t0) > elapsed) {
+		    start.tv_sec = start.tv_nsec = 0;
+		    timespec_add_ns(&start, timespec_to_ns(&t0) - elapsed);
+		}
+	    }
+	}
+
+	if (r->speed > 0) {
+	    due = start;
+	    timespec_add_ns(&due,
+		(uint64_t) ((offset + arrival - first) / r->speed));
+	    stopped = replay_wait(r, &due);
+	} else {
+	    pthread_mutex_lock(&r->lock);
+	    stopped = r->stop;
+	    pthread_mutex_unlock(&r->lock);
+	}
+	if (stopped)
+	    break;
+
+	frame.sequence = seq_offset + seq - first_seq;
+	/* the callback may take the data */
+	size = frame.data_bytes;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	r->cb(&frame, r->user_ptr);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	pthread_mutex_lock(&r->lock);
+	r->stats.frames++;
+	r->stats.bytes += size;
+	r->stats.callback_ns += timespec_diff_ns(&t1, &t0);
+	if (r->speed > 0) {
+	    elapsed = timespec_diff_ns(&t0, &start);
+	    if (elapsed > (uint64_t) ((offset + arrival - first) / r->speed)
+		+ (uint64_t) r->interval * 100)
+		r->stats.late++;
+	}
+	pthread_mutex_unlock(&r->lock);
+
+	last = arrival;
+	last_seq = seq;
+    }
+
+    free(frame.data);
+    if (!stopped)
+	r->cb(NULL, r->user_ptr);
+
+    return NULL;
+}
+
+/* Skip ahead to the next IDR frame and deliver it right away */
+uvc_error_t
+thetauvc_replay_request_key_frame(thetauvc_replay_t * r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->key_request = 1;
+    pthread_mutex_unlock(&r->lock);
+
+    return UVC_SUCCESS;
+}
+
+/* Counters since the replay was opened */
+void
+thetauvc_replay_get_stats(thetauvc_replay_t * r,
+			  thetauvc_replay_stats_t * stats)
+{
+    pthread_mutex_lock(&r->lock);
+    *stats = r->stats;
+    pthread_mutex_unlock(&r->lock);
+}
+
+uvc_error_t
+thetauvc_replay_start(thetauvc_replay_t * r, uvc_frame_callback_t * cb,
+		      void *user_ptr)
+{
+    if (r->running)
+	return UVC_ERROR_BUSY;
+
+    if (fseek(r->fp, LOG_HEADER_SIZE, SEEK_SET) != 0)
+	return UVC_ERROR_IO;
+
+    r->cb = cb;
+    r->user_ptr = user_ptr;
+    r->stop = 0;
+    if (pthread_create(&r->thread, NULL, replay_thread, r) != 0)
+	return UVC_ERROR_OTHER;
+    r->running = 1;
+
+    return UVC_SUCCESS;
+}
+
+void
+thetauvc_replay_stop(thetauvc_replay_t * r)
+{
+    if (!r->running)
+	return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    r->running = 0;
+}
+
+static uvc_error_t
+backend_replay_start(void *handle, uvc_stream_ctrl_t * ctrl,
+		     uvc_frame_callback_t * cb, void *user_ptr)
+{
+    return thetauvc_replay_start((thetauvc_replay_t *) handle, cb, user_ptr);
+}
+
+static void
+backend_replay_stop(void *handle)
+{
+    thetauvc_replay_stop((thetauvc_replay_t *) handle);
+}
+
+static uvc_error_t
+backend_replay_request_key_frame(void *handle)
+{
+    return thetauvc_replay_request_key_frame((thetauvc_replay_t *) handle);
+}
+
+const thetauvc_backend_t thetauvc_backend_replay = {
+    .name = "replay",
+    .start_streaming = backend_replay_start,
+    .stop_streaming = backend_replay_stop,
+    .request_key_frame = backend_replay_request_key_frame,
+};
+
+uvc_error_t
+thetauvc_recorder_open(const char *path, uint16_t pid,
+		       const thetauvc_mode_t * mode, uint32_t interval,
+		       thetauvc_recorder_t ** recorder)
+{
+    thetauvc_recorder_t *rec;
+    uint8_t hdr[LOG_HEADER_SIZE];
+    FILE   *fp;
+
+    if ((fp = fopen(path, "wb")) == NULL)
+	return UVC_ERROR_ACCESS;
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, LOG_MAGIC, LOG_MAGIC_SIZE);
+    thetauvc_put_le32(hdr + 8, LOG_VERSION);
+    thetauvc_put_le16(hdr + 12, pid);
+    thetauvc_put_le16(hdr + 14, mode->width);
+    thetauvc_put_le16(hdr + 16, mode->height);
+    thetauvc_put_le32(hdr + 20, interval);
+
+    if (fwrite(hdr, sizeof(hdr), 1, fp) != 1) {
+	fclose(fp);
+	return UVC_ERROR_IO;
+    }
+
+    rec = calloc(1, sizeof(thetauvc_recorder_t));
+    if (rec == NULL) {
+	fclose(fp);
+	return UVC_ERROR_NO_MEM;
+    }
+    rec->fp = fp;
+    *recorder = rec;
+
+    return UVC_SUCCESS;
+}
+
+/* arrival is the host time of the frame in ns, any epoch */
+uvc_error_t
+thetauvc_recorder_write(thetauvc_recorder_t * rec, const uvc_frame_t * frame,
+			uint64_t arrival)
+{
+    uint8_t hdr[LOG_RECORD_SIZE];
+
+    if (!rec->started) {
+	rec->first = arrival;
+	rec->started = 1;
+    }
+
+    thetauvc_put_le32(hdr, frame->data_bytes);
+    thetauvc_put_le32(hdr + 4, frame->sequence);
+    put_le64(hdr + 8, arrival - rec->first);
+
+    if (fwrite(hdr, sizeof(hdr), 1, rec->fp) != 1
+	|| (frame->data_bytes > 0
+	    && fwrite(frame->data, frame->data_bytes, 1, rec->fp) != 1))
+	return UVC_ERROR_IO;
+
+    return UVC_SUCCESS;
+}
+
+void
+thetauvc_recorder_close(thetauvc_recorder_t * rec)
+{
+    fclose(rec->fp);
+    free(rec);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2020-2022 K. Takeo. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following
+ * disclaimer in the documentation and/or other materials provided
+ * with the distribution.
+ * 3. Neither the name of the author nor other contributors may be
+ * used to endorse or promote products derived from this software
+ * without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if !defined(__THETAUVC_REPLAY_H__)
+#define __THETAUVC_REPLAY_H__
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+typedef struct thetauvc_replay thetauvc_replay_t;
+typedef struct thetauvc_recorder thetauvc_recorder_t;
+typedef struct thetauvc_replay_stats thetauvc_replay_stats_t;
+
+struct thetauvc_replay_stats
+{
+    uint64_t frames;
+    uint64_t bytes;
+    /* time spent in the frame callback */
+    uint64_t callback_ns;
+    /* frames delivered more than a frame interval behind the recording */
+    uint64_t late;
+};
+
+/* handle is a thetauvc_replay_t, the stream control is not used */
+extern const thetauvc_backend_t thetauvc_backend_replay;
+
+extern uvc_error_t thetauvc_replay_open(const char *, thetauvc_replay_t **);
+extern void thetauvc_replay_close(thetauvc_replay_t *);
+extern void thetauvc_replay_get_format(thetauvc_replay_t *, uint16_t *,
+	thetauvc_mode_t *, uint32_t *);
+extern void thetauvc_replay_set_speed(thetauvc_replay_t *, double, int);
+extern void thetauvc_replay_get_stats(thetauvc_replay_t *,
+	thetauvc_replay_stats_t *);
+extern uvc_error_t thetauvc_replay_start(thetauvc_replay_t *,
+	uvc_frame_callback_t *, void *);
+extern void thetauvc_replay_stop(thetauvc_replay_t *);
+extern uvc_error_t thetauvc_replay_request_key_frame(thetauvc_replay_t *);
+
+extern uvc_error_t thetauvc_recorder_open(const char *, uint16_t,
+	const thetauvc_mode_t *, uint32_t, thetauvc_recorder_t **);
+extern uvc_error_t thetauvc_recorder_write(thetauvc_recorder_t *,
+	const uvc_frame_t *, uint64_t);
+extern void thetauvc_recorder_close(thetauvc_recorder_t *);
+
+#if defined(__cplusplus)
+}
+#endif
+#endif